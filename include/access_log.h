@@ -0,0 +1,37 @@
+#ifndef ACCESS_LOG_H
+#define ACCESS_LOG_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define ACCESS_LOG_RING_SIZE 512              // Entries buffered per thread, power of two
+#define ACCESS_LOG_FLUSH_MS 100               // Drain interval
+#define ACCESS_LOG_MAX_FILE_SIZE (64L << 20)  // Rotate once the file grows past this
+#define ACCESS_LOG_MAX_FILES 5                // Current file plus rotated .1 to .4
+
+// One completed request
+typedef struct {
+  int64_t timestamp;   // Wall clock, seconds since the epoch
+  uint64_t latency_us; // From reading the request to closing the connection
+  size_t bytes;        // Response bytes written
+  int status;
+  char method[16];
+  char path[256];
+  char client_ip[46];
+} access_log_entry_t;
+
+// Open the log file and start the background writer
+int access_log_init(const char *path);
+
+// Write out everything still buffered, then stop the writer and close the file
+void access_log_shutdown(void);
+
+// Queue an entry from any thread without blocking. Each thread appends to its
+// own ring; when that ring is full the entry is counted as dropped.
+void access_log_record(const access_log_entry_t *entry);
+
+// Entries dropped because a ring was full
+uint64_t access_log_dropped(void);
+
+#endif // ACCESS_LOG_H
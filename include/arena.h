@@ -0,0 +1,34 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+#define ARENA_ALIGNMENT 16
+#define ARENA_BLOCK_SIZE 16384 // Overflow block size once the initial buffer is full
+
+typedef struct arena_block arena_block_t;
+
+// Bump-pointer allocator. Allocations are never freed individually; the
+// whole arena is rewound at once. Starts in a caller-provided buffer and only
+// falls back to malloc'd blocks when that runs out. Not thread-safe: use it
+// from one thread at a time.
+typedef struct {
+  char *cursor;
+  char *end;
+  char *initial; // Caller-provided buffer
+  size_t initial_size;
+  arena_block_t *blocks; // Overflow blocks, newest first
+} arena_t;
+
+void arena_init(arena_t *arena, void *buffer, size_t size);
+
+// Allocate size bytes aligned to ARENA_ALIGNMENT; NULL if out of memory
+void *arena_alloc(arena_t *arena, size_t size);
+
+// Copy length bytes of data into the arena and NUL-terminate them
+char *arena_strndup(arena_t *arena, const char *data, size_t length);
+
+// Free overflow blocks and rewind to the start of the initial buffer
+void arena_reset(arena_t *arena);
+
+#endif // ARENA_H
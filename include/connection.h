@@ -0,0 +1,125 @@
+#ifndef CONNECTION_H
+#define CONNECTION_H
+
+#include "access_log.h"
+#include "arena.h"
+#include "event_loop.h"
+#include "thread_pool.h"
+#include "trace.h"
+#include <openssl/ssl.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#define CONNECTION_ARENA_SIZE 8192 // Inline arena space, enough for a typical request
+#define CONNECTION_READ_BUFFER_SIZE 4096
+#define CONNECTION_WRITE_BUFFER_SIZE 4096 // Response headers and small body writes
+#define CONNECTION_WRITE_TIMEOUT_MS 30000 // Give up on a client that stops reading
+
+// Deadlines, measured from accept unless noted. A client that misses one is
+// disconnected; until the request head is complete that happens on the
+// event loop, without a worker thread.
+#define CONNECTION_IDLE_TIMEOUT_MS 5000     // First request byte (or TLS handshake byte)
+#define CONNECTION_HEADER_TIMEOUT_MS 10000  // Complete request head, TLS handshake included
+#define CONNECTION_BODY_TIMEOUT_MS 30000    // Whole body, from the first read of it
+#define CONNECTION_REQUEST_TIMEOUT_MS 60000 // Every read and plain-socket write wait
+#define CONNECTION_MIN_BODY_RATE 1024       // Bytes per second a body has to keep up
+#define CONNECTION_RATE_GRACE_MS 2000       // Before the minimum rate applies
+
+// Client connection. Reference counted so a handler can keep it open after
+// returning (for example while waiting on an asynchronous database call):
+// the connection is closed when the last reference is released. Connections
+// come from a slab preallocated by connection_pool_init() and go back to it
+// on release, buffers included.
+typedef struct connection {
+  int client_fd;
+  char client_ip[46];
+  uint32_t client_addr; // IPv4, host byte order
+  bool conn_limited;    // Counted against the per-client limit until closed
+  SSL_CTX *ssl_ctx;     // NULL for HTTP, non-NULL for HTTPS
+  SSL *ssl;
+  bool tls_ready;      // TLS handshake has completed
+  event_watch_t watch; // Readiness events while owned by the event loop
+  event_timer_t timer; // Idle or header deadline while owned by the event loop
+  atomic_int refcount;
+  int route;              // Index of the matched route, -1 if none
+  trace_t trace;          // Stage timestamps
+  access_log_entry_t log; // Filled in while handling; written out on release
+  arena_t arena;          // Request allocations, released with the connection
+  bool pooled;            // Slab slot rather than an overflow heap allocation
+  bool expect_continue;   // Send 100 Continue before reading the request body
+  size_t read_length;     // Request bytes in read_buffer when handed to a worker
+  uint64_t accepted_ns;   // Deadlines count from here
+  uint64_t body_start_ns; // First body read, 0 before it
+  size_t body_received;   // Bytes read from the socket since body_start_ns
+  // Reused buffers; left uninitialized between connections
+  _Alignas(ARENA_ALIGNMENT) unsigned char arena_buffer[CONNECTION_ARENA_SIZE];
+  char read_buffer[CONNECTION_READ_BUFFER_SIZE];
+  char write_buffer[CONNECTION_WRITE_BUFFER_SIZE];
+} connection_t;
+
+typedef struct {
+  size_t capacity; // Slab slots
+  size_t in_use;   // Connections currently open, slab and overflow
+  size_t overflow; // Connections allocated on the heap because the slab was empty
+} connection_pool_stats_t;
+
+// Recover the connection from its embedded event watch or timer
+#define connection_from_watch(w) ((connection_t *) ((char *) (w) - offsetof(connection_t, watch)))
+#define connection_from_timer(t) ((connection_t *) ((char *) (t) - offsetof(connection_t, timer)))
+
+// Account a response in the connection's access log entry
+static inline void connection_note_response(connection_t *conn, int status, size_t bytes) {
+  if (conn) {
+    conn->log.status = status;
+    conn->log.bytes += bytes;
+  }
+}
+
+// Preallocate and prefault a slab of capacity connections. Without it (or
+// once it is exhausted) connections are allocated on the heap.
+int connection_pool_init(size_t capacity);
+
+// Release the slab. Left mapped if connections are still open.
+void connection_pool_destroy(void);
+
+connection_pool_stats_t connection_pool_stats(void);
+
+// Read raw bytes from the client, decrypting on TLS connections. Waits at
+// most until the body deadline, and gives up on a client sending slower than
+// CONNECTION_MIN_BODY_RATE; either way it fails with errno set to ETIMEDOUT.
+ssize_t connection_read(connection_t *conn, void *buf, size_t size);
+
+// Write all of iov, encrypting on TLS connections. When the socket buffer
+// is full this waits for the client to drain it, up to
+// CONNECTION_WRITE_TIMEOUT_MS and, on plain sockets, no later than the
+// request deadline. Returns the bytes written or -1.
+ssize_t connection_writev(connection_t *conn, const struct iovec *iov, int iovcnt);
+
+// http_body_source_t reading the request body from a connection (ctx).
+// Answers Expect: 100-continue before the first read.
+ssize_t connection_body_source(void *ctx, void *buf, size_t size);
+
+// HTTP worker pool for connection_run_on_worker()
+void connection_set_worker_pool(thread_pool_t *pool);
+
+// Queue fn(arg) on the HTTP worker pool, waiting while its queue is full.
+// Work completed on another executor hands its response back this way, so
+// that executor never blocks writing to a slow client. Runs fn inline when
+// no pool is set; returns false if the pool is shutting down.
+bool connection_run_on_worker(void (*fn)(void *), void *arg);
+
+// Create a connection holding one reference
+connection_t *connection_create(int client_fd, const char *client_ip, SSL_CTX *ssl_ctx);
+
+// Take an additional reference
+connection_t *connection_retain(connection_t *conn);
+
+// Drop a reference; the last one logs the request, then shuts down and
+// closes the socket
+void connection_release(connection_t *conn);
+
+#endif // CONNECTION_H
@@ -2,6 +2,13 @@
 #define DB_H
 
 #include <sqlite3.h>
+#include <stdbool.h>
+
+// Pooled connections, each with its own prepared statement cache
+#define DB_POOL_SIZE 8
+
+// Returned when the password hashing executor is saturated; retry later
+#define DB_BUSY -2
 
 int db_init(const char *db_path);
 void db_close(void);
@@ -9,4 +16,17 @@ int db_create_user(const char *username, const char *password);
 int db_verify_user(const char *username, const char *password);
 sqlite3 *db_get_connection(void);
 
+// Asynchronous API: the call runs on a dedicated database executor and the
+// callback receives the same result the synchronous call would return. The
+// callback runs on an executor thread (or inline if db_async_init was not
+// called). Returns false without calling the callback if the queue is full.
+typedef void (*db_callback_t)(int result, void *user_data);
+
+int db_async_init(int thread_count, int queue_size);
+void db_async_shutdown(void);
+bool db_create_user_async(const char *username, const char *password, db_callback_t callback,
+                          void *user_data);
+bool db_verify_user_async(const char *username, const char *password, db_callback_t callback,
+                          void *user_data);
+
 #endif // DB_H
@@ -0,0 +1,57 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Readiness notification for one file descriptor. Embed it in the owning
+// object and recover the owner in the handler.
+typedef struct event_watch {
+  int fd;
+  void (*handler)(struct event_watch *watch, uint32_t events);
+  bool registered; // Set before the fd is added to epoll, never after
+} event_watch_t;
+
+// Deadline on the event loop, embedded in its owner like a watch. The
+// handler runs on the loop thread once the deadline has passed, so it is
+// serialized with the owner's watch handler.
+typedef struct event_timer {
+  uint64_t deadline_ns; // Monotonic, see timing_now_ns()
+  void (*handler)(struct event_timer *timer);
+  size_t slot; // Position in the loop's heap + 1, 0 while not armed
+} event_timer_t;
+
+// epoll-based reactor running on its own thread. Watches are one-shot: after
+// the handler runs, the fd stays silent until it is watched again, so a
+// handler never races with another event for the same fd.
+typedef struct {
+  int epoll_fd;
+  int wake_fd; // eventfd used to interrupt epoll_wait on shutdown
+  pthread_t thread;
+  bool running;
+  volatile bool shutdown;
+  pthread_mutex_t timer_lock;
+  event_timer_t **timers; // Binary min-heap on deadline_ns
+  size_t timer_count;
+  size_t timer_capacity;
+} event_loop_t;
+
+event_loop_t *event_loop_create(void);
+int event_loop_start(event_loop_t *loop);
+void event_loop_destroy(event_loop_t *loop);
+
+// Arm a watch for EPOLLIN and/or EPOLLOUT; safe to call from any thread
+int event_loop_watch(event_loop_t *loop, event_watch_t *watch, uint32_t events);
+
+// Stop watching the fd (before handing it to another thread or closing it)
+void event_loop_unwatch(event_loop_t *loop, event_watch_t *watch);
+
+// Arm a timer, or move it if already armed; safe to call from any thread
+int event_loop_timer_set(event_loop_t *loop, event_timer_t *timer, uint64_t deadline_ns);
+
+// Disarm a timer; a no-op if it is not armed
+void event_loop_timer_cancel(event_loop_t *loop, event_timer_t *timer);
+
+#endif // EVENT_LOOP_H
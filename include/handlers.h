@@ -1,6 +1,7 @@
 #ifndef HANDLERS_H
 #define HANDLERS_H
 
+#include "connection.h"
 #include "http.h"
 #include "router.h"
 
@@ -10,6 +11,13 @@ void handle_dashboard(int client_fd, const http_request_t *request, const route_
 void handle_register(int client_fd, const http_request_t *request, const route_params_t *params);
 void handle_login(int client_fd, const http_request_t *request, const route_params_t *params);
 void handle_logout(int client_fd, const http_request_t *request, const route_params_t *params);
+void handle_metrics(int client_fd, const http_request_t *request, const route_params_t *params);
+
+// Router error responses, sent like any other response so they work over TLS
+void handle_error(int client_fd, const http_request_t *request, const char *status_line);
+
+// 503 for a request the server has no capacity for right now
+void send_busy(connection_t *conn);
 
 // Middleware
 bool logging_middleware(int client_fd, const http_request_t *request);
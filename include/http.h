@@ -1,27 +1,151 @@
 #ifndef HTTP_H
 #define HTTP_H
 
+#include "arena.h"
 #include <openssl/ssl.h>
+#include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+struct connection;
 
 #define MAX_HEADERS 32
 #define MAX_HEADER_SIZE 1024
 
+// http_parse_head() result besides 0 and -1 (malformed)
+#define HTTP_HEAD_TOO_LARGE -2 // More than MAX_HEADERS, or a name or value too long
+
+// http_read_body() results besides 0
+#define HTTP_BODY_ERROR -1     // Malformed framing or the connection failed
+#define HTTP_BODY_TOO_LARGE -2 // Larger than the caller's limit
+#define HTTP_BODY_TIMEOUT -3   // The source gave up on a slow client (ETIMEDOUT)
+
+typedef enum {
+  HTTP_BODY_NONE,    // No body
+  HTTP_BODY_LENGTH,  // Content-Length
+  HTTP_BODY_CHUNKED, // Transfer-Encoding: chunked
+} http_body_framing_t;
+
+// Reads more raw request bytes from the transport; returns 0 at end of
+// stream and -1 on error, like read()
+typedef ssize_t (*http_body_source_t)(void *ctx, void *buf, size_t size);
+
+// Body framing and decoding state. Body bytes come first from whatever
+// followed the headers in the initial read, then from the source.
+typedef struct {
+  http_body_framing_t framing;
+  uint64_t remaining; // Body bytes left (LENGTH) or bytes left in the current chunk (CHUNKED)
+  int chunk_state;
+  int chunk_digits;
+  bool done;
+  bool error;
+  bool timed_out; // The error was the source timing out
+  const char *pending; // Body bytes read along with the headers
+  size_t pending_length;
+  http_body_source_t source; // NULL when the request is entirely in memory
+  void *source_ctx;
+} http_body_t;
+
+// Headers the parser indexes as it goes, for constant-time lookup
+typedef enum {
+  HTTP_HEADER_UNKNOWN = -1,
+  HTTP_HEADER_HOST,
+  HTTP_HEADER_CONTENT_LENGTH,
+  HTTP_HEADER_CONNECTION,
+  HTTP_HEADER_AUTHORIZATION,
+  HTTP_HEADER_ACCEPT_ENCODING,
+  HTTP_HEADER_IF_NONE_MATCH,
+  HTTP_HEADER_TRANSFER_ENCODING,
+  HTTP_HEADER_COOKIE,
+  HTTP_HEADER_KNOWN_COUNT,
+} http_header_id_t;
+
+#define HTTP_FORM_MAX_FIELDS 32
+#define HTTP_FORM_SLOTS 64 // Hash slots, a power of two above HTTP_FORM_MAX_FIELDS
+
+typedef struct {
+  const char *name; // Decoded and NUL terminated, pointing into the parsed buffer
+  size_t name_length;
+  const char *value; // Decoded; may contain NULs, so use value_length
+  size_t value_length;
+  uint32_t hash;
+} http_form_field_t;
+
+// Index of an application/x-www-form-urlencoded body
+typedef struct {
+  http_form_field_t fields[HTTP_FORM_MAX_FIELDS];
+  size_t count;
+  uint8_t slots[HTTP_FORM_SLOTS]; // Field index + 1, 0 for empty
+} http_form_t;
+
 typedef struct {
   char method[16];
   char path[256];
   char version[16];
   char headers[MAX_HEADERS][2][MAX_HEADER_SIZE];
   int header_count;
-  char *body;
-  int body_length;
+  int8_t known_headers[HTTP_HEADER_KNOWN_COUNT]; // Index into headers + 1, 0 if absent
+  char *body; // Set once the body is buffered; NUL terminated, may contain NULs
+  size_t body_length;
+  http_body_t *body_stream; // NULL if the request has no body framing state
   char client_ip[46]; // IPv6 max length
   SSL *ssl;           // NULL for plain HTTP, non-NULL for HTTPS
+  struct connection *conn;
+  arena_t *arena; // Request-lifetime allocations, NULL to use malloc
 } http_request_t;
 
+// Parse a complete request held in memory, body included
 int http_parse_request(const char *raw_request, http_request_t *request);
+
+// Parse with the body (and anything else the request needs) allocated from
+// arena, so nothing has to be freed individually
+int http_parse_request_arena(const char *raw_request, http_request_t *request, arena_t *arena);
+
+// Parse the request line and headers from the first length bytes of raw,
+// which must include the blank line ending the headers and be followed by
+// a NUL. The body is not
+// read: bytes after the headers are kept as the start of the body stream
+// and must stay valid until the body has been consumed. arena may be NULL.
+// Returns 0, -1 if the head is malformed or HTTP_HEAD_TOO_LARGE.
+int http_parse_head(const char *raw, size_t length, http_request_t *request, arena_t *arena);
+
+// Where body bytes beyond those read with the headers come from
+void http_set_body_source(http_request_t *request, http_body_source_t source, void *ctx);
+
+// Read up to size decoded body bytes. Returns the number read, 0 at the end
+// of the body and -1 on malformed framing or transport errors.
+ssize_t http_body_read(const http_request_t *request, void *buf, size_t size);
+
+// Buffer the whole body into request->body. Returns 0, HTTP_BODY_TOO_LARGE
+// if it exceeds max_size bytes, HTTP_BODY_TIMEOUT or HTTP_BODY_ERROR.
+int http_read_body(http_request_t *request, size_t max_size);
+
 void http_free_request(http_request_t *request);
+
+// Scratch memory for handlers that lives until the response is finished and
+// the connection released. Returns NULL if the request has no arena.
+void *http_request_alloc(const http_request_t *request, size_t size);
+
+// Identify a well-known header name (case-insensitive)
+http_header_id_t http_header_classify(const char *name, size_t length);
+
+// Value of a well-known header, or NULL; the first one wins if repeated
+const char *http_get_known_header(const http_request_t *request, http_header_id_t id);
+
+// Any header by name. Well-known names take the indexed path.
 const char *http_get_header(const http_request_t *request, const char *name);
+
+// Decode a urlencoded body in one pass, in place, and index its fields.
+// data must have a byte to spare at data[length] (request bodies are NUL
+// terminated). Repeated names keep their first value; fields beyond
+// HTTP_FORM_MAX_FIELDS are ignored.
+int http_form_parse(http_form_t *form, char *data, size_t length);
+
+// Value of the named field, or NULL; *length (if not NULL) gets its length
+const char *http_form_get(const http_form_t *form, const char *name, size_t *length);
+
+// Look up a single field in a body without modifying it
 int http_parse_post_data(const char *body, const char *key, char *value, size_t value_size);
 
 #endif // HTTP_H
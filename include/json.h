@@ -0,0 +1,45 @@
+#ifndef JSON_H
+#define JSON_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define JSON_MAX_DEPTH 32
+
+// Streaming JSON writer into a caller-provided buffer. Never allocates:
+// output that does not fit sets the overflow flag and json_finish() fails.
+// Commas and nesting are tracked, so callers only emit keys and values.
+typedef struct {
+  char *buffer;
+  size_t capacity;
+  size_t length;
+  bool overflow;
+  bool after_key; // Next value completes a key-value pair
+  int depth;
+  uint32_t has_items; // Bit per nesting level: a comma is due before the next item
+} json_writer_t;
+
+void json_init(json_writer_t *json, char *buffer, size_t capacity);
+
+void json_object_begin(json_writer_t *json);
+void json_object_end(json_writer_t *json);
+void json_array_begin(json_writer_t *json);
+void json_array_end(json_writer_t *json);
+
+// Object key; the next call writes its value
+void json_key(json_writer_t *json, const char *key);
+
+// Values, escaped as needed. NULL strings are written as null.
+void json_string(json_writer_t *json, const char *value);
+void json_string_n(json_writer_t *json, const char *value, size_t length);
+void json_int(json_writer_t *json, long long value);
+void json_double(json_writer_t *json, double value); // null for NaN and infinities
+void json_bool(json_writer_t *json, bool value);
+void json_null(json_writer_t *json);
+
+// NUL-terminate the document; returns it, with its length in *length, or
+// NULL if it overflowed or is not closed
+const char *json_finish(json_writer_t *json, size_t *length);
+
+#endif // JSON_H
@@ -0,0 +1,39 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define METRICS_MAX_ROUTES 64    // Matches the router's route table
+#define METRICS_MAX_CALLBACKS 32 // Gauges and counters read at scrape time
+
+// Latency histograms are log-linear like HDR histograms: four sub-buckets per
+// power of two of microseconds (at most 25% relative error) up to 2^26 us
+// (about 67 seconds), plus an overflow bucket.
+#define METRICS_SUB_BUCKETS 4
+#define METRICS_MAX_EXPONENT 26
+#define METRICS_BUCKETS (METRICS_SUB_BUCKETS * (METRICS_MAX_EXPONENT - 1) + 1)
+
+typedef enum { METRIC_GAUGE, METRIC_COUNTER } metric_type_t;
+
+// Value sampled when /metrics is scraped
+typedef double (*metric_read_t)(void);
+
+// Count one finished request. route is the router's route id (-1 when no
+// route matched), status the response status (0 if none was sent). Updates
+// only the calling thread's counters, without locks or atomic read-modify-
+// write instructions.
+void metrics_record_request(int route, int status, uint64_t latency_us, size_t bytes);
+
+// Expose a value owned by another module. name must be a valid Prometheus
+// metric name; name and help must outlive the metrics module.
+int metrics_register(const char *name, const char *help, metric_type_t type, metric_read_t read);
+
+// Drop registered callbacks and zero every thread's counters
+void metrics_reset(void);
+
+// Aggregate all threads and render the Prometheus text exposition format.
+// Returns a malloc'd string the caller frees, or NULL.
+char *metrics_render(size_t *length);
+
+#endif // METRICS_H
@@ -0,0 +1,84 @@
+#ifndef MULTIPART_H
+#define MULTIPART_H
+
+#include "http.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+#define MULTIPART_BOUNDARY_MAX 70 // RFC 2046 limit
+#define MULTIPART_DELIMITER_MAX (MULTIPART_BOUNDARY_MAX + 5) // "\r\n--" + boundary + NUL
+#define MULTIPART_WINDOW_SIZE 8192 // Body bytes buffered while searching for a boundary
+#define MULTIPART_HEADER_SIZE 1024 // Headers of one part
+#define MULTIPART_SPOOL_MEMORY 4096 // Part bytes kept in memory before spilling to disk
+
+// Headers of one part
+typedef struct {
+  char name[128];         // Content-Disposition name
+  char filename[256];     // Content-Disposition filename, empty for plain fields
+  char content_type[128]; // Empty if the part has none
+} multipart_part_t;
+
+// Callbacks receive parts as they stream past. Returning non-zero from any
+// of them aborts parsing.
+typedef struct {
+  int (*on_part_begin)(void *ctx, const multipart_part_t *part);
+  int (*on_part_data)(void *ctx, const char *data, size_t length);
+  int (*on_part_end)(void *ctx);
+} multipart_callbacks_t;
+
+// Incremental multipart/form-data parser. Memory is fixed whatever the size
+// of the body: the delimiter is searched for Boyer-Moore-Horspool style
+// within a window of MULTIPART_WINDOW_SIZE bytes, and only the bytes that
+// could still start a delimiter are carried over between feeds.
+typedef struct {
+  int state;
+  char delimiter[MULTIPART_DELIMITER_MAX];
+  size_t delimiter_length;
+  size_t skip[256]; // Horspool shift per byte value
+  char window[MULTIPART_WINDOW_SIZE];
+  size_t window_length;
+  char header[MULTIPART_HEADER_SIZE];
+  size_t header_length;
+  multipart_part_t part;
+  multipart_callbacks_t callbacks;
+  void *ctx;
+} multipart_parser_t;
+
+// Collects one part's data: in memory up to MULTIPART_SPOOL_MEMORY bytes,
+// then in an unlinked temporary file. Or straight into a caller's fd.
+typedef struct {
+  int fd;         // Destination, or -1 while the data is in memory
+  bool temporary; // fd is a temp file owned by the spool
+  size_t length;  // Bytes written
+  char memory[MULTIPART_SPOOL_MEMORY];
+} multipart_spool_t;
+
+// Copy the boundary parameter of a multipart Content-Type header
+int multipart_boundary(const char *content_type, char *boundary, size_t size);
+
+// Set up a parser for a body with the given Content-Type. Returns -1 if it
+// is not multipart or has no valid boundary.
+int multipart_parser_init(multipart_parser_t *parser, const char *content_type,
+                          const multipart_callbacks_t *callbacks, void *ctx);
+
+// Feed the next body bytes; -1 on malformed input or an aborting callback
+int multipart_parser_feed(multipart_parser_t *parser, const char *data, size_t length);
+
+// Check that the body ended with the closing delimiter
+int multipart_parser_finish(multipart_parser_t *parser);
+
+// Stream the request body through a parser. Works for routes that buffer
+// the body as well as for ROUTE_BODY_STREAMED ones.
+int multipart_read(const http_request_t *request, multipart_parser_t *parser);
+
+// fd >= 0 writes straight to fd; -1 keeps small parts in memory
+void multipart_spool_init(multipart_spool_t *spool, int fd);
+int multipart_spool_write(multipart_spool_t *spool, const char *data, size_t length);
+
+// In-memory data, or NULL once the data has gone to a file
+const char *multipart_spool_data(const multipart_spool_t *spool);
+
+// Close the temporary file, if any
+void multipart_spool_close(multipart_spool_t *spool);
+
+#endif // MULTIPART_H
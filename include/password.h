@@ -0,0 +1,39 @@
+#ifndef PASSWORD_H
+#define PASSWORD_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Stored format: $scrypt$v=<version>$<salt hex>$<hash hex>
+// The version selects the scrypt cost parameters, so they can be raised later
+// without invalidating existing hashes.
+#define PASSWORD_HASH_MAX 160 // Also fits legacy plain-text passwords
+
+#define PASSWORD_OK 0
+#define PASSWORD_MISMATCH -1
+#define PASSWORD_BUSY -2 // Hashing executor queue is full
+
+// Hash a password with the current parameters
+int password_hash(const char *password, char *out, size_t out_size);
+
+// Verify a password against a stored hash (or a legacy plain-text password)
+int password_verify(const char *password, const char *stored);
+
+// Cost of a password_verify() for an account that does not exist, so a
+// failed login takes as long for an unknown username as for a wrong password.
+// Always fails: PASSWORD_MISMATCH, or PASSWORD_BUSY like password_verify().
+int password_verify_missing(const char *password);
+
+// True if the stored value uses outdated parameters or is not hashed at all
+bool password_needs_rehash(const char *stored);
+
+// Hashing executor: a dedicated pool with its own bounded queue, so no more
+// than its thread count of 16 MB hashes run at once and a full queue fails
+// fast with PASSWORD_BUSY. The calling thread still waits for its hash;
+// handlers call in through the database executor (db_verify_user_async), so
+// that thread is not an HTTP worker. Without an executor, hashing runs
+// inline on the calling thread.
+int password_executor_init(int thread_count, int queue_size);
+void password_executor_shutdown(void);
+
+#endif // PASSWORD_H
@@ -0,0 +1,37 @@
+#ifndef PROBES_H
+#define PROBES_H
+
+// USDT (user-level statically defined tracing) probes for bpftrace and perf,
+// under the provider name "http_server". Each probe is a single nop in the
+// instruction stream until a tracer attaches. Configure with
+// -DENABLE_USDT=OFF, or build without sys/sdt.h, to compile them out.
+//
+//   connection_accept(int fd, const char *client_ip)
+//   request_parsed(void *conn, const char *method, const char *path)
+//   route_matched(void *conn, const char *method, const char *route)
+//   handler_start(void *conn, const char *route)
+//   handler_end(void *conn, const char *route)
+//   pool_enqueue(void *pool, void *task_arg, int queue_depth)
+//   pool_dequeue(void *pool, void *task_arg, int queue_depth)
+//   session_validate_start(void)
+//   session_validate_end(int valid)
+//   db_query_start(int statement)
+//   db_query_end(int statement, int sqlite_rc)
+//   tls_handshake_start(void *ssl, int fd)
+//   tls_handshake_end(void *ssl, int ok, int resumed)
+
+#ifdef ENABLE_USDT
+#include <sys/sdt.h>
+
+#define PROBE(name) DTRACE_PROBE(http_server, name)
+#define PROBE1(name, a) DTRACE_PROBE1(http_server, name, a)
+#define PROBE2(name, a, b) DTRACE_PROBE2(http_server, name, a, b)
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(http_server, name, a, b, c)
+#else
+#define PROBE(name) ((void) 0)
+#define PROBE1(name, a) ((void) 0)
+#define PROBE2(name, a, b) ((void) 0)
+#define PROBE3(name, a, b, c) ((void) 0)
+#endif
+
+#endif // PROBES_H
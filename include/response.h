@@ -0,0 +1,48 @@
+#ifndef RESPONSE_H
+#define RESPONSE_H
+
+#include "connection.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+#define RESPONSE_LENGTH_CHUNKED -1 // Body length not known up front
+
+// Response being written to a connection. Headers and small writes collect
+// in the connection's write buffer and go out together; larger writes are
+// sent straight from the caller's memory. Writes block while the socket is
+// full, so a handler producing a large body is held to the client's pace
+// instead of buffering it.
+typedef struct {
+  connection_t *conn;
+  int status;
+  bool chunked;     // Transfer-Encoding: chunked
+  bool failed;      // A write failed or the body overran its length
+  bool finished;    // response_end() has run
+  size_t head;      // Header bytes at the start of the write buffer
+  size_t buffered;  // Bytes in the write buffer, headers included
+  long long length; // Declared Content-Length, or RESPONSE_LENGTH_CHUNKED
+  size_t body_sent; // Body bytes accepted so far
+  size_t bytes;     // Bytes written to the socket, framing included
+} response_t;
+
+// Start a response. status is the status line text ("200 OK"); headers are
+// extra header lines, each ending in CRLF, or NULL. content_length is the
+// exact body size, or RESPONSE_LENGTH_CHUNKED to stream it in chunks.
+int response_begin(response_t *res, connection_t *conn, const char *status,
+                   const char *content_type, const char *headers, long long content_length);
+
+// Append body bytes; returns -1 once the client has gone away, after which
+// the handler should stop producing output
+int response_write(response_t *res, const void *data, size_t length);
+
+// Send everything buffered so far
+int response_flush(response_t *res);
+
+// Send the rest, the final chunk when chunked, and account the response
+int response_end(response_t *res);
+
+// Whole response in one call
+int response_send(connection_t *conn, const char *status, const char *content_type,
+                  const char *headers, const void *body, size_t length);
+
+#endif // RESPONSE_H
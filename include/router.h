@@ -7,6 +7,8 @@
 #define MAX_PARAMS 8
 #define MAX_PARAM_NAME 32
 #define MAX_PARAM_VALUE 256
+#define ROUTER_MAX_BODY_SIZE 16384 // Default limit for buffered request bodies
+#define ROUTE_BODY_STREAMED 0      // Body limit for handlers that read it with http_body_read()
 
 // Route parameters extracted from URL
 typedef struct {
@@ -26,6 +28,11 @@ typedef bool (*middleware_t)(int client_fd, const http_request_t *request);
 typedef void (*route_handler_t)(int client_fd, const http_request_t *request,
                                 const route_params_t *params);
 
+// Sends the router's own error responses (404, 400, 413). status_line is
+// the text after "HTTP/1.1 ", e.g. "404 Not Found".
+typedef void (*router_error_handler_t)(int client_fd, const http_request_t *request,
+                                       const char *status_line);
+
 // Route structure
 typedef struct {
   const char *method;
@@ -33,7 +40,8 @@ typedef struct {
   route_handler_t handler;
   middleware_t *middlewares; // Array of middleware functions
   size_t middleware_count;
-  bool has_params; // True if path contains :params
+  bool has_params;      // True if path contains :params
+  size_t max_body_size; // Buffered body limit, or ROUTE_BODY_STREAMED
 } route_t;
 
 // Router functions
@@ -41,9 +49,22 @@ void router_init(void);
 void router_register(const char *method, const char *path, route_handler_t handler);
 void router_register_with_middleware(const char *method, const char *path, route_handler_t handler,
                                      middleware_t *middlewares, size_t middleware_count);
-void router_handle(int client_fd, const http_request_t *request);
+// Set how large a body the route accepts. Bodies are buffered into
+// request->body before the handler runs; with ROUTE_BODY_STREAMED the
+// handler reads the body itself.
+void router_set_max_body_size(const char *method, const char *path, size_t max_body_size);
+
+void router_handle(int client_fd, http_request_t *request);
+
+// Replace the default error responses, which are written straight to
+// client_fd and so only work on plain HTTP connections
+void router_set_error_handler(router_error_handler_t handler);
 
 // Middleware registration
 void router_use_global_middleware(middleware_t middleware);
 
+// Registered routes, in registration order (route ids index into this)
+size_t router_route_count(void);
+const route_t *router_get_route(size_t index);
+
 #endif // ROUTER_H
@@ -3,6 +3,7 @@
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <time.h>
 
 // Session management
@@ -24,13 +25,21 @@ const char *session_create(const char *username);
 bool session_validate(const char *token, char *username_out, size_t username_size);
 void session_destroy(const char *token);
 void session_cleanup_expired(void);
+size_t session_count(void); // Active sessions
 
 // Security utilities
 int secure_compare(const char *a, const char *b, size_t len);
 void generate_token(char *buffer, size_t length);
+void random_bytes(void *buffer, size_t length);
 
 // CSRF protection
 #define CSRF_TOKEN_LENGTH 32
+#define CSRF_STATELESS_TOKEN_LENGTH 43 // base64url of timestamp, nonce and HMAC
+
+// CSRF_MODE_TABLE keeps issued tokens in a fixed table. CSRF_MODE_STATELESS
+// derives tokens from the session with an HMAC and only tracks consumed tokens
+// in a replay filter, so capacity scales with the session count.
+typedef enum { CSRF_MODE_TABLE, CSRF_MODE_STATELESS } csrf_mode_t;
 
 typedef struct {
   char token[CSRF_TOKEN_LENGTH + 1];
@@ -40,6 +49,7 @@ typedef struct {
 } csrf_token_t;
 
 void csrf_init(void);
+void csrf_set_mode(csrf_mode_t mode);
 const char *csrf_generate(const char *session_token);
 bool csrf_validate(const char *csrf_token, const char *session_token);
 void csrf_cleanup_expired(void);
@@ -58,5 +68,28 @@ typedef struct {
 void rate_limit_init(void);
 bool rate_limit_check(const char *ip);
 void rate_limit_cleanup(void);
+size_t rate_limit_count(void); // Tracked client addresses
+
+// Concurrent connection limit per client address, checked right after
+// accept(). Addresses sharing the top prefix_bits count as one client.
+#define CONN_LIMIT_PER_CLIENT 64 // Default, see --max-conns-per-ip=
+#define CONN_LIMIT_PREFIX_BITS 32
+#define CONN_LIMIT_SHARDS 16 // Independently locked parts of the table
+// Clients tracked per shard. A shard takes new clients until three quarters
+// full and refuses them after that; clients pick their addresses, so they
+// may all hash to the same shard, and 1536 of them still fit.
+#define CONN_LIMIT_SHARD_SLOTS 2048
+
+// per_client 0 disables the limit
+void conn_limit_init(unsigned per_client, unsigned prefix_bits);
+
+// Count a new connection from addr (IPv4, host byte order). Returns false,
+// counting nothing, if the client is at its limit or the table is full.
+bool conn_limit_acquire(uint32_t addr);
+
+// Count a connection from addr as closed
+void conn_limit_release(uint32_t addr);
+
+size_t conn_limit_count(void); // Clients with open connections
 
 #endif // SECURITY_H
@@ -23,6 +23,7 @@ typedef struct {
   int queue_front;
   int queue_rear;
   int queue_count;
+  int active_count; // Workers currently running a task
 
   pthread_mutex_t queue_mutex;
   pthread_cond_t queue_cond;
@@ -33,8 +34,11 @@ typedef struct {
 
 // Thread pool functions
 thread_pool_t *thread_pool_create(int thread_count);
+thread_pool_t *thread_pool_create_ex(int thread_count, int queue_size);
 bool thread_pool_add_task(thread_pool_t *pool, void (*function)(void *), void *arg);
+bool thread_pool_try_add_task(thread_pool_t *pool, void (*function)(void *), void *arg);
 void thread_pool_destroy(thread_pool_t *pool);
 int thread_pool_get_active_count(thread_pool_t *pool);
+int thread_pool_get_queue_depth(thread_pool_t *pool);
 
 #endif // THREAD_POOL_H
@@ -0,0 +1,16 @@
+#ifndef TIMING_H
+#define TIMING_H
+
+#include <stdint.h>
+#include <time.h>
+
+#define MS_TO_NS(ms) ((uint64_t) (ms) * 1000000ULL)
+
+// Monotonic clock in nanoseconds, for measuring durations
+static inline uint64_t timing_now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+
+#endif // TIMING_H
@@ -3,26 +3,88 @@
 
 #include <openssl/err.h>
 #include <openssl/ssl.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include <sys/uio.h>
 
 // Initialize OpenSSL library
 void tls_init(void);
 
+// Route OpenSSL allocations through a shared pool of record-sized buffers, so
+// connections that release their buffers while idle recycle them instead of
+// going back to malloc. Also enables the memory figures in tls_stats_t. Must
+// run before any other OpenSSL call; returns false if that is too late.
+bool tls_use_buffer_pool(void);
+
 // Create SSL context with certificate and key
 SSL_CTX *tls_create_context(const char *cert_file, const char *key_file);
 
+// Start issuing session tickets under a fresh key. Tickets under the key it
+// replaces still resume (and are re-issued); older ones fall back to a full
+// handshake. Happens on its own every hour; returns -1 if no key could be made.
+int tls_rotate_ticket_keys(void);
+
+// Ask OpenSSL to hand record encryption to the kernel (Linux "tls" ULP) once
+// the handshake completes. Connections whose kernel or cipher cannot do kTLS
+// silently stay on user-space encryption. Returns false if this OpenSSL build
+// has no kTLS support.
+bool tls_enable_ktls(SSL_CTX *ctx);
+
+// Whether the kernel encrypts records sent on this connection
+bool tls_ktls_send_enabled(SSL *ssl);
+
 // Clean up SSL context
 void tls_cleanup_context(SSL_CTX *ctx);
 
-// Create SSL connection from socket
+// Create SSL connection from socket, completing the handshake before returning
 SSL *tls_accept_connection(SSL_CTX *ctx, int client_fd);
 
-// Read from SSL connection
+// Read from SSL connection (waits if the socket is non-blocking)
 ssize_t tls_read(SSL *ssl, void *buffer, size_t length);
 
-// Write to SSL connection
+// Write to SSL connection (waits if the socket is non-blocking)
 ssize_t tls_write(SSL *ssl, const void *buffer, size_t length);
 
+// Write all of iov. With kTLS this is a single writev() on the socket;
+// otherwise small buffers are coalesced so they go out in one TLS record.
+// Returns the number of bytes written or -1.
+ssize_t tls_writev(SSL *ssl, const struct iovec *iov, int iovcnt);
+
+// Non-blocking interface. Each call either completes (TLS_IO_DONE) or reports
+// which readiness event to wait for before calling it again. Retried writes
+// must pass the same buffer and length.
+typedef enum {
+  TLS_IO_DONE,
+  TLS_IO_WANT_READ,
+  TLS_IO_WANT_WRITE,
+  TLS_IO_CLOSED, // Peer sent close_notify
+  TLS_IO_ERROR
+} tls_io_status_t;
+
+// Create a server-side SSL for a (non-blocking) socket without handshaking
+SSL *tls_new_connection(SSL_CTX *ctx, int client_fd);
+
+// Advance the handshake as far as the socket allows
+tls_io_status_t tls_handshake(SSL *ssl);
+
+tls_io_status_t tls_read_nonblock(SSL *ssl, void *buffer, size_t length, size_t *bytes_read);
+tls_io_status_t tls_write_nonblock(SSL *ssl, const void *buffer, size_t length,
+                                   size_t *bytes_written);
+
 // Close SSL connection
 void tls_close(SSL *ssl);
 
+// Handshake counters since startup
+typedef struct {
+  unsigned long full_handshakes;
+  unsigned long resumed_handshakes; // Via session cache or session ticket
+  unsigned long failed_handshakes;
+  unsigned long ktls_connections; // Handshakes that ended with kernel TLS send
+  unsigned long active_connections;
+  size_t memory_in_use;  // OpenSSL heap allocated by connection I/O (needs the buffer pool)
+  size_t pooled_buffers; // Idle record buffers ready for reuse
+} tls_stats_t;
+
+void tls_get_stats(tls_stats_t *stats);
+
 #endif // TLS_H
@@ -0,0 +1,50 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "access_log.h"
+#include "timing.h"
+#include <stdint.h>
+
+#define TRACE_SLOW_THRESHOLD_MS 500 // Default, see --slow-ms=
+#define TRACE_SLOW_PER_SECOND 20    // Slow requests written per second at most
+
+// Points in a request's life. Each mark ends the stage it is named after; a
+// request skips the marks that do not apply to it (plain HTTP has no
+// handshake, for example).
+typedef enum {
+  TRACE_ACCEPTED,        // accept() returned
+  TRACE_HANDSHAKE_DONE,  // TLS handshake completed
+  TRACE_QUEUED,          // Handed to the worker pool once request data was due
+  TRACE_WORKER_START,    // A worker picked the connection up
+  TRACE_READ_DONE,       // Request bytes read
+  TRACE_PARSED,          // http_parse_request returned
+  TRACE_MIDDLEWARE_DONE, // Global and route middlewares passed
+  TRACE_HANDLER_DONE,    // Handler returned (before the response if it is asynchronous)
+  TRACE_RESPONSE_START,  // Response about to be written
+  TRACE_RESPONSE_SENT,   // Response written
+  TRACE_CLOSED,          // Connection closed
+  TRACE_STAGES
+} trace_stage_t;
+
+// Marks can come from different threads as a request moves between the
+// event loop, workers and executors; each stage is written by one of them.
+// Handoffs go through the pools' queue mutexes and the connection's
+// acquire-release reference count, so trace_finish(), run on the last
+// release, sees every mark.
+typedef struct {
+  uint64_t ns[TRACE_STAGES]; // Monotonic time of each mark, 0 if not reached
+} trace_t;
+
+static inline void trace_mark(trace_t *trace, trace_stage_t stage) {
+  trace->ns[stage] = timing_now_ns();
+}
+
+// Open the slow-request log. Requests taking at least threshold_ms from
+// accept to close are written there with their stage breakdown; 0 disables.
+int trace_init(const char *path, unsigned threshold_ms);
+void trace_shutdown(void);
+
+// Called once per finished request
+void trace_finish(const trace_t *trace, const access_log_entry_t *entry);
+
+#endif // TRACE_H
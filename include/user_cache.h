@@ -0,0 +1,41 @@
+#ifndef USER_CACHE_H
+#define USER_CACHE_H
+
+#include "password.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+// Read-through cache of user credentials in front of SQLite. Sharded, each
+// shard a bounded LRU. Unknown usernames are cached as negative entries for
+// USER_CACHE_NEGATIVE_TTL seconds, in an LRU of their own holding at most a
+// quarter of the shard, so a flood of made-up names cannot push out the real
+// users. A negative hit saves the query, not the hash: db_verify_user still
+// verifies against a dummy hash so unknown names cost as much as wrong
+// passwords.
+#define USER_CACHE_SHARDS 16
+#define USER_CACHE_SHARD_CAPACITY 256
+#define USER_CACHE_NEGATIVE_TTL 60
+
+#define USER_FLAG_NEGATIVE 0x1 // Username does not exist
+
+typedef struct {
+  int64_t id;
+  char password_hash[PASSWORD_HASH_MAX];
+  unsigned flags;
+} user_record_t;
+
+void user_cache_init(void);
+
+// Copy a cached record into out; false on miss
+bool user_cache_get(const char *username, user_record_t *out);
+
+// Snapshot taken before reading the database. user_cache_put drops the record
+// if the username was invalidated in between, so a slow reader cannot cache a
+// result that a concurrent write has already made stale.
+uint64_t user_cache_generation(const char *username);
+void user_cache_put(const char *username, const user_record_t *record, uint64_t generation);
+
+// Must be called after every write that changes a user
+void user_cache_invalidate(const char *username);
+
+#endif // USER_CACHE_H
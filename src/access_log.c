@@ -0,0 +1,295 @@
+#include "access_log.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define ACCESS_LOG_BATCH_SIZE 65536 // Bytes formatted before each write()
+#define ACCESS_LOG_LINE_MAX 1024    // Longest formatted entry
+#define ACCESS_LOG_PATH_MAX 256
+
+// Single-producer, single-consumer ring owned by one request thread and
+// drained by the writer. head and tail sit on separate cache lines so the
+// producer and the writer do not invalidate each other's line on every entry.
+typedef struct access_log_ring {
+  access_log_entry_t entries[ACCESS_LOG_RING_SIZE];
+  _Alignas(64) atomic_uint head; // Next slot the owning thread fills
+  _Alignas(64) atomic_uint tail; // Next slot the writer drains
+  atomic_ulong dropped;
+  struct access_log_ring *next;
+} access_log_ring_t;
+
+// A thread keeps its ring for the life of the process, so rings are never freed
+static _Atomic(access_log_ring_t *) rings = NULL; // Every thread's ring, newest first
+static __thread access_log_ring_t *thread_ring = NULL;
+static atomic_bool accepting                   = false;
+
+// Writer state - only touched by the writer thread once it is running
+static char log_path[ACCESS_LOG_PATH_MAX];
+static int log_fd                = -1;
+static off_t log_size            = 0;
+static uint64_t dropped_reported = 0;
+
+static pthread_t writer_thread;
+static pthread_mutex_t writer_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t writer_wakeup = PTHREAD_COND_INITIALIZER;
+static bool writer_running          = false;
+static bool writer_shutdown         = false;
+
+static access_log_ring_t *access_log_thread_ring(void) {
+  if (thread_ring) {
+    return thread_ring;
+  }
+
+  access_log_ring_t *ring = (access_log_ring_t *) aligned_alloc(64, sizeof(access_log_ring_t));
+  if (!ring) {
+    return NULL;
+  }
+  memset(ring, 0, sizeof(*ring));
+
+  // Publish without a lock; the writer only ever walks the list
+  ring->next = atomic_load(&rings);
+  while (!atomic_compare_exchange_weak(&rings, &ring->next, ring)) {
+  }
+  thread_ring = ring;
+  return ring;
+}
+
+void access_log_record(const access_log_entry_t *entry) {
+  if (!atomic_load_explicit(&accepting, memory_order_relaxed)) {
+    return;
+  }
+
+  access_log_ring_t *ring = access_log_thread_ring();
+  if (!ring) {
+    return;
+  }
+
+  unsigned head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  unsigned tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+  if (head - tail >= ACCESS_LOG_RING_SIZE) {
+    atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+    return; // Never wait for the writer
+  }
+
+  ring->entries[head & (ACCESS_LOG_RING_SIZE - 1)] = *entry;
+  atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+uint64_t access_log_dropped(void) {
+  uint64_t dropped = 0;
+  for (access_log_ring_t *ring = atomic_load(&rings); ring; ring = ring->next) {
+    dropped += atomic_load_explicit(&ring->dropped, memory_order_relaxed);
+  }
+  return dropped;
+}
+
+// Copy a request string, percent-encoding anything that would break the
+// line format (control bytes, spaces, quotes, backslashes, non-ASCII)
+static void access_log_escape(const char *in, char *out, size_t out_size) {
+  static const char hex[] = "0123456789ABCDEF";
+  size_t used             = 0;
+
+  for (const unsigned char *p = (const unsigned char *) in; *p && used + 4 <= out_size; p++) {
+    if (*p <= ' ' || *p >= 0x7f || *p == '"' || *p == '\\') {
+      out[used++] = '%';
+      out[used++] = hex[*p >> 4];
+      out[used++] = hex[*p & 0x0f];
+    } else {
+      out[used++] = (char) *p;
+    }
+  }
+  out[used] = '\0';
+}
+
+static size_t access_log_format(char *out, size_t out_size, const access_log_entry_t *entry) {
+  char time_text[32];
+  char method[sizeof(entry->method) * 3 + 1];
+  char path[sizeof(entry->path) * 3 + 1];
+  struct tm tm;
+  time_t timestamp = (time_t) entry->timestamp;
+
+  gmtime_r(&timestamp, &tm);
+  strftime(time_text, sizeof(time_text), "%Y-%m-%dT%H:%M:%SZ", &tm);
+  access_log_escape(entry->method, method, sizeof(method));
+  access_log_escape(entry->path, path, sizeof(path));
+
+  int length = snprintf(out, out_size,
+                        "time=%s ip=%s method=%s path=\"%s\" status=%d bytes=%zu "
+                        "latency_us=%" PRIu64 "\n",
+                        time_text, entry->client_ip, method, path, entry->status, entry->bytes,
+                        entry->latency_us);
+  if (length < 0) {
+    return 0;
+  }
+  return (size_t) length < out_size ? (size_t) length : out_size - 1;
+}
+
+static int access_log_open(void) {
+  log_fd = open(log_path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+  if (log_fd < 0) {
+    perror("Failed to open access log");
+    return -1;
+  }
+
+  struct stat st;
+  log_size = fstat(log_fd, &st) == 0 ? st.st_size : 0;
+  return 0;
+}
+
+// Shift access.log -> access.log.1 -> ... and start a new file
+static void access_log_rotate(void) {
+  char from[ACCESS_LOG_PATH_MAX + 8];
+  char to[ACCESS_LOG_PATH_MAX + 8];
+
+  for (int i = ACCESS_LOG_MAX_FILES - 1; i > 0; i--) {
+    if (i == 1) {
+      snprintf(from, sizeof(from), "%s", log_path);
+    } else {
+      snprintf(from, sizeof(from), "%s.%d", log_path, i - 1);
+    }
+    snprintf(to, sizeof(to), "%s.%d", log_path, i);
+    if (rename(from, to) != 0 && errno != ENOENT) {
+      perror("Failed to rotate access log");
+    }
+  }
+
+  close(log_fd);
+  access_log_open();
+}
+
+static void access_log_write(const char *data, size_t length) {
+  while (length > 0 && log_fd >= 0) {
+    ssize_t written = write(log_fd, data, length);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("Failed to write access log");
+      return;
+    }
+    data += written;
+    length -= (size_t) written;
+    log_size += written;
+  }
+
+  if (log_fd >= 0 && log_size >= ACCESS_LOG_MAX_FILE_SIZE) {
+    access_log_rotate();
+  }
+}
+
+// Move everything queued so far into the file, one write() per batch
+static void access_log_drain(void) {
+  static char batch[ACCESS_LOG_BATCH_SIZE];
+  size_t used      = 0;
+  uint64_t dropped = 0;
+
+  for (access_log_ring_t *ring = atomic_load(&rings); ring; ring = ring->next) {
+    unsigned tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    unsigned head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+    while (tail != head) {
+      if (sizeof(batch) - used < ACCESS_LOG_LINE_MAX) {
+        access_log_write(batch, used);
+        used = 0;
+      }
+      used += access_log_format(batch + used, sizeof(batch) - used,
+                                &ring->entries[tail & (ACCESS_LOG_RING_SIZE - 1)]);
+      tail++;
+    }
+    atomic_store_explicit(&ring->tail, tail, memory_order_release);
+    dropped += atomic_load_explicit(&ring->dropped, memory_order_relaxed);
+  }
+
+  if (dropped > dropped_reported) {
+    if (sizeof(batch) - used < ACCESS_LOG_LINE_MAX) {
+      access_log_write(batch, used);
+      used = 0;
+    }
+    int length = snprintf(batch + used, sizeof(batch) - used,
+                          "# dropped %" PRIu64 " entries (%" PRIu64 " total)\n",
+                          dropped - dropped_reported, dropped);
+    if (length > 0) {
+      used += (size_t) length < sizeof(batch) - used ? (size_t) length : sizeof(batch) - used - 1;
+    }
+    dropped_reported = dropped;
+  }
+
+  if (used > 0) {
+    access_log_write(batch, used);
+  }
+}
+
+static void *access_log_writer_main(void *arg) {
+  (void) arg;
+
+  pthread_mutex_lock(&writer_mutex);
+  while (!writer_shutdown) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += ACCESS_LOG_FLUSH_MS * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000L;
+    }
+    pthread_cond_timedwait(&writer_wakeup, &writer_mutex, &deadline);
+
+    pthread_mutex_unlock(&writer_mutex);
+    access_log_drain();
+    pthread_mutex_lock(&writer_mutex);
+  }
+  pthread_mutex_unlock(&writer_mutex);
+
+  access_log_drain(); // Whatever arrived before shutdown
+  return NULL;
+}
+
+int access_log_init(const char *path) {
+  if (writer_running) {
+    return 0;
+  }
+
+  snprintf(log_path, sizeof(log_path), "%s", path);
+  if (access_log_open() != 0) {
+    return -1;
+  }
+
+  writer_shutdown  = false;
+  dropped_reported = 0;
+  if (pthread_create(&writer_thread, NULL, access_log_writer_main, NULL) != 0) {
+    fprintf(stderr, "Failed to start access log writer\n");
+    close(log_fd);
+    log_fd = -1;
+    return -1;
+  }
+
+  writer_running = true;
+  atomic_store(&accepting, true);
+  return 0;
+}
+
+void access_log_shutdown(void) {
+  if (!writer_running) {
+    return;
+  }
+
+  atomic_store(&accepting, false);
+
+  pthread_mutex_lock(&writer_mutex);
+  writer_shutdown = true;
+  pthread_cond_signal(&writer_wakeup);
+  pthread_mutex_unlock(&writer_mutex);
+
+  pthread_join(writer_thread, NULL);
+  writer_running = false;
+
+  close(log_fd);
+  log_fd = -1;
+}
@@ -0,0 +1,64 @@
+#include "arena.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct arena_block {
+  arena_block_t *next;
+  size_t size;
+  _Alignas(ARENA_ALIGNMENT) char data[];
+};
+
+static char *arena_align(char *ptr) {
+  uintptr_t address = (uintptr_t) ptr;
+  return (char *) ((address + ARENA_ALIGNMENT - 1) & ~(uintptr_t) (ARENA_ALIGNMENT - 1));
+}
+
+void arena_init(arena_t *arena, void *buffer, size_t size) {
+  arena->initial      = (char *) buffer;
+  arena->initial_size = buffer ? size : 0;
+  arena->blocks       = NULL;
+  arena->cursor       = arena->initial;
+  arena->end          = arena->initial + arena->initial_size;
+}
+
+void *arena_alloc(arena_t *arena, size_t size) {
+  char *start = arena->cursor ? arena_align(arena->cursor) : NULL;
+  if (start && start <= arena->end && size <= (size_t) (arena->end - start)) {
+    arena->cursor = start + size;
+    return start;
+  }
+
+  // Out of room: chain a new block, big enough for oversized requests
+  size_t block_size    = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+  arena_block_t *block = (arena_block_t *) malloc(sizeof(arena_block_t) + block_size);
+  if (!block) {
+    return NULL;
+  }
+  block->next   = arena->blocks;
+  block->size   = block_size;
+  arena->blocks = block;
+
+  arena->cursor = block->data + size;
+  arena->end    = block->data + block_size;
+  return block->data;
+}
+
+char *arena_strndup(arena_t *arena, const char *data, size_t length) {
+  char *copy = (char *) arena_alloc(arena, length + 1);
+  if (copy) {
+    memcpy(copy, data, length);
+    copy[length] = '\0';
+  }
+  return copy;
+}
+
+void arena_reset(arena_t *arena) {
+  while (arena->blocks) {
+    arena_block_t *next = arena->blocks->next;
+    free(arena->blocks);
+    arena->blocks = next;
+  }
+  arena->cursor = arena->initial;
+  arena->end    = arena->initial + arena->initial_size;
+}
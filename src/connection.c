@@ -0,0 +1,333 @@
+#include "connection.h"
+#include "metrics.h"
+#include "security.h"
+#include "timing.h"
+#include "tls.h"
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// Free slots form a Treiber stack of slot indexes. The head packs a
+// generation tag in the upper 32 bits with index + 1 (0 = empty) in the
+// lower ones, so a slot popped and pushed back between another thread's
+// load and compare-and-swap cannot be mistaken for an unchanged head.
+#define SLOT_MASK 0xffffffffu
+#define SLOT_TAG_ONE ((uint64_t) 1 << 32)
+
+static connection_t *slab           = NULL;
+static atomic_uint *slab_next       = NULL; // Per slot: next free index + 1
+static size_t slab_capacity         = 0;
+static _Atomic uint64_t free_head   = 0;
+static atomic_size_t in_use_count   = 0;
+static atomic_size_t overflow_count = 0;
+
+// Where connection_run_on_worker() queues work; NULL runs it inline
+static _Atomic(thread_pool_t *) worker_pool = NULL;
+
+static void slot_push(uint32_t index) {
+  uint64_t head = atomic_load(&free_head);
+  uint64_t next;
+  do {
+    atomic_store_explicit(&slab_next[index], (unsigned) (head & SLOT_MASK), memory_order_relaxed);
+    next = ((head & ~(uint64_t) SLOT_MASK) + SLOT_TAG_ONE) | (index + 1);
+  } while (!atomic_compare_exchange_weak(&free_head, &head, next));
+}
+
+// Returns the slot index, or -1 when the slab is exhausted
+static int64_t slot_pop(void) {
+  uint64_t head = atomic_load(&free_head);
+  uint64_t next;
+  do {
+    uint32_t top = (uint32_t) (head & SLOT_MASK);
+    if (top == 0) {
+      return -1;
+    }
+    // May read a stale link if the slot is taken concurrently; the tag makes
+    // the compare-and-swap fail in that case
+    uint32_t after = atomic_load_explicit(&slab_next[top - 1], memory_order_relaxed);
+    next           = ((head & ~(uint64_t) SLOT_MASK) + SLOT_TAG_ONE) | after;
+  } while (!atomic_compare_exchange_weak(&free_head, &head, next));
+
+  return (int64_t) (head & SLOT_MASK) - 1;
+}
+
+int connection_pool_init(size_t capacity) {
+  if (slab || capacity == 0 || capacity >= SLOT_MASK) {
+    return -1;
+  }
+
+  // MAP_POPULATE faults every page in now rather than on the first accepts
+  size_t size = capacity * sizeof(connection_t);
+  void *mem   = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE,
+                     -1, 0);
+  if (mem == MAP_FAILED) {
+    perror("Failed to allocate connection slab");
+    return -1;
+  }
+
+  slab_next = (atomic_uint *) calloc(capacity, sizeof(atomic_uint));
+  if (!slab_next) {
+    munmap(mem, size);
+    return -1;
+  }
+
+  slab          = (connection_t *) mem;
+  slab_capacity = capacity;
+  atomic_store(&free_head, 0);
+  for (size_t i = capacity; i-- > 0;) {
+    slot_push((uint32_t) i);
+  }
+
+  return 0;
+}
+
+void connection_pool_destroy(void) {
+  if (!slab || atomic_load(&in_use_count) > 0) {
+    return;
+  }
+
+  munmap(slab, slab_capacity * sizeof(connection_t));
+  free(slab_next);
+  slab          = NULL;
+  slab_next     = NULL;
+  slab_capacity = 0;
+  atomic_store(&free_head, 0);
+}
+
+connection_pool_stats_t connection_pool_stats(void) {
+  connection_pool_stats_t stats = {
+      .capacity = slab_capacity,
+      .in_use   = atomic_load(&in_use_count),
+      .overflow = atomic_load(&overflow_count),
+  };
+  return stats;
+}
+
+void connection_set_worker_pool(thread_pool_t *pool) {
+  atomic_store(&worker_pool, pool);
+}
+
+bool connection_run_on_worker(void (*fn)(void *), void *arg) {
+  thread_pool_t *pool = atomic_load(&worker_pool);
+  if (!pool) {
+    fn(arg);
+    return true;
+  }
+  return thread_pool_add_task(pool, fn, arg);
+}
+
+connection_t *connection_create(int client_fd, const char *client_ip, SSL_CTX *ssl_ctx) {
+  connection_t *conn = NULL;
+  int64_t slot       = slab ? slot_pop() : -1;
+
+  if (slot >= 0) {
+    conn = &slab[slot];
+    // Buffers are overwritten before use, so only the bookkeeping is cleared
+    memset(conn, 0, offsetof(connection_t, arena_buffer));
+    conn->pooled = true;
+  } else {
+    conn = (connection_t *) calloc(1, sizeof(connection_t));
+    if (!conn) {
+      return NULL;
+    }
+    if (slab) {
+      atomic_fetch_add(&overflow_count, 1);
+    }
+  }
+  atomic_fetch_add(&in_use_count, 1);
+
+  conn->client_fd = client_fd;
+  conn->ssl_ctx   = ssl_ctx;
+  conn->watch.fd  = client_fd;
+  conn->route     = -1;
+  strncpy(conn->client_ip, client_ip, sizeof(conn->client_ip) - 1);
+  conn->accepted_ns = timing_now_ns();
+  atomic_init(&conn->refcount, 1);
+  arena_init(&conn->arena, conn->arena_buffer, sizeof(conn->arena_buffer));
+  trace_mark(&conn->trace, TRACE_ACCEPTED);
+
+  return conn;
+}
+
+static uint64_t min_ns(uint64_t a, uint64_t b) {
+  return a < b ? a : b;
+}
+
+// Wait for the socket to become ready, until deadline_ns at the latest
+static bool connection_wait(connection_t *conn, short events, uint64_t deadline_ns) {
+  struct pollfd pfd = {.fd = conn->client_fd, .events = events};
+  for (;;) {
+    uint64_t now = timing_now_ns();
+    if (now >= deadline_ns) {
+      errno = ETIMEDOUT;
+      return false;
+    }
+    int rc = poll(&pfd, 1, (int) ((deadline_ns - now + 999999) / 1000000));
+    if (rc > 0) {
+      return true;
+    }
+    if (rc < 0 && errno != EINTR) {
+      return false;
+    }
+  }
+}
+
+// Latest time the next body byte may arrive: the body, request and
+// minimum-rate deadlines, whichever comes first
+static uint64_t connection_read_deadline(const connection_t *conn) {
+  uint64_t deadline = min_ns(conn->body_start_ns + MS_TO_NS(CONNECTION_BODY_TIMEOUT_MS),
+                             conn->accepted_ns + MS_TO_NS(CONNECTION_REQUEST_TIMEOUT_MS));
+  uint64_t rate_ns  = (uint64_t) conn->body_received * 1000000000ULL / CONNECTION_MIN_BODY_RATE;
+  return min_ns(deadline, conn->body_start_ns + MS_TO_NS(CONNECTION_RATE_GRACE_MS) + rate_ns);
+}
+
+ssize_t connection_read(connection_t *conn, void *buf, size_t size) {
+  if (conn->body_start_ns == 0) {
+    conn->body_start_ns = timing_now_ns();
+  }
+
+  for (;;) {
+    short wanted = POLLIN;
+    ssize_t n;
+
+    if (conn->ssl) {
+      size_t bytes_read;
+      tls_io_status_t status = tls_read_nonblock(conn->ssl, buf, size, &bytes_read);
+      if (status == TLS_IO_CLOSED) {
+        return 0;
+      }
+      if (status != TLS_IO_DONE && status != TLS_IO_WANT_READ && status != TLS_IO_WANT_WRITE) {
+        return -1;
+      }
+      n      = status == TLS_IO_DONE ? (ssize_t) bytes_read : -1;
+      wanted = status == TLS_IO_WANT_WRITE ? POLLOUT : POLLIN;
+    } else {
+      n = read(conn->client_fd, buf, size);
+      if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+        if (errno == EINTR) {
+          continue;
+        }
+        return -1;
+      }
+    }
+
+    if (n >= 0) {
+      conn->body_received += (size_t) n;
+      return n;
+    }
+    if (!connection_wait(conn, wanted, connection_read_deadline(conn))) {
+      return -1;
+    }
+  }
+}
+
+#define CONNECTION_MAX_IOV 16
+
+ssize_t connection_writev(connection_t *conn, const struct iovec *iov, int iovcnt) {
+  if (conn->ssl) {
+    return tls_writev(conn->ssl, iov, iovcnt);
+  }
+  if (iovcnt > CONNECTION_MAX_IOV) {
+    return -1;
+  }
+
+  // Partial writes advance through a copy of the caller's vector
+  struct iovec pending[CONNECTION_MAX_IOV];
+  memcpy(pending, iov, sizeof(struct iovec) * (size_t) iovcnt);
+  struct iovec *next = pending;
+  size_t total       = 0;
+
+  while (iovcnt > 0) {
+    ssize_t n = writev(conn->client_fd, next, iovcnt);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        return -1;
+      }
+      uint64_t deadline = min_ns(timing_now_ns() + MS_TO_NS(CONNECTION_WRITE_TIMEOUT_MS),
+                                 conn->accepted_ns + MS_TO_NS(CONNECTION_REQUEST_TIMEOUT_MS));
+      if (!connection_wait(conn, POLLOUT, deadline)) {
+        return -1;
+      }
+      continue;
+    }
+
+    total += (size_t) n;
+    while (iovcnt > 0 && (size_t) n >= next->iov_len) {
+      n -= (ssize_t) next->iov_len;
+      next++;
+      iovcnt--;
+    }
+    if (iovcnt > 0) {
+      next->iov_base = (char *) next->iov_base + n;
+      next->iov_len -= (size_t) n;
+    }
+  }
+
+  return (ssize_t) total;
+}
+
+ssize_t connection_body_source(void *ctx, void *buf, size_t size) {
+  connection_t *conn = (connection_t *) ctx;
+
+  if (conn->expect_continue) {
+    static const char continue_response[] = "HTTP/1.1 100 Continue\r\n\r\n";
+    size_t length                         = sizeof(continue_response) - 1;
+    conn->expect_continue                 = false;
+
+    ssize_t written = conn->ssl ? tls_write(conn->ssl, continue_response, length)
+                                : write(conn->client_fd, continue_response, length);
+    if (written != (ssize_t) length) {
+      return -1;
+    }
+  }
+
+  return connection_read(conn, buf, size);
+}
+
+connection_t *connection_retain(connection_t *conn) {
+  atomic_fetch_add(&conn->refcount, 1);
+  return conn;
+}
+
+void connection_release(connection_t *conn) {
+  if (!conn || atomic_fetch_sub(&conn->refcount, 1) != 1) {
+    return;
+  }
+
+  if (conn->ssl) {
+    tls_close(conn->ssl);
+  } else {
+    shutdown(conn->client_fd, SHUT_WR);
+  }
+  close(conn->client_fd);
+  if (conn->conn_limited) {
+    conn_limit_release(conn->client_addr);
+  }
+  trace_mark(&conn->trace, TRACE_CLOSED);
+
+  // Only requests that reached the router have a method
+  if (conn->log.method[0]) {
+    conn->log.latency_us =
+        (conn->trace.ns[TRACE_CLOSED] - conn->trace.ns[TRACE_WORKER_START]) / 1000;
+    access_log_record(&conn->log);
+    metrics_record_request(conn->route, conn->log.status, conn->log.latency_us, conn->log.bytes);
+    trace_finish(&conn->trace, &conn->log);
+  }
+  arena_reset(&conn->arena);
+
+  atomic_fetch_sub(&in_use_count, 1);
+  if (conn->pooled) {
+    slot_push((uint32_t) (conn - slab));
+  } else {
+    free(conn);
+  }
+}
@@ -1,11 +1,287 @@
 #include "db.h"
-#include "security.h"
+#include "password.h"
+#include "probes.h"
+#include "thread_pool.h"
+#include "user_cache.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
+#define DB_BUSY_TIMEOUT_MS 5000
+#define DB_GROUP_COMMIT_WINDOW_US 2000 // How long the writer waits to fill a batch
+#define DB_GROUP_COMMIT_MAX 256        // Writes per transaction
+#define DB_ASYNC_FIELD_SIZE 256
+
+// Statements cached on every connection
+typedef enum {
+  DB_STMT_INSERT_USER,
+  DB_STMT_SELECT_USER,
+  DB_STMT_UPDATE_PASSWORD,
+  DB_STMT_COUNT
+} db_stmt_id_t;
+
+static const char *stmt_sql[DB_STMT_COUNT] = {
+    [DB_STMT_INSERT_USER]     = "INSERT INTO users (username, password) VALUES (?, ?);",
+    [DB_STMT_SELECT_USER]     = "SELECT id, password FROM users WHERE username = ?;",
+    [DB_STMT_UPDATE_PASSWORD] = "UPDATE users SET password = ? WHERE username = ?;",
+};
+
+// Connection with its own statement cache. Opened without SQLite's internal
+// mutex: it is only used by the thread that checked it out of the pool, or by
+// the writer thread.
+typedef struct {
+  sqlite3 *conn;
+  sqlite3_stmt *stmts[DB_STMT_COUNT];
+} db_conn_t;
+
+// Administrative connection for schema setup and db_get_connection()
 static sqlite3 *db = NULL;
 
+static db_conn_t pool[DB_POOL_SIZE];
+static int pool_free[DB_POOL_SIZE]; // Stack of free pool indices
+static int pool_free_count          = 0;
+static int pool_size                = 0;
+static pthread_mutex_t pool_mutex   = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_not_busy = PTHREAD_COND_INITIALIZER;
+
+// Group commit: all writes go through a single writer thread that commits
+// whatever has queued up within a short window as one transaction, so a burst
+// of registrations costs one fsync instead of one per user. Callers wait until
+// the transaction holding their write has committed.
+typedef struct db_write {
+  db_stmt_id_t stmt; // DB_STMT_INSERT_USER or DB_STMT_UPDATE_PASSWORD
+  const char *username;
+  const char *hash;
+  int result;
+  bool done;
+  struct db_write *next;
+} db_write_t;
+
+static db_conn_t writer;
+static pthread_t writer_thread;
+static bool writer_running         = false;
+static bool writer_shutdown        = false;
+static db_write_t *write_head      = NULL;
+static db_write_t *write_tail      = NULL;
+static int write_pending           = 0;
+static pthread_mutex_t write_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t write_ready  = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t write_done   = PTHREAD_COND_INITIALIZER;
+
+// Executor for the asynchronous API
+typedef struct {
+  bool create;
+  char username[DB_ASYNC_FIELD_SIZE];
+  char password[DB_ASYNC_FIELD_SIZE];
+  db_callback_t callback;
+  void *user_data;
+} db_async_job_t;
+
+static thread_pool_t *async_executor = NULL;
+
+static int db_exec(sqlite3 *conn, const char *sql) {
+  char *err_msg = NULL;
+  int rc        = sqlite3_exec(conn, sql, NULL, NULL, &err_msg);
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "SQL error: %s\n", err_msg);
+    sqlite3_free(err_msg);
+    return -1;
+  }
+  return 0;
+}
+
+static int db_open_pooled(const char *db_path, db_conn_t *c) {
+  memset(c, 0, sizeof(*c));
+
+  int flags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_NOMUTEX;
+  if (sqlite3_open_v2(db_path, &c->conn, flags, NULL) != SQLITE_OK) {
+    fprintf(stderr, "Cannot open database: %s\n", sqlite3_errmsg(c->conn));
+    sqlite3_close(c->conn);
+    c->conn = NULL;
+    return -1;
+  }
+
+  sqlite3_busy_timeout(c->conn, DB_BUSY_TIMEOUT_MS);
+  // WAL syncs on every commit with FULL, so acknowledged writes stay durable
+  return db_exec(c->conn, "PRAGMA synchronous=FULL;");
+}
+
+static void db_close_pooled(db_conn_t *c) {
+  for (int i = 0; i < DB_STMT_COUNT; i++) {
+    sqlite3_finalize(c->stmts[i]);
+    c->stmts[i] = NULL;
+  }
+  sqlite3_close(c->conn);
+  c->conn = NULL;
+}
+
+// Take a connection from the pool, waiting if all are checked out
+static db_conn_t *db_checkout(void) {
+  pthread_mutex_lock(&pool_mutex);
+  while (pool_free_count == 0) {
+    pthread_cond_wait(&pool_not_busy, &pool_mutex);
+  }
+  db_conn_t *c = &pool[pool_free[--pool_free_count]];
+  pthread_mutex_unlock(&pool_mutex);
+  return c;
+}
+
+static void db_checkin(db_conn_t *c) {
+  pthread_mutex_lock(&pool_mutex);
+  pool_free[pool_free_count++] = (int) (c - pool);
+  pthread_cond_signal(&pool_not_busy);
+  pthread_mutex_unlock(&pool_mutex);
+}
+
+// Get a cached statement, preparing it on first use. Release it with
+// db_stmt_release() so the next caller finds it reset and unbound.
+static sqlite3_stmt *db_stmt(db_conn_t *c, db_stmt_id_t id) {
+  if (!c->stmts[id]) {
+    int rc = sqlite3_prepare_v3(c->conn, stmt_sql[id], -1, SQLITE_PREPARE_PERSISTENT,
+                                &c->stmts[id], NULL);
+    if (rc != SQLITE_OK) {
+      fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(c->conn));
+      c->stmts[id] = NULL;
+      return NULL;
+    }
+  }
+  return c->stmts[id];
+}
+
+static void db_stmt_release(sqlite3_stmt *stmt) {
+  sqlite3_reset(stmt);
+  sqlite3_clear_bindings(stmt);
+}
+
+// Queue a write for the writer thread and wait until it has committed
+static int db_submit_write(db_write_t *w) {
+  w->done = false;
+  w->next = NULL;
+
+  pthread_mutex_lock(&write_mutex);
+  if (write_tail) {
+    write_tail->next = w;
+  } else {
+    write_head = w;
+  }
+  write_tail = w;
+  write_pending++;
+  pthread_cond_signal(&write_ready);
+
+  while (!w->done) {
+    pthread_cond_wait(&write_done, &write_mutex);
+  }
+  int result = w->result;
+  pthread_mutex_unlock(&write_mutex);
+
+  return result;
+}
+
+// Apply a batch of writes in one transaction. A failing statement (such as a
+// duplicate username) only fails its own write; a failed commit fails them all.
+static void db_apply_batch(db_write_t *batch) {
+  bool began = db_exec(writer.conn, "BEGIN IMMEDIATE;") == 0;
+
+  for (db_write_t *w = batch; w; w = w->next) {
+    sqlite3_stmt *stmt = began ? db_stmt(&writer, w->stmt) : NULL;
+    if (!stmt) {
+      w->result = -1;
+      continue;
+    }
+
+    if (w->stmt == DB_STMT_INSERT_USER) {
+      sqlite3_bind_text(stmt, 1, w->username, -1, SQLITE_STATIC);
+      sqlite3_bind_text(stmt, 2, w->hash, -1, SQLITE_STATIC);
+    } else {
+      sqlite3_bind_text(stmt, 1, w->hash, -1, SQLITE_STATIC);
+      sqlite3_bind_text(stmt, 2, w->username, -1, SQLITE_STATIC);
+    }
+
+    PROBE1(db_query_start, w->stmt);
+    int rc = sqlite3_step(stmt);
+    PROBE2(db_query_end, w->stmt, rc);
+    if (rc != SQLITE_DONE) {
+      fprintf(stderr, "Failed to write user: %s\n", sqlite3_errmsg(writer.conn));
+    }
+    w->result = rc == SQLITE_DONE ? 0 : -1;
+    db_stmt_release(stmt);
+  }
+
+  if (began && db_exec(writer.conn, "COMMIT;") != 0) {
+    db_exec(writer.conn, "ROLLBACK;");
+    for (db_write_t *w = batch; w; w = w->next) {
+      w->result = -1;
+    }
+  }
+
+  // Drop cached records (including negative ones) before callers see success
+  for (db_write_t *w = batch; w; w = w->next) {
+    user_cache_invalidate(w->username);
+  }
+}
+
+static void *db_writer_main(void *arg) {
+  (void) arg;
+
+  pthread_mutex_lock(&write_mutex);
+  while (true) {
+    while (!write_head && !writer_shutdown) {
+      pthread_cond_wait(&write_ready, &write_mutex);
+    }
+    if (!write_head) {
+      break; // Shutdown with nothing left to write
+    }
+
+    // Give concurrent writers a moment to join this transaction
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += DB_GROUP_COMMIT_WINDOW_US * 1000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000L;
+    }
+    while (write_pending < DB_GROUP_COMMIT_MAX && !writer_shutdown) {
+      if (pthread_cond_timedwait(&write_ready, &write_mutex, &deadline) == ETIMEDOUT) {
+        break;
+      }
+    }
+
+    // Detach up to DB_GROUP_COMMIT_MAX writes from the queue
+    db_write_t *batch = write_head;
+    db_write_t *last  = batch;
+    int taken         = 1;
+    while (last->next && taken < DB_GROUP_COMMIT_MAX) {
+      last = last->next;
+      taken++;
+    }
+    write_head = last->next;
+    if (!write_head) {
+      write_tail = NULL;
+    }
+    last->next = NULL;
+    write_pending -= taken;
+    pthread_mutex_unlock(&write_mutex);
+
+    db_apply_batch(batch);
+
+    // Callers may return as soon as done is set, so read next first
+    pthread_mutex_lock(&write_mutex);
+    for (db_write_t *w = batch; w;) {
+      db_write_t *next = w->next;
+      w->done          = true;
+      w                = next;
+    }
+    pthread_cond_broadcast(&write_done);
+  }
+  pthread_mutex_unlock(&write_mutex);
+
+  return NULL;
+}
+
 int db_init(const char *db_path) {
   int rc = sqlite3_open(db_path, &db);
   if (rc != SQLITE_OK) {
@@ -13,6 +289,12 @@ int db_init(const char *db_path) {
     return -1;
   }
 
+  // WAL lets readers proceed while a write is in progress; the setting is
+  // stored in the database file and applies to every connection
+  if (db_exec(db, "PRAGMA journal_mode=WAL;") != 0) {
+    return -1;
+  }
+
   // Create users table
   const char *sql = "CREATE TABLE IF NOT EXISTS users ("
                     "  id INTEGER PRIMARY KEY AUTOINCREMENT,"
@@ -21,19 +303,57 @@ int db_init(const char *db_path) {
                     "  created_at DATETIME DEFAULT CURRENT_TIMESTAMP"
                     ");";
 
-  char *err_msg = NULL;
-  rc            = sqlite3_exec(db, sql, NULL, NULL, &err_msg);
-  if (rc != SQLITE_OK) {
-    fprintf(stderr, "SQL error: %s\n", err_msg);
-    sqlite3_free(err_msg);
+  if (db_exec(db, sql) != 0) {
     return -1;
   }
 
+  user_cache_init();
+
+  for (pool_size = 0; pool_size < DB_POOL_SIZE; pool_size++) {
+    if (db_open_pooled(db_path, &pool[pool_size]) != 0) {
+      db_close();
+      return -1;
+    }
+    pool_free[pool_size] = pool_size;
+  }
+  pool_free_count = pool_size;
+
+  if (db_open_pooled(db_path, &writer) != 0) {
+    db_close();
+    return -1;
+  }
+  writer_shutdown = false;
+  if (pthread_create(&writer_thread, NULL, db_writer_main, NULL) != 0) {
+    fprintf(stderr, "Failed to start database writer thread\n");
+    db_close();
+    return -1;
+  }
+  writer_running = true;
+
   printf("Database initialized successfully\n");
   return 0;
 }
 
 void db_close(void) {
+  // Stop the writer after it has committed everything still queued
+  if (writer_running) {
+    pthread_mutex_lock(&write_mutex);
+    writer_shutdown = true;
+    pthread_cond_signal(&write_ready);
+    pthread_mutex_unlock(&write_mutex);
+    pthread_join(writer_thread, NULL);
+    writer_running = false;
+  }
+  if (writer.conn) {
+    db_close_pooled(&writer);
+  }
+
+  for (int i = 0; i < pool_size; i++) {
+    db_close_pooled(&pool[i]);
+  }
+  pool_size       = 0;
+  pool_free_count = 0;
+
   if (db) {
     sqlite3_close(db);
     db = NULL;
@@ -41,53 +361,165 @@ void db_close(void) {
 }
 
 int db_create_user(const char *username, const char *password) {
-  const char *sql = "INSERT INTO users (username, password) VALUES (?, ?);";
-  sqlite3_stmt *stmt;
+  char hash[PASSWORD_HASH_MAX];
+  int rc = password_hash(password, hash, sizeof(hash));
+  if (rc == PASSWORD_BUSY) {
+    return DB_BUSY;
+  }
+  if (rc != PASSWORD_OK) {
+    return -1;
+  }
 
-  int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
-  if (rc != SQLITE_OK) {
-    fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(db));
+  db_write_t w = {.stmt = DB_STMT_INSERT_USER, .username = username, .hash = hash};
+  return db_submit_write(&w);
+}
+
+// Replace a stored password with a hash using the current parameters
+static void db_rehash_password(const char *username, const char *password) {
+  char hash[PASSWORD_HASH_MAX];
+  if (password_hash(password, hash, sizeof(hash)) != PASSWORD_OK) {
+    return; // Best effort: the old hash keeps working
+  }
+
+  db_write_t w = {.stmt = DB_STMT_UPDATE_PASSWORD, .username = username, .hash = hash};
+  db_submit_write(&w);
+}
+
+// Look a user up in the cache, falling back to the database. Unknown
+// usernames are cached too (USER_FLAG_NEGATIVE).
+static int db_load_user(const char *username, user_record_t *record) {
+  if (user_cache_get(username, record)) {
+    return 0;
+  }
+
+  uint64_t generation = user_cache_generation(username);
+
+  db_conn_t *c       = db_checkout();
+  sqlite3_stmt *stmt = db_stmt(c, DB_STMT_SELECT_USER);
+  if (!stmt) {
+    db_checkin(c);
     return -1;
   }
 
   sqlite3_bind_text(stmt, 1, username, -1, SQLITE_STATIC);
-  sqlite3_bind_text(stmt, 2, password, -1, SQLITE_STATIC);
 
-  rc = sqlite3_step(stmt);
-  sqlite3_finalize(stmt);
+  memset(record, 0, sizeof(*record));
+  PROBE1(db_query_start, DB_STMT_SELECT_USER);
+  int rc = sqlite3_step(stmt);
+  PROBE2(db_query_end, DB_STMT_SELECT_USER, rc);
+  if (rc == SQLITE_ROW) {
+    const unsigned char *stored_password = sqlite3_column_text(stmt, 1);
+    record->id                           = sqlite3_column_int64(stmt, 0);
+    snprintf(record->password_hash, sizeof(record->password_hash), "%s",
+             stored_password ? (const char *) stored_password : "");
+  } else if (rc == SQLITE_DONE) {
+    record->flags = USER_FLAG_NEGATIVE;
+  }
+  db_stmt_release(stmt);
+  db_checkin(c);
 
-  if (rc != SQLITE_DONE) {
-    fprintf(stderr, "Failed to create user: %s\n", sqlite3_errmsg(db));
-    return -1;
+  if (rc != SQLITE_ROW && rc != SQLITE_DONE) {
+    return -1; // Database error: don't cache
   }
 
+  user_cache_put(username, record, generation);
   return 0;
 }
 
 int db_verify_user(const char *username, const char *password) {
-  const char *sql = "SELECT password FROM users WHERE username = ?;";
-  sqlite3_stmt *stmt;
-
-  int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
-  if (rc != SQLITE_OK) {
-    fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(db));
+  user_record_t record;
+  if (db_load_user(username, &record) != 0) {
     return -1;
   }
+  if (record.flags & USER_FLAG_NEGATIVE) {
+    // Hash anyway: an early return would tell which usernames exist
+    return password_verify_missing(password) == PASSWORD_BUSY ? DB_BUSY : -1;
+  }
 
-  sqlite3_bind_text(stmt, 1, username, -1, SQLITE_STATIC);
+  int match = password_verify(password, record.password_hash);
+  if (match == PASSWORD_BUSY) {
+    return DB_BUSY;
+  }
+  if (match != PASSWORD_OK) {
+    return -1;
+  }
 
-  rc = sqlite3_step(stmt);
-  if (rc == SQLITE_ROW) {
-    const unsigned char *stored_password = sqlite3_column_text(stmt, 0);
-    int match = secure_compare(password, (const char *) stored_password, 0);
-    sqlite3_finalize(stmt);
-    return match;
+  // Transparently upgrade plain-text or outdated hashes
+  if (password_needs_rehash(record.password_hash)) {
+    db_rehash_password(username, password);
   }
 
-  sqlite3_finalize(stmt);
-  return -1;
+  return 0;
 }
 
 sqlite3 *db_get_connection(void) {
   return db;
 }
+
+int db_async_init(int thread_count, int queue_size) {
+  if (async_executor) {
+    return 0;
+  }
+
+  async_executor = thread_pool_create_ex(thread_count, queue_size);
+  return async_executor ? 0 : -1;
+}
+
+void db_async_shutdown(void) {
+  if (async_executor) {
+    thread_pool_destroy(async_executor);
+    async_executor = NULL;
+  }
+}
+
+static void db_async_run(void *arg) {
+  db_async_job_t *job = (db_async_job_t *) arg;
+
+  int result = job->create ? db_create_user(job->username, job->password)
+                           : db_verify_user(job->username, job->password);
+
+  memset(job->password, 0, sizeof(job->password));
+  job->callback(result, job->user_data);
+  free(job);
+}
+
+static bool db_async_submit(bool create, const char *username, const char *password,
+                            db_callback_t callback, void *user_data) {
+  if (!username || !password || !callback || strlen(username) >= DB_ASYNC_FIELD_SIZE ||
+      strlen(password) >= DB_ASYNC_FIELD_SIZE) {
+    return false;
+  }
+
+  db_async_job_t *job = (db_async_job_t *) malloc(sizeof(db_async_job_t));
+  if (!job) {
+    return false;
+  }
+
+  job->create    = create;
+  job->callback  = callback;
+  job->user_data = user_data;
+  strcpy(job->username, username);
+  strcpy(job->password, password);
+
+  if (!async_executor) {
+    db_async_run(job);
+    return true;
+  }
+
+  if (!thread_pool_try_add_task(async_executor, db_async_run, job)) {
+    memset(job->password, 0, sizeof(job->password));
+    free(job);
+    return false;
+  }
+  return true;
+}
+
+bool db_create_user_async(const char *username, const char *password, db_callback_t callback,
+                          void *user_data) {
+  return db_async_submit(true, username, password, callback, user_data);
+}
+
+bool db_verify_user_async(const char *username, const char *password, db_callback_t callback,
+                          void *user_data) {
+  return db_async_submit(false, username, password, callback, user_data);
+}
@@ -0,0 +1,247 @@
+#include "event_loop.h"
+#include "timing.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#define EVENT_LOOP_MAX_EVENTS 64
+#define EVENT_LOOP_TIMER_CAPACITY 64 // Initial heap size; doubles as needed
+
+static void *event_loop_thread(void *arg);
+
+static void event_loop_wake(event_loop_t *loop) {
+  uint64_t one = 1;
+  if (write(loop->wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+    perror("Failed to wake event loop");
+  }
+}
+
+event_loop_t *event_loop_create(void) {
+  event_loop_t *loop = (event_loop_t *) calloc(1, sizeof(event_loop_t));
+  if (!loop) {
+    return NULL;
+  }
+
+  pthread_mutex_init(&loop->timer_lock, NULL);
+  loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  loop->wake_fd  = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (loop->epoll_fd < 0 || loop->wake_fd < 0) {
+    perror("Failed to create event loop");
+    event_loop_destroy(loop);
+    return NULL;
+  }
+
+  struct epoll_event ev = {.events = EPOLLIN, .data.ptr = NULL};
+  if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->wake_fd, &ev) != 0) {
+    perror("Failed to register event loop wakeup");
+    event_loop_destroy(loop);
+    return NULL;
+  }
+
+  return loop;
+}
+
+int event_loop_start(event_loop_t *loop) {
+  if (pthread_create(&loop->thread, NULL, event_loop_thread, loop) != 0) {
+    return -1;
+  }
+  loop->running = true;
+  return 0;
+}
+
+void event_loop_destroy(event_loop_t *loop) {
+  if (!loop) {
+    return;
+  }
+
+  if (loop->running) {
+    loop->shutdown = true;
+    event_loop_wake(loop);
+    pthread_join(loop->thread, NULL);
+  }
+
+  if (loop->epoll_fd >= 0) {
+    close(loop->epoll_fd);
+  }
+  if (loop->wake_fd >= 0) {
+    close(loop->wake_fd);
+  }
+  pthread_mutex_destroy(&loop->timer_lock);
+  free(loop->timers);
+  free(loop);
+}
+
+int event_loop_watch(event_loop_t *loop, event_watch_t *watch, uint32_t events) {
+  struct epoll_event ev = {.events = events | EPOLLONESHOT | EPOLLRDHUP, .data.ptr = watch};
+  int op                = watch->registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+
+  // Mark it first: once added, the fd may fire and its handler re-arm it on
+  // the loop thread before epoll_ctl has even returned here
+  watch->registered = true;
+  if (epoll_ctl(loop->epoll_fd, op, watch->fd, &ev) != 0) {
+    if (op == EPOLL_CTL_ADD) {
+      watch->registered = false;
+    }
+    return -1;
+  }
+  return 0;
+}
+
+void event_loop_unwatch(event_loop_t *loop, event_watch_t *watch) {
+  if (watch->registered) {
+    epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, watch->fd, NULL);
+    watch->registered = false;
+  }
+}
+
+// Heap helpers; the caller holds timer_lock
+static void timer_place(event_loop_t *loop, event_timer_t *timer, size_t index) {
+  loop->timers[index] = timer;
+  timer->slot         = index + 1;
+}
+
+static void timer_sift_up(event_loop_t *loop, size_t index) {
+  event_timer_t *timer = loop->timers[index];
+  while (index > 0) {
+    size_t parent = (index - 1) / 2;
+    if (loop->timers[parent]->deadline_ns <= timer->deadline_ns) {
+      break;
+    }
+    timer_place(loop, loop->timers[parent], index);
+    index = parent;
+  }
+  timer_place(loop, timer, index);
+}
+
+static void timer_sift_down(event_loop_t *loop, size_t index) {
+  event_timer_t *timer = loop->timers[index];
+  for (;;) {
+    size_t child = 2 * index + 1;
+    if (child >= loop->timer_count) {
+      break;
+    }
+    if (child + 1 < loop->timer_count &&
+        loop->timers[child + 1]->deadline_ns < loop->timers[child]->deadline_ns) {
+      child++;
+    }
+    if (timer->deadline_ns <= loop->timers[child]->deadline_ns) {
+      break;
+    }
+    timer_place(loop, loop->timers[child], index);
+    index = child;
+  }
+  timer_place(loop, timer, index);
+}
+
+static void timer_remove(event_loop_t *loop, event_timer_t *timer) {
+  size_t index = timer->slot - 1;
+  timer->slot  = 0;
+
+  event_timer_t *last = loop->timers[--loop->timer_count];
+  if (last != timer) {
+    timer_place(loop, last, index);
+    timer_sift_up(loop, index);
+    timer_sift_down(loop, last->slot - 1);
+  }
+}
+
+int event_loop_timer_set(event_loop_t *loop, event_timer_t *timer, uint64_t deadline_ns) {
+  pthread_mutex_lock(&loop->timer_lock);
+
+  if (timer->slot) {
+    timer->deadline_ns = deadline_ns;
+    timer_sift_up(loop, timer->slot - 1);
+    timer_sift_down(loop, timer->slot - 1);
+  } else {
+    if (loop->timer_count == loop->timer_capacity) {
+      size_t capacity = loop->timer_capacity ? loop->timer_capacity * 2 : EVENT_LOOP_TIMER_CAPACITY;
+      event_timer_t **grown =
+          (event_timer_t **) realloc(loop->timers, capacity * sizeof(event_timer_t *));
+      if (!grown) {
+        pthread_mutex_unlock(&loop->timer_lock);
+        return -1;
+      }
+      loop->timers         = grown;
+      loop->timer_capacity = capacity;
+    }
+    timer->deadline_ns = deadline_ns;
+    timer_place(loop, timer, loop->timer_count++);
+    timer_sift_up(loop, timer->slot - 1);
+  }
+
+  // A new earliest deadline shortens the loop's current wait
+  bool earliest = timer->slot == 1;
+  pthread_mutex_unlock(&loop->timer_lock);
+
+  if (earliest && loop->running && !pthread_equal(pthread_self(), loop->thread)) {
+    event_loop_wake(loop);
+  }
+  return 0;
+}
+
+void event_loop_timer_cancel(event_loop_t *loop, event_timer_t *timer) {
+  pthread_mutex_lock(&loop->timer_lock);
+  if (timer->slot) {
+    timer_remove(loop, timer);
+  }
+  pthread_mutex_unlock(&loop->timer_lock);
+}
+
+// Run expired timers; returns the epoll_wait timeout until the next one
+static int event_loop_run_timers(event_loop_t *loop) {
+  pthread_mutex_lock(&loop->timer_lock);
+  uint64_t now = timing_now_ns();
+
+  while (loop->timer_count > 0 && loop->timers[0]->deadline_ns <= now) {
+    event_timer_t *timer = loop->timers[0];
+    timer_remove(loop, timer);
+
+    // The handler may arm or cancel timers itself
+    pthread_mutex_unlock(&loop->timer_lock);
+    timer->handler(timer);
+    pthread_mutex_lock(&loop->timer_lock);
+    now = timing_now_ns();
+  }
+
+  int timeout = -1;
+  if (loop->timer_count > 0) {
+    // Rounded up so the wait never ends just short of the deadline
+    timeout = (int) ((loop->timers[0]->deadline_ns - now + 999999) / 1000000);
+  }
+  pthread_mutex_unlock(&loop->timer_lock);
+  return timeout;
+}
+
+static void *event_loop_thread(void *arg) {
+  event_loop_t *loop = (event_loop_t *) arg;
+  struct epoll_event events[EVENT_LOOP_MAX_EVENTS];
+
+  while (!loop->shutdown) {
+    int timeout = event_loop_run_timers(loop);
+    int count   = epoll_wait(loop->epoll_fd, events, EVENT_LOOP_MAX_EVENTS, timeout);
+    if (count < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("epoll_wait failed");
+      break;
+    }
+
+    for (int i = 0; i < count; i++) {
+      event_watch_t *watch = (event_watch_t *) events[i].data.ptr;
+      if (watch) {
+        watch->handler(watch, events[i].events);
+      } else {
+        uint64_t wakeups;
+        if (read(loop->wake_fd, &wakeups, sizeof(wakeups)) < 0 && errno != EAGAIN) {
+          perror("Failed to drain event loop wakeup");
+        }
+      }
+    }
+  }
+
+  return NULL;
+}
@@ -1,59 +1,68 @@
 #include "handlers.h"
+#include "connection.h"
 #include "db.h"
 #include "http.h"
+#include "json.h"
+#include "metrics.h"
+#include "response.h"
 #include "security.h"
 #include "static.h"
-#include "tls.h"
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #define BUFFER_SIZE 4096
 #define MAX_RESPONSE_SIZE 65536
+#define JSON_RESPONSE_SIZE 512 // Largest JSON reply: login with both tokens
 
-static void send_response_ex(int client_fd, SSL *ssl, const char *status, const char *content_type,
-                             const char *body) {
-  // Send headers first
-  char headers[512];
-  int header_len = snprintf(headers, sizeof(headers),
-                            "HTTP/1.1 %s\r\n"
-                            "Content-Type: %s\r\n"
-                            "Content-Length: %zu\r\n"
-                            "Cache-Control: no-store, no-cache, must-revalidate, max-age=0\r\n"
-                            "Pragma: no-cache\r\n"
-                            "Expires: 0\r\n"
-                            "Connection: close\r\n"
-                            "\r\n",
-                            status, content_type, strlen(body));
-
-  // Send headers
-  ssize_t written;
-  if (ssl) {
-    written = tls_write(ssl, headers, header_len);
-  } else {
-    written = write(client_fd, headers, header_len);
-  }
+#define NO_CACHE_HEADERS                                                                           \
+  "Cache-Control: no-store, no-cache, must-revalidate, max-age=0\r\n"                              \
+  "Pragma: no-cache\r\n"                                                                           \
+  "Expires: 0\r\n"
 
-  if (written < 0) {
-    perror("Failed to send headers");
-    return;
-  }
+static void send_response_ex(connection_t *conn, const char *status, const char *content_type,
+                             const char *body) {
+  // Headers and body go out together: one writev() for plain HTTP and for
+  // kTLS, one coalesced TLS record otherwise
+  response_send(conn, status, content_type, NO_CACHE_HEADERS, body, strlen(body));
+}
 
-  // Send body
-  if (ssl) {
-    written = tls_write(ssl, body, strlen(body));
-  } else {
-    written = write(client_fd, body, strlen(body));
-  }
+// Form value as a C string; NULL if missing or if it has an embedded NUL
+static const char *form_field(const http_form_t *form, const char *name) {
+  size_t length;
+  const char *value = http_form_get(form, name, &length);
+  return value && strlen(value) == length ? value : NULL;
+}
 
-  if (written < 0) {
-    perror("Failed to send body");
+// Send a finished JSON document; Content-Length comes from the writer
+static void send_json(connection_t *conn, const char *status, json_writer_t *json) {
+  size_t length;
+  const char *body = json_finish(json, &length);
+  if (!body) {
+    fprintf(stderr, "JSON response does not fit in %d bytes\n", JSON_RESPONSE_SIZE);
+    response_send(conn, "500 Internal Server Error", "text/plain", NULL, "Internal Server Error",
+                  21);
+    return;
   }
+  response_send(conn, status, "application/json", NO_CACHE_HEADERS, body, length);
 }
 
-static void send_response(int client_fd, const char *status, const char *content_type,
-                          const char *body) {
-  send_response_ex(client_fd, NULL, status, content_type, body);
+// {"success": ..., "message": ...}, the shape of every API reply
+static void send_json_message(connection_t *conn, const char *status, bool success,
+                              const char *message) {
+  char body[JSON_RESPONSE_SIZE];
+  json_writer_t json;
+
+  json_init(&json, body, sizeof(body));
+  json_object_begin(&json);
+  json_key(&json, "success");
+  json_bool(&json, success);
+  json_key(&json, "message");
+  json_string(&json, message);
+  json_object_end(&json);
+  send_json(conn, status, &json);
 }
 
 static int validate_credentials(const char *username, const char *password) {
@@ -85,7 +94,16 @@ static int validate_credentials(const char *username, const char *password) {
 
 bool logging_middleware(int client_fd, const http_request_t *request) {
   (void) client_fd; // Unused
-  printf("[%s] %s\n", request->method, request->path);
+
+  // Start the access log entry; status, size and latency are filled in as
+  // the response goes out and the entry is queued when the connection closes
+  connection_t *conn = request->conn;
+  if (conn) {
+    conn->log.timestamp = time(NULL);
+    snprintf(conn->log.method, sizeof(conn->log.method), "%s", request->method);
+    snprintf(conn->log.path, sizeof(conn->log.path), "%s", request->path);
+    snprintf(conn->log.client_ip, sizeof(conn->log.client_ip), "%s", request->client_ip);
+  }
   return true; // Continue to next middleware/handler
 }
 
@@ -94,7 +112,7 @@ static const char *extract_session_token(const http_request_t *request, char *to
                                          size_t buffer_size) {
   (void) buffer_size; // Unused - token size is fixed
 
-  const char *auth_header = http_get_header(request, "Authorization");
+  const char *auth_header = http_get_known_header(request, HTTP_HEADER_AUTHORIZATION);
   if (!auth_header)
     return NULL;
 
@@ -105,27 +123,19 @@ static const char *extract_session_token(const http_request_t *request, char *to
 }
 
 bool auth_middleware(int client_fd, const http_request_t *request) {
+  (void) client_fd; // Unused
   // Extract token from Authorization header
   char token[SESSION_TOKEN_LENGTH + 1] = {0};
   if (!extract_session_token(request, token, sizeof(token))) {
-    const char *response = "HTTP/1.1 401 Unauthorized\r\n"
-                           "Content-Type: application/json\r\n"
-                           "Connection: close\r\n"
-                           "\r\n"
-                           "{\"success\":false,\"message\":\"No authorization token provided\"}";
-    write(client_fd, response, strlen(response));
+    send_json_message(request->conn, "401 Unauthorized", false,
+                      "No authorization token provided");
     return false;
   }
 
   // Validate session
   char username[65];
   if (!session_validate(token, username, sizeof(username))) {
-    const char *response = "HTTP/1.1 401 Unauthorized\r\n"
-                           "Content-Type: application/json\r\n"
-                           "Connection: close\r\n"
-                           "\r\n"
-                           "{\"success\":false,\"message\":\"Invalid or expired session\"}";
-    write(client_fd, response, strlen(response));
+    send_json_message(request->conn, "401 Unauthorized", false, "Invalid or expired session");
     return false;
   }
 
@@ -133,116 +143,223 @@ bool auth_middleware(int client_fd, const http_request_t *request) {
 }
 
 void handle_index(int client_fd, const http_request_t *request, const route_params_t *params) {
+  (void) client_fd; // Unused
   (void) params; // Unused
-  send_response_ex(client_fd, request->ssl, "200 OK", "text/html", embedded_html);
+  send_response_ex(request->conn, "200 OK", "text/html", embedded_html);
 }
 
 void handle_dashboard(int client_fd, const http_request_t *request, const route_params_t *params) {
+  (void) client_fd; // Unused
   (void) params; // Unused
-  send_response_ex(client_fd, request->ssl, "200 OK", "text/html", embedded_dashboard);
+  send_response_ex(request->conn, "200 OK", "text/html", embedded_dashboard);
+}
+
+// State carried from a handler to its database completion callback
+typedef struct {
+  connection_t *conn;
+  char username[65];
+  int result; // Database result, passed on to the worker that responds
+} pending_auth_t;
+
+// Keep the connection open past the handler's return; NULL if that fails
+static pending_auth_t *pending_auth_create(const http_request_t *request, const char *username) {
+  if (!request->conn) {
+    return NULL;
+  }
+
+  // Lives in the request arena, which stays valid while the connection is held
+  pending_auth_t *pending = (pending_auth_t *) http_request_alloc(request, sizeof(pending_auth_t));
+  if (!pending) {
+    return NULL;
+  }
+
+  pending->conn = connection_retain(request->conn);
+  snprintf(pending->username, sizeof(pending->username), "%s", username);
+  return pending;
+}
+
+static void pending_auth_finish(pending_auth_t *pending) {
+  if (pending) {
+    connection_release(pending->conn);
+  }
+}
+
+void send_busy(connection_t *conn) {
+  send_json_message(conn, "503 Service Unavailable", false, "Server busy. Please try again");
+}
+
+// Runs on the database executor: the response is written from an HTTP
+// worker, so a slow client never holds up database or hashing work
+static void pending_auth_complete(pending_auth_t *pending, int result, void (*respond)(void *)) {
+  pending->result = result;
+  if (!connection_run_on_worker(respond, pending)) {
+    pending_auth_finish(pending);
+  }
+}
+
+static void register_respond(void *arg) {
+  pending_auth_t *pending = (pending_auth_t *) arg;
+  connection_t *conn      = pending->conn;
+  int result              = pending->result;
+
+  if (result == 0) {
+    send_json_message(conn, "200 OK", true, "User registered successfully");
+  } else if (result == DB_BUSY) {
+    send_busy(conn);
+  } else {
+    send_json_message(conn, "400 Bad Request", false, "Username already exists");
+  }
+
+  pending_auth_finish(pending);
+}
+
+static void register_complete(int result, void *user_data) {
+  pending_auth_complete((pending_auth_t *) user_data, result, register_respond);
 }
 
 void handle_register(int client_fd, const http_request_t *request, const route_params_t *params) {
+  (void) client_fd; // Unused
   (void) params; // Unused
-  char username[256] = {0};
-  char password[256] = {0};
-
-  if (!request->body ||
-      http_parse_post_data(request->body, "username", username, sizeof(username)) != 0 ||
-      http_parse_post_data(request->body, "password", password, sizeof(password)) != 0) {
-    send_response_ex(client_fd, request->ssl, "400 Bad Request", "application/json",
-                     "{\"success\":false,\"message\":\"Missing username or password\"}");
+  http_form_t form;
+  const char *username = NULL;
+  const char *password = NULL;
+
+  if (http_form_parse(&form, request->body, request->body_length) != 0 ||
+      !(username = form_field(&form, "username")) || !(password = form_field(&form, "password"))) {
+    send_json_message(request->conn, "400 Bad Request", false, "Missing username or password");
     return;
   }
 
   // Validate credentials
   if (validate_credentials(username, password) != 0) {
-    send_response_ex(
-        client_fd, request->ssl, "400 Bad Request", "application/json",
-        "{\"success\":false,\"message\":\"Invalid username or password format. Username must "
-        "be alphanumeric (1-64 chars), password 1-128 chars\"}");
+    send_json_message(request->conn, "400 Bad Request", false,
+                      "Invalid username or password format. Username must be alphanumeric "
+                      "(1-64 chars), password 1-128 chars");
     return;
   }
 
-  if (db_create_user(username, password) == 0) {
-    send_response_ex(client_fd, request->ssl, "200 OK", "application/json",
-                     "{\"success\":true,\"message\":\"User registered successfully\"}");
-  } else {
-    send_response_ex(client_fd, request->ssl, "400 Bad Request", "application/json",
-                     "{\"success\":false,\"message\":\"Username already exists\"}");
+  // The response is sent from register_complete once the database is done
+  pending_auth_t *pending = pending_auth_create(request, username);
+  if (!pending || !db_create_user_async(username, password, register_complete, pending)) {
+    pending_auth_finish(pending);
+    send_busy(request->conn);
   }
 }
 
 void handle_logout(int client_fd, const http_request_t *request, const route_params_t *params) {
+  (void) client_fd; // Unused
   (void) params; // Unused
 
   // Extract session token
   char token[SESSION_TOKEN_LENGTH + 1] = {0};
   if (!extract_session_token(request, token, sizeof(token))) {
-    send_response_ex(client_fd, request->ssl, "400 Bad Request", "application/json",
-                     "{\"success\":false,\"message\":\"No session token provided\"}");
+    send_json_message(request->conn, "400 Bad Request", false, "No session token provided");
     return;
   }
 
   // Destroy session
   session_destroy(token);
 
-  send_response_ex(client_fd, request->ssl, "200 OK", "application/json",
-                   "{\"success\":true,\"message\":\"Logged out successfully\"}");
+  send_json_message(request->conn, "200 OK", true, "Logged out successfully");
+}
+
+static void login_respond(void *arg) {
+  pending_auth_t *pending = (pending_auth_t *) arg;
+  connection_t *conn      = pending->conn;
+  int result              = pending->result;
+
+  if (result == DB_BUSY) {
+    send_busy(conn);
+  } else if (result == 0) {
+    // Create session
+    const char *token = session_create(pending->username);
+    if (token) {
+      // Generate CSRF token
+      const char *csrf_token = csrf_generate(token);
+      if (csrf_token) {
+        char body[JSON_RESPONSE_SIZE];
+        json_writer_t json;
+        json_init(&json, body, sizeof(body));
+        json_object_begin(&json);
+        json_key(&json, "success");
+        json_bool(&json, true);
+        json_key(&json, "message");
+        json_string(&json, "Login successful");
+        json_key(&json, "token");
+        json_string(&json, token);
+        json_key(&json, "csrf_token");
+        json_string(&json, csrf_token);
+        json_object_end(&json);
+        send_json(conn, "200 OK", &json);
+      } else {
+        send_json_message(conn, "500 Internal Server Error", false,
+                          "Failed to create CSRF token");
+      }
+    } else {
+      send_json_message(conn, "500 Internal Server Error", false, "Failed to create session");
+    }
+  } else {
+    send_json_message(conn, "401 Unauthorized", false, "Invalid username or password");
+  }
+
+  pending_auth_finish(pending);
+}
+
+static void login_complete(int result, void *user_data) {
+  pending_auth_complete((pending_auth_t *) user_data, result, login_respond);
 }
 
 void handle_login(int client_fd, const http_request_t *request, const route_params_t *params) {
+  (void) client_fd; // Unused
   (void) params; // Unused
 
   // Rate limiting check using real client IP
   if (!rate_limit_check(request->client_ip)) {
-    send_response_ex(
-        client_fd, request->ssl, "429 Too Many Requests", "application/json",
-        "{\"success\":false,\"message\":\"Too many login attempts. Please try again later\"}");
+    send_json_message(request->conn, "429 Too Many Requests", false,
+                      "Too many login attempts. Please try again later");
     return;
   }
 
-  char username[256] = {0};
-  char password[256] = {0};
+  http_form_t form;
+  const char *username = NULL;
+  const char *password = NULL;
 
-  if (!request->body ||
-      http_parse_post_data(request->body, "username", username, sizeof(username)) != 0 ||
-      http_parse_post_data(request->body, "password", password, sizeof(password)) != 0) {
-    send_response_ex(client_fd, request->ssl, "400 Bad Request", "application/json",
-                     "{\"success\":false,\"message\":\"Missing username or password\"}");
+  if (http_form_parse(&form, request->body, request->body_length) != 0 ||
+      !(username = form_field(&form, "username")) || !(password = form_field(&form, "password"))) {
+    send_json_message(request->conn, "400 Bad Request", false, "Missing username or password");
     return;
   }
 
   // Validate credentials format
   if (validate_credentials(username, password) != 0) {
-    send_response_ex(client_fd, request->ssl, "400 Bad Request", "application/json",
-                     "{\"success\":false,\"message\":\"Invalid username or password format\"}");
+    send_json_message(request->conn, "400 Bad Request", false,
+                      "Invalid username or password format");
     return;
   }
 
-  if (db_verify_user(username, password) == 0) {
-    // Create session
-    const char *token = session_create(username);
-    if (token) {
-      // Generate CSRF token
-      const char *csrf_token = csrf_generate(token);
-      if (csrf_token) {
-        char response[768];
-        snprintf(response, sizeof(response),
-                 "{\"success\":true,\"message\":\"Login successful\",\"token\":\"%s\",\"csrf_"
-                 "token\":\"%s\"}",
-                 token, csrf_token);
-        send_response_ex(client_fd, request->ssl, "200 OK", "application/json", response);
-      } else {
-        send_response_ex(client_fd, request->ssl, "500 Internal Server Error", "application/json",
-                         "{\"success\":false,\"message\":\"Failed to create CSRF token\"}");
-      }
-    } else {
-      send_response_ex(client_fd, request->ssl, "500 Internal Server Error", "application/json",
-                       "{\"success\":false,\"message\":\"Failed to create session\"}");
-    }
-  } else {
-    send_response_ex(client_fd, request->ssl, "401 Unauthorized", "application/json",
-                     "{\"success\":false,\"message\":\"Invalid username or password\"}");
+  // The response is sent from login_complete once the database is done
+  pending_auth_t *pending = pending_auth_create(request, username);
+  if (!pending || !db_verify_user_async(username, password, login_complete, pending)) {
+    pending_auth_finish(pending);
+    send_busy(request->conn);
+  }
+}
+
+void handle_error(int client_fd, const http_request_t *request, const char *status_line) {
+  (void) client_fd; // Unused
+  send_response_ex(request->conn, status_line, "text/plain", strchr(status_line, ' ') + 1);
+}
+
+void handle_metrics(int client_fd, const http_request_t *request, const route_params_t *params) {
+  (void) client_fd; // Unused
+  (void) params;    // Unused
+
+  char *body = metrics_render(NULL);
+  if (!body) {
+    send_response_ex(request->conn, "500 Internal Server Error", "text/plain",
+                     "Failed to render metrics");
+    return;
   }
+  send_response_ex(request->conn, "200 OK", "text/plain; version=0.0.4", body);
+  free(body);
 }
@@ -1,38 +1,113 @@
+#define _GNU_SOURCE // memmem
 #include "http.h"
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <ctype.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define HTTP_BODY_INITIAL_CAPACITY 1024 // Starting buffer for chunked bodies
+#define HTTP_CHUNK_SIZE_DIGITS 15       // Hex digits in a chunk size, keeps it below 2^60
+
+// Chunked decoder states
+enum {
+  CHUNK_SIZE,
+  CHUNK_EXTENSION,
+  CHUNK_SIZE_LF,
+  CHUNK_DATA,
+  CHUNK_DATA_CR,
+  CHUNK_DATA_LF,
+  CHUNK_TRAILER,
+  CHUNK_TRAILER_LINE,
+  CHUNK_TRAILER_LINE_LF,
+  CHUNK_END_LF,
+};
 
 int http_parse_request(const char *raw_request, http_request_t *request) {
+  return http_parse_request_arena(raw_request, request, NULL);
+}
+
+int http_parse_request_arena(const char *raw_request, http_request_t *request, arena_t *arena) {
+  size_t length = strlen(raw_request);
+  if (http_parse_head(raw_request, length, request, arena) != 0) {
+    return -1;
+  }
+
+  // Everything is in memory, so the body cannot be longer than the input
+  return http_read_body(request, length) == 0 ? 0 : -1;
+}
+
+static void *http_alloc(arena_t *arena, size_t size) {
+  return arena ? arena_alloc(arena, size) : malloc(size);
+}
+
+// Work out how the body is delimited. Requests with both headers, or with a
+// transfer coding other than chunked, are rejected rather than guessed at.
+static int http_parse_framing(http_request_t *request, http_body_t *body) {
+  const char *transfer_encoding = http_get_known_header(request, HTTP_HEADER_TRANSFER_ENCODING);
+  const char *content_length    = http_get_known_header(request, HTTP_HEADER_CONTENT_LENGTH);
+
+  if (transfer_encoding) {
+    if (content_length || strcasecmp(transfer_encoding, "chunked") != 0) {
+      return -1;
+    }
+    body->framing = HTTP_BODY_CHUNKED;
+    return 0;
+  }
+
+  if (content_length) {
+    if (!isdigit((unsigned char) *content_length)) {
+      return -1;
+    }
+    char *end;
+    errno                    = 0;
+    unsigned long long value = strtoull(content_length, &end, 10);
+    if (errno != 0 || *end != '\0') {
+      return -1;
+    }
+    body->framing   = value > 0 ? HTTP_BODY_LENGTH : HTTP_BODY_NONE;
+    body->remaining = value;
+    return 0;
+  }
+
+  body->framing = HTTP_BODY_NONE;
+  return 0;
+}
+
+int http_parse_head(const char *raw, size_t length, http_request_t *request, arena_t *arena) {
   memset(request, 0, sizeof(http_request_t));
+  request->arena = arena;
+
+  const char *head_end = memmem(raw, length, "\r\n\r\n", 4);
+  if (!head_end) return -1;
 
   // Parse request line
-  if (sscanf(raw_request, "%15s %255s %15s", request->method, request->path, request->version) != 3) {
+  if (sscanf(raw, "%15s %255s %15s", request->method, request->path, request->version) != 3) {
     return -1;
   }
 
   // Find end of request line
-  const char *header_start = strstr(raw_request, "\r\n");
+  const char *header_start = memmem(raw, (size_t) (head_end + 2 - raw), "\r\n", 2);
   if (!header_start) return -1;
   header_start += 2;
 
-  // Parse headers
+  // Parse headers. Anything that does not fit is refused rather than
+  // dropped, so every header the client sent is seen by the framing checks.
   const char *line = header_start;
-  while (*line != '\0' && request->header_count < MAX_HEADERS) {
-    if (strncmp(line, "\r\n", 2) == 0) {
-      // End of headers
-      line += 2;
-      break;
-    }
+  while (line < head_end + 2) {
+    if (request->header_count >= MAX_HEADERS) return HTTP_HEAD_TOO_LARGE;
 
-    const char *colon = strchr(line, ':');
-    const char *line_end = strstr(line, "\r\n");
+    const char *colon = memchr(line, ':', (size_t) (head_end - line));
+    const char *line_end = memmem(line, (size_t) (head_end + 2 - line), "\r\n", 2);
 
-    if (!colon || !line_end) break;
+    if (!colon || !line_end || colon > line_end) return -1;
 
     int name_len = colon - line;
-    if (name_len >= MAX_HEADER_SIZE) break;
+    if (name_len >= MAX_HEADER_SIZE) return HTTP_HEAD_TOO_LARGE;
 
     strncpy(request->headers[request->header_count][0], line, name_len);
     request->headers[request->header_count][0][name_len] = '\0';
@@ -42,35 +117,355 @@ int http_parse_request(const char *raw_request, http_request_t *request) {
     while (*value_start == ' ') value_start++;
 
     int value_len = line_end - value_start;
-    if (value_len >= MAX_HEADER_SIZE) break;
+    if (value_len >= MAX_HEADER_SIZE) return HTTP_HEAD_TOO_LARGE;
 
     strncpy(request->headers[request->header_count][1], value_start, value_len);
     request->headers[request->header_count][1][value_len] = '\0';
 
+    http_header_id_t id = http_header_classify(line, (size_t) name_len);
+    if (id != HTTP_HEADER_UNKNOWN && !request->known_headers[id]) {
+      request->known_headers[id] = (int8_t) (request->header_count + 1);
+    } else if (id == HTTP_HEADER_CONTENT_LENGTH) {
+      // Repeats must agree, or the body length depends on which one is read
+      const char *first = http_get_known_header(request, HTTP_HEADER_CONTENT_LENGTH);
+      if (strcmp(first, request->headers[request->header_count][1]) != 0) return -1;
+    } else if (id == HTTP_HEADER_TRANSFER_ENCODING) {
+      // Only the first would be honoured, while a proxy may go by another
+      return -1;
+    }
+
     request->header_count++;
     line = line_end + 2;
   }
 
-  // Body starts after headers
-  if (*line != '\0') {
-    request->body_length = strlen(line);
-    request->body = malloc(request->body_length + 1);
-    if (request->body) {
-      strcpy(request->body, line);
+  http_body_t framing = {0};
+  if (http_parse_framing(request, &framing) != 0) return -1;
+  if (framing.framing == HTTP_BODY_NONE) return 0;
+
+  // The body starts after the blank line
+  http_body_t *body = (http_body_t *) http_alloc(arena, sizeof(http_body_t));
+  if (!body) return -1;
+
+  *body                = framing;
+  body->pending        = head_end + 4;
+  body->pending_length = length - (size_t) (body->pending - raw);
+  request->body_stream = body;
+
+  return 0;
+}
+
+void http_set_body_source(http_request_t *request, http_body_source_t source, void *ctx) {
+  if (request->body_stream) {
+    request->body_stream->source     = source;
+    request->body_stream->source_ctx = ctx;
+  }
+}
+
+static int hex_value(char c) {
+  if (c >= '0' && c <= '9') return c - '0';
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+  return -1;
+}
+
+// Decode chunked framing in place. Returns the number of body bytes moved
+// to the start of data; anything after the final chunk is discarded.
+static size_t http_chunked_decode(http_body_t *body, char *data, size_t length) {
+  size_t in  = 0;
+  size_t out = 0;
+
+  while (in < length && !body->done && !body->error) {
+    char c = data[in];
+
+    switch (body->chunk_state) {
+    case CHUNK_SIZE: {
+      int digit = hex_value(c);
+      if (digit >= 0 && body->chunk_digits < HTTP_CHUNK_SIZE_DIGITS) {
+        body->remaining = body->remaining * 16 + (uint64_t) digit;
+        body->chunk_digits++;
+      } else if (body->chunk_digits > 0 && (c == ';' || c == '\r')) {
+        body->chunk_state = c == ';' ? CHUNK_EXTENSION : CHUNK_SIZE_LF;
+      } else {
+        body->error = true;
+      }
+      in++;
+      break;
+    }
+    case CHUNK_EXTENSION:
+      if (c == '\r') {
+        body->chunk_state = CHUNK_SIZE_LF;
+      }
+      in++;
+      break;
+    case CHUNK_SIZE_LF:
+      if (c != '\n') {
+        body->error = true;
+      }
+      body->chunk_state = body->remaining > 0 ? CHUNK_DATA : CHUNK_TRAILER;
+      in++;
+      break;
+    case CHUNK_DATA: {
+      size_t take = length - in;
+      if (take > body->remaining) {
+        take = (size_t) body->remaining;
+      }
+      memmove(data + out, data + in, take);
+      in += take;
+      out += take;
+      body->remaining -= take;
+      if (body->remaining == 0) {
+        body->chunk_state = CHUNK_DATA_CR;
+      }
+      break;
+    }
+    case CHUNK_DATA_CR:
+    case CHUNK_DATA_LF:
+      if (c != (body->chunk_state == CHUNK_DATA_CR ? '\r' : '\n')) {
+        body->error = true;
+      } else if (body->chunk_state == CHUNK_DATA_CR) {
+        body->chunk_state = CHUNK_DATA_LF;
+      } else {
+        body->chunk_state  = CHUNK_SIZE;
+        body->chunk_digits = 0;
+      }
+      in++;
+      break;
+    case CHUNK_TRAILER:
+      // Trailer fields are skipped; an empty line ends the body
+      body->chunk_state = c == '\r' ? CHUNK_END_LF : CHUNK_TRAILER_LINE;
+      in++;
+      break;
+    case CHUNK_TRAILER_LINE:
+      if (c == '\r') {
+        body->chunk_state = CHUNK_TRAILER_LINE_LF;
+      }
+      in++;
+      break;
+    case CHUNK_TRAILER_LINE_LF:
+    case CHUNK_END_LF:
+      if (c != '\n') {
+        body->error = true;
+      } else if (body->chunk_state == CHUNK_END_LF) {
+        body->done = true;
+      } else {
+        body->chunk_state = CHUNK_TRAILER;
+      }
+      in++;
+      break;
+    }
+  }
+
+  return out;
+}
+
+ssize_t http_body_read(const http_request_t *request, void *buf, size_t size) {
+  http_body_t *body = request->body_stream;
+  if (!body || body->done || size == 0) {
+    return 0;
+  }
+
+  while (!body->error) {
+    size_t want = size;
+    if (body->framing == HTTP_BODY_LENGTH && want > body->remaining) {
+      want = (size_t) body->remaining;
+    }
+
+    size_t got;
+    if (body->pending_length > 0) {
+      got = want < body->pending_length ? want : body->pending_length;
+      memcpy(buf, body->pending, got);
+      body->pending += got;
+      body->pending_length -= got;
+    } else if (body->source) {
+      ssize_t n = body->source(body->source_ctx, buf, want);
+      if (n <= 0) {
+        body->timed_out = n < 0 && errno == ETIMEDOUT;
+        break; // The connection ended before the body did
+      }
+      got = (size_t) n;
+    } else {
+      break; // Truncated in-memory request
+    }
+
+    if (body->framing == HTTP_BODY_LENGTH) {
+      body->remaining -= got;
+      body->done = body->remaining == 0;
+      return (ssize_t) got;
+    }
+
+    size_t decoded = http_chunked_decode(body, (char *) buf, got);
+    if (decoded > 0 && !body->error) {
+      return (ssize_t) decoded;
+    }
+    if (body->done) {
+      return 0;
     }
   }
 
+  body->error = true;
+  return -1;
+}
+
+// Grow a body buffer; arena memory is copied since the arena cannot resize
+static char *http_body_grow(arena_t *arena, char *data, size_t length, size_t size) {
+  if (!arena) {
+    return (char *) realloc(data, size);
+  }
+  char *grown = (char *) arena_alloc(arena, size);
+  if (grown && length > 0) {
+    memcpy(grown, data, length);
+  }
+  return grown;
+}
+
+int http_read_body(http_request_t *request, size_t max_size) {
+  http_body_t *body = request->body_stream;
+  if (request->body || !body) {
+    return 0;
+  }
+
+  size_t capacity;
+  if (body->framing == HTTP_BODY_LENGTH) {
+    if (body->remaining > max_size) {
+      return HTTP_BODY_TOO_LARGE;
+    }
+    capacity = (size_t) body->remaining;
+  } else {
+    capacity = max_size < HTTP_BODY_INITIAL_CAPACITY ? max_size : HTTP_BODY_INITIAL_CAPACITY;
+  }
+
+  char *data = (char *) http_alloc(request->arena, capacity + 1);
+  if (!data) {
+    return HTTP_BODY_ERROR;
+  }
+
+  size_t length = 0;
+  int result    = 0;
+  for (;;) {
+    if (length == capacity) {
+      if (body->framing == HTTP_BODY_LENGTH) {
+        break;
+      }
+      if (capacity == max_size) {
+        // Full: one more byte means the body is over the limit
+        char probe;
+        ssize_t n = http_body_read(request, &probe, 1);
+        if (n < 0) {
+          result = body->timed_out ? HTTP_BODY_TIMEOUT : HTTP_BODY_ERROR;
+        } else {
+          result = n > 0 ? HTTP_BODY_TOO_LARGE : 0;
+        }
+        break;
+      }
+
+      size_t grown_capacity = capacity > max_size / 2 ? max_size : capacity * 2;
+      char *grown           = http_body_grow(request->arena, data, length, grown_capacity + 1);
+      if (!grown) {
+        result = HTTP_BODY_ERROR;
+        break;
+      }
+      data     = grown;
+      capacity = grown_capacity;
+    }
+
+    ssize_t n = http_body_read(request, data + length, capacity - length);
+    if (n < 0) {
+      result = body->timed_out ? HTTP_BODY_TIMEOUT : HTTP_BODY_ERROR;
+      break;
+    }
+    if (n == 0) {
+      break;
+    }
+    length += (size_t) n;
+  }
+
+  if (result != 0) {
+    if (!request->arena) {
+      free(data);
+    }
+    return result;
+  }
+
+  data[length]         = '\0';
+  request->body        = data;
+  request->body_length = length;
   return 0;
 }
 
 void http_free_request(http_request_t *request) {
-  if (request->body) {
+  if (!request->arena) {
     free(request->body);
-    request->body = NULL;
+    free(request->body_stream);
+  }
+  // Arena memory goes when the arena is reset
+  request->body        = NULL;
+  request->body_stream = NULL;
+}
+
+void *http_request_alloc(const http_request_t *request, size_t size) {
+  return request->arena ? arena_alloc(request->arena, size) : NULL;
+}
+
+http_header_id_t http_header_classify(const char *name, size_t length) {
+  // Length and first letter narrow it to one candidate, so at most one
+  // comparison runs
+  const char *candidate;
+  http_header_id_t id;
+
+  switch (length) {
+  case 4:
+    candidate = "Host";
+    id        = HTTP_HEADER_HOST;
+    break;
+  case 6:
+    candidate = "Cookie";
+    id        = HTTP_HEADER_COOKIE;
+    break;
+  case 10:
+    candidate = "Connection";
+    id        = HTTP_HEADER_CONNECTION;
+    break;
+  case 13:
+    if ((name[0] | 0x20) == 'a') {
+      candidate = "Authorization";
+      id        = HTTP_HEADER_AUTHORIZATION;
+    } else {
+      candidate = "If-None-Match";
+      id        = HTTP_HEADER_IF_NONE_MATCH;
+    }
+    break;
+  case 14:
+    candidate = "Content-Length";
+    id        = HTTP_HEADER_CONTENT_LENGTH;
+    break;
+  case 15:
+    candidate = "Accept-Encoding";
+    id        = HTTP_HEADER_ACCEPT_ENCODING;
+    break;
+  case 17:
+    candidate = "Transfer-Encoding";
+    id        = HTTP_HEADER_TRANSFER_ENCODING;
+    break;
+  default:
+    return HTTP_HEADER_UNKNOWN;
+  }
+
+  return strncasecmp(name, candidate, length) == 0 ? id : HTTP_HEADER_UNKNOWN;
+}
+
+const char *http_get_known_header(const http_request_t *request, http_header_id_t id) {
+  if (id < 0 || id >= HTTP_HEADER_KNOWN_COUNT || !request->known_headers[id]) {
+    return NULL;
   }
+  return request->headers[request->known_headers[id] - 1][1];
 }
 
 const char *http_get_header(const http_request_t *request, const char *name) {
+  http_header_id_t id = http_header_classify(name, strlen(name));
+  if (id != HTTP_HEADER_UNKNOWN) {
+    return http_get_known_header(request, id);
+  }
+
   for (int i = 0; i < request->header_count; i++) {
     if (strcasecmp(request->headers[i][0], name) == 0) {
       return request->headers[i][1];
@@ -79,46 +474,188 @@ const char *http_get_header(const http_request_t *request, const char *name) {
   return NULL;
 }
 
-int http_parse_post_data(const char *body, const char *key, char *value, size_t value_size) {
-  if (!body || !key || !value) return -1;
+// Offset of the first byte in data[0..length) that form decoding has to
+// look at ('%', '+', '&' or '='), or length if there is none. Plain runs
+// between them are skipped 16 bytes at a time where SSE2 is available.
+static size_t http_form_scan(const char *data, size_t length) {
+  size_t i = 0;
 
-  char search_key[256];
-  snprintf(search_key, sizeof(search_key), "%s=", key);
+#ifdef __SSE2__
+  const __m128i percent = _mm_set1_epi8('%');
+  const __m128i plus    = _mm_set1_epi8('+');
+  const __m128i amp     = _mm_set1_epi8('&');
+  const __m128i equals  = _mm_set1_epi8('=');
 
-  const char *start = strstr(body, search_key);
-  if (!start) return -1;
-
-  start += strlen(search_key);
-  const char *end = strchr(start, '&');
+  for (; i + 16 <= length; i += 16) {
+    __m128i block = _mm_loadu_si128((const __m128i *) (data + i));
+    __m128i hits  = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(block, percent),
+                                              _mm_cmpeq_epi8(block, plus)),
+                                 _mm_or_si128(_mm_cmpeq_epi8(block, amp),
+                                              _mm_cmpeq_epi8(block, equals)));
+    int mask      = _mm_movemask_epi8(hits);
+    if (mask) {
+      return i + (size_t) __builtin_ctz((unsigned) mask);
+    }
+  }
+#endif
 
-  size_t len;
-  if (end) {
-    len = end - start;
-  } else {
-    len = strlen(start);
+  for (; i < length; i++) {
+    char c = data[i];
+    if (c == '%' || c == '+' || c == '&' || c == '=') {
+      break;
+    }
   }
+  return i;
+}
 
-  if (len >= value_size) len = value_size - 1;
+// Decode one key (stopping at '=' or '&') or value (stopping at '&') in
+// place. Decoded bytes never outrun the input, so *write trails *read.
+static size_t http_form_decode(char *data, size_t length, size_t *read, size_t *write,
+                               bool is_key) {
+  size_t start = *write;
+  size_t r     = *read;
+  size_t w     = *write;
 
-  strncpy(value, start, len);
-  value[len] = '\0';
+  while (r < length) {
+    size_t run = http_form_scan(data + r, length - r);
+    if (w != r) {
+      memmove(data + w, data + r, run);
+    }
+    r += run;
+    w += run;
+    if (r >= length) {
+      break;
+    }
 
-  // URL decode (simple version - just handle %20 for spaces)
-  char *dst = value;
-  const char *src = value;
-  while (*src) {
-    if (*src == '+') {
-      *dst++ = ' ';
-      src++;
-    } else if (*src == '%' && isxdigit(src[1]) && isxdigit(src[2])) {
-      char hex[3] = {src[1], src[2], '\0'};
-      *dst++ = (char)strtol(hex, NULL, 16);
-      src += 3;
+    char c = data[r];
+    if (c == '&' || (c == '=' && is_key)) {
+      break;
+    }
+    if (c == '+') {
+      data[w++] = ' ';
+      r++;
+    } else if (c == '%' && r + 2 < length && hex_value(data[r + 1]) >= 0 &&
+               hex_value(data[r + 2]) >= 0) {
+      data[w++] = (char) (hex_value(data[r + 1]) << 4 | hex_value(data[r + 2]));
+      r += 3;
     } else {
-      *dst++ = *src++;
+      data[w++] = c; // '=' inside a value, or a stray '%'
+      r++;
+    }
+  }
+
+  *read  = r;
+  *write = w;
+  return w - start;
+}
+
+static uint32_t http_form_hash(const char *name, size_t length) {
+  uint32_t hash = 2166136261u; // FNV-1a
+  for (size_t i = 0; i < length; i++) {
+    hash ^= (unsigned char) name[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+static void http_form_index(http_form_t *form, size_t field) {
+  uint32_t hash = form->fields[field].hash;
+  for (size_t probe = 0; probe < HTTP_FORM_SLOTS; probe++) {
+    uint8_t *slot = &form->slots[(hash + probe) & (HTTP_FORM_SLOTS - 1)];
+    if (*slot == 0) {
+      *slot = (uint8_t) (field + 1);
+      return;
+    }
+    const http_form_field_t *other = &form->fields[*slot - 1];
+    if (other->hash == hash && other->name_length == form->fields[field].name_length &&
+        memcmp(other->name, form->fields[field].name, other->name_length) == 0) {
+      return; // Repeated name: the first occurrence wins
+    }
+  }
+}
+
+int http_form_parse(http_form_t *form, char *data, size_t length) {
+  memset(form, 0, sizeof(*form));
+  if (!data) {
+    return -1;
+  }
+
+  size_t read  = 0;
+  size_t write = 0;
+  while (read < length) {
+    size_t name_start   = write;
+    size_t name_length  = http_form_decode(data, length, &read, &write, true);
+    size_t value_start  = write;
+    size_t value_length = 0;
+
+    // Separators become the terminators of the decoded strings before them
+    bool has_value = read < length && data[read] == '=';
+    data[write++]  = '\0';
+    read++;
+    if (has_value) {
+      value_start   = write;
+      value_length  = http_form_decode(data, length, &read, &write, false);
+      data[write++] = '\0';
+      read++;
+    }
+
+    if (name_length == 0 || form->count == HTTP_FORM_MAX_FIELDS) {
+      continue; // Empty segments ("a=1&&b=2") and fields past the limit
     }
+
+    http_form_field_t *field = &form->fields[form->count];
+    field->name              = data + name_start;
+    field->name_length       = name_length;
+    field->value             = data + value_start;
+    field->value_length      = value_length;
+    field->hash              = http_form_hash(field->name, name_length);
+    http_form_index(form, form->count);
+    form->count++;
   }
-  *dst = '\0';
 
   return 0;
 }
+
+const char *http_form_get(const http_form_t *form, const char *name, size_t *length) {
+  size_t name_length = strlen(name);
+  uint32_t hash      = http_form_hash(name, name_length);
+
+  for (size_t probe = 0; probe < HTTP_FORM_SLOTS; probe++) {
+    uint8_t slot = form->slots[(hash + probe) & (HTTP_FORM_SLOTS - 1)];
+    if (slot == 0) {
+      break;
+    }
+    const http_form_field_t *field = &form->fields[slot - 1];
+    if (field->hash == hash && field->name_length == name_length &&
+        memcmp(field->name, name, name_length) == 0) {
+      if (length) {
+        *length = field->value_length;
+      }
+      return field->value;
+    }
+  }
+  return NULL;
+}
+
+int http_parse_post_data(const char *body, const char *key, char *value, size_t value_size) {
+  if (!body || !key || !value || value_size == 0) return -1;
+
+  // Decoding works in place, so it runs on a copy
+  size_t length = strlen(body);
+  char *copy    = malloc(length + 1);
+  if (!copy) return -1;
+  memcpy(copy, body, length + 1);
+
+  http_form_t form;
+  size_t value_length;
+  http_form_parse(&form, copy, length);
+  const char *found = http_form_get(&form, key, &value_length);
+  if (found) {
+    if (value_length >= value_size) value_length = value_size - 1;
+    memcpy(value, found, value_length);
+    value[value_length] = '\0';
+  }
+
+  free(copy);
+  return found ? 0 : -1;
+}
@@ -0,0 +1,238 @@
+#include "json.h"
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+void json_init(json_writer_t *json, char *buffer, size_t capacity) {
+  memset(json, 0, sizeof(*json));
+  json->buffer   = buffer;
+  json->capacity = capacity > 0 ? capacity - 1 : 0; // Room for the terminator
+  json->overflow = capacity == 0;
+}
+
+static void json_put(json_writer_t *json, const char *data, size_t length) {
+  if (json->overflow || length > json->capacity - json->length) {
+    json->overflow = true;
+    return;
+  }
+  memcpy(json->buffer + json->length, data, length);
+  json->length += length;
+}
+
+static void json_putc(json_writer_t *json, char c) {
+  if (json->overflow || json->length == json->capacity) {
+    json->overflow = true;
+    return;
+  }
+  json->buffer[json->length++] = c;
+}
+
+// Comma before every item of an array or object but the first
+static void json_separator(json_writer_t *json) {
+  if (json->after_key) {
+    json->after_key = false;
+    return;
+  }
+  if (json->depth > 0) {
+    uint32_t bit = 1u << (json->depth - 1);
+    if (json->has_items & bit) {
+      json_putc(json, ',');
+    }
+    json->has_items |= bit;
+  }
+}
+
+static void json_open(json_writer_t *json, char bracket) {
+  json_separator(json);
+  if (json->depth == JSON_MAX_DEPTH) {
+    json->overflow = true;
+    return;
+  }
+  json_putc(json, bracket);
+  json->has_items &= ~(1u << json->depth);
+  json->depth++;
+}
+
+static void json_close(json_writer_t *json, char bracket) {
+  if (json->depth == 0 || json->after_key) {
+    json->overflow = true; // Unbalanced, or a key without a value
+    return;
+  }
+  json->depth--;
+  json_putc(json, bracket);
+}
+
+void json_object_begin(json_writer_t *json) {
+  json_open(json, '{');
+}
+
+void json_object_end(json_writer_t *json) {
+  json_close(json, '}');
+}
+
+void json_array_begin(json_writer_t *json) {
+  json_open(json, '[');
+}
+
+void json_array_end(json_writer_t *json) {
+  json_close(json, ']');
+}
+
+// Length of the leading run that can be copied without escaping: no quote,
+// backslash or control character. SSE2 checks 16 bytes per step.
+static size_t json_plain_run(const char *data, size_t length) {
+  size_t i = 0;
+
+#ifdef __SSE2__
+  const __m128i quote     = _mm_set1_epi8('"');
+  const __m128i backslash = _mm_set1_epi8('\\');
+  const __m128i control   = _mm_set1_epi8(0x1f);
+
+  for (; i + 16 <= length; i += 16) {
+    __m128i block = _mm_loadu_si128((const __m128i *) (data + i));
+    // max(b, 0x1f) == 0x1f exactly when b <= 0x1f, compared unsigned
+    __m128i special = _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(block, quote), _mm_cmpeq_epi8(block, backslash)),
+        _mm_cmpeq_epi8(_mm_max_epu8(block, control), control));
+    int mask = _mm_movemask_epi8(special);
+    if (mask) {
+      return i + (size_t) __builtin_ctz((unsigned) mask);
+    }
+  }
+#endif
+
+  for (; i < length; i++) {
+    unsigned char c = (unsigned char) data[i];
+    if (c == '"' || c == '\\' || c < 0x20) {
+      break;
+    }
+  }
+  return i;
+}
+
+static void json_escaped(json_writer_t *json, const char *value, size_t length) {
+  static const char hex[] = "0123456789abcdef";
+
+  json_putc(json, '"');
+  size_t i = 0;
+  while (i < length) {
+    size_t run = json_plain_run(value + i, length - i);
+    json_put(json, value + i, run);
+    i += run;
+    if (i == length) {
+      break;
+    }
+
+    unsigned char c = (unsigned char) value[i++];
+    char escape[6]  = {'\\', 0};
+    size_t size     = 2;
+    switch (c) {
+    case '"':
+    case '\\':
+      escape[1] = (char) c;
+      break;
+    case '\n':
+      escape[1] = 'n';
+      break;
+    case '\r':
+      escape[1] = 'r';
+      break;
+    case '\t':
+      escape[1] = 't';
+      break;
+    case '\b':
+      escape[1] = 'b';
+      break;
+    case '\f':
+      escape[1] = 'f';
+      break;
+    default:
+      memcpy(escape + 1, "u00", 3);
+      escape[4] = hex[c >> 4];
+      escape[5] = hex[c & 0xf];
+      size      = 6;
+      break;
+    }
+    json_put(json, escape, size);
+  }
+  json_putc(json, '"');
+}
+
+void json_key(json_writer_t *json, const char *key) {
+  json_separator(json);
+  json_escaped(json, key, strlen(key));
+  json_putc(json, ':');
+  json->after_key = true;
+}
+
+void json_string(json_writer_t *json, const char *value) {
+  if (!value) {
+    json_null(json);
+    return;
+  }
+  json_string_n(json, value, strlen(value));
+}
+
+void json_string_n(json_writer_t *json, const char *value, size_t length) {
+  json_separator(json);
+  json_escaped(json, value, length);
+}
+
+void json_int(json_writer_t *json, long long value) {
+  char digits[24];
+  char *p = digits + sizeof(digits);
+  // Negate as unsigned so LLONG_MIN works too
+  unsigned long long magnitude = value < 0 ? 0ull - (unsigned long long) value
+                                           : (unsigned long long) value;
+
+  do {
+    *--p = (char) ('0' + magnitude % 10);
+    magnitude /= 10;
+  } while (magnitude);
+  if (value < 0) {
+    *--p = '-';
+  }
+
+  json_separator(json);
+  json_put(json, p, (size_t) (digits + sizeof(digits) - p));
+}
+
+void json_double(json_writer_t *json, double value) {
+  if (!isfinite(value)) {
+    json_null(json);
+    return;
+  }
+
+  char number[32];
+  int length = snprintf(number, sizeof(number), "%.17g", value);
+  json_separator(json);
+  json_put(json, number, (size_t) length);
+}
+
+void json_bool(json_writer_t *json, bool value) {
+  json_separator(json);
+  if (value) {
+    json_put(json, "true", 4);
+  } else {
+    json_put(json, "false", 5);
+  }
+}
+
+void json_null(json_writer_t *json) {
+  json_separator(json);
+  json_put(json, "null", 4);
+}
+
+const char *json_finish(json_writer_t *json, size_t *length) {
+  if (json->overflow || json->depth != 0 || json->after_key || json->length == 0) {
+    return NULL;
+  }
+  json->buffer[json->length] = '\0';
+  if (length) {
+    *length = json->length;
+  }
+  return json->buffer;
+}
@@ -1,52 +1,90 @@
 #include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <netinet/in.h>
 #include <signal.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
 #include <sys/socket.h>
 #include <unistd.h>
 
+#include "access_log.h"
+#include "connection.h"
 #include "db.h"
+#include "event_loop.h"
 #include "handlers.h"
 #include "http.h"
+#include "metrics.h"
+#include "password.h"
+#include "probes.h"
+#include "response.h"
 #include "router.h"
 #include "security.h"
 #include "thread_pool.h"
+#include "trace.h"
 #include "tls.h"
 
 #define PORT 8080
 #define TLS_PORT 8443
-#define BUFFER_SIZE 4096
 #define DB_PATH "data/server.db"
+#define ACCESS_LOG_PATH "data/access.log"
+#define METRICS_PATH "/metrics" // Default scrape route, see --metrics-path=
+#define SLOW_LOG_PATH "data/slow.log"
 #define CERT_PATH "certs/cert.pem"
 #define KEY_PATH "certs/key.pem"
 #define THREAD_POOL_SIZE 8
-
-// Client connection context
-typedef struct {
-  int client_fd;
-  char client_ip[46];
-  SSL_CTX *ssl_ctx; // NULL for HTTP, non-NULL for HTTPS
-} client_context_t;
+#define CONNECTION_POOL_SIZE 1024 // Preallocated connections (about 14 KB each)
+#define PASSWORD_THREADS 2      // Concurrent scrypt hashes (16 MB each)
+#define PASSWORD_QUEUE_SIZE 64  // Logins allowed to wait for a hash slot
+#define DB_ASYNC_THREADS 4      // Threads running database calls for handlers
+#define DB_ASYNC_QUEUE_SIZE 256 // Database calls allowed to wait for a thread
 
 // Global state for cleanup
 static int g_server_fd                            = -1;
 static SSL_CTX *g_ssl_ctx                         = NULL;
 static thread_pool_t *g_thread_pool               = NULL;
+static event_loop_t *g_event_loop                 = NULL;
 static volatile sig_atomic_t g_shutdown_requested = 0;
+static atomic_ulong g_connection_timeouts          = 0;
+static atomic_ulong g_conn_limit_rejected          = 0;
+static atomic_ulong g_worker_queue_full            = 0;
 
 static void cleanup(void) {
+  if (g_event_loop) {
+    event_loop_destroy(g_event_loop);
+    g_event_loop = NULL;
+  }
   if (g_thread_pool) {
+    // Database completions still arriving respond inline from here on
+    connection_set_worker_pool(NULL);
     thread_pool_destroy(g_thread_pool);
     g_thread_pool = NULL;
   }
+  db_async_shutdown();
+  password_executor_shutdown();
+  access_log_shutdown();
+  trace_shutdown();
+  connection_pool_destroy();
   if (g_server_fd >= 0) {
     close(g_server_fd);
     g_server_fd = -1;
   }
   if (g_ssl_ctx) {
+    tls_stats_t stats;
+    tls_get_stats(&stats);
+    printf("\nTLS handshakes: %lu full, %lu resumed, %lu failed, %lu with kTLS\n",
+           stats.full_handshakes, stats.resumed_handshakes, stats.failed_handshakes,
+           stats.ktls_connections);
+    if (stats.active_connections > 0) {
+      printf("TLS memory: %zu bytes across %lu connections (%zu per connection), "
+             "%zu pooled buffers\n",
+             stats.memory_in_use, stats.active_connections,
+             stats.memory_in_use / stats.active_connections, stats.pooled_buffers);
+    }
     tls_cleanup_context(g_ssl_ctx);
     g_ssl_ctx = NULL;
   }
@@ -59,9 +97,11 @@ static void signal_handler(int signum) {
   g_shutdown_requested = 1;
 }
 
-static void setup_routes(void) {
+static void setup_routes(const char *metrics_path) {
   router_init();
 
+  router_set_error_handler(handle_error);
+
   // Register global logging middleware
   router_use_global_middleware(logging_middleware);
 
@@ -69,101 +109,344 @@ static void setup_routes(void) {
   router_register("GET", "/", handle_index);
 
   // Protected routes - require authentication
-  middleware_t auth_middlewares[] = {auth_middleware};
+  static middleware_t auth_middlewares[] = {auth_middleware};
   router_register_with_middleware("GET", "/dashboard", handle_dashboard, auth_middlewares, 1);
   router_register_with_middleware("POST", "/logout", handle_logout, auth_middlewares, 1);
 
   router_register("POST", "/register", handle_register);
   router_register("POST", "/login", handle_login);
+
+  router_register("GET", metrics_path, handle_metrics);
 }
 
-static void handle_client_connection(void *arg) {
-  client_context_t *ctx    = (client_context_t *) arg;
-  char buffer[BUFFER_SIZE] = {0};
-  SSL *ssl                 = NULL;
-
-  // Handle TLS if needed
-  if (ctx->ssl_ctx) {
-    ssl = tls_accept_connection(ctx->ssl_ctx, ctx->client_fd);
-    if (!ssl) {
-      fprintf(stderr, "Failed to establish SSL connection\n");
-      close(ctx->client_fd);
-      free(ctx);
-      return;
-    }
-  }
+// Values sampled by the metrics module at scrape time
+static double metric_queue_depth(void) {
+  return thread_pool_get_queue_depth(g_thread_pool);
+}
+
+static double metric_active_workers(void) {
+  return thread_pool_get_active_count(g_thread_pool);
+}
 
-  // Read request
-  ssize_t bytes_read;
-  if (ssl) {
-    bytes_read = tls_read(ssl, buffer, BUFFER_SIZE - 1);
-  } else {
-    bytes_read = read(ctx->client_fd, buffer, BUFFER_SIZE - 1);
+static double metric_sessions(void) {
+  return (double) session_count();
+}
+
+static double metric_rate_limit_entries(void) {
+  return (double) rate_limit_count();
+}
+
+static double metric_access_log_dropped(void) {
+  return (double) access_log_dropped();
+}
+
+static double metric_connections_open(void) {
+  return (double) connection_pool_stats().in_use;
+}
+
+static double metric_connection_overflow(void) {
+  return (double) connection_pool_stats().overflow;
+}
+
+static double metric_connection_timeouts(void) {
+  return (double) atomic_load(&g_connection_timeouts);
+}
+
+static double metric_worker_queue_full(void) {
+  return (double) atomic_load(&g_worker_queue_full);
+}
+
+static double metric_conn_limit_rejected(void) {
+  return (double) atomic_load(&g_conn_limit_rejected);
+}
+
+static double metric_conn_limit_clients(void) {
+  return (double) conn_limit_count();
+}
+
+static double metric_tls_full_handshakes(void) {
+  tls_stats_t stats;
+  tls_get_stats(&stats);
+  return (double) stats.full_handshakes;
+}
+
+static double metric_tls_resumed_handshakes(void) {
+  tls_stats_t stats;
+  tls_get_stats(&stats);
+  return (double) stats.resumed_handshakes;
+}
+
+static double metric_tls_failed_handshakes(void) {
+  tls_stats_t stats;
+  tls_get_stats(&stats);
+  return (double) stats.failed_handshakes;
+}
+
+static double metric_tls_connections(void) {
+  tls_stats_t stats;
+  tls_get_stats(&stats);
+  return (double) stats.active_connections;
+}
+
+static double metric_tls_memory(void) {
+  tls_stats_t stats;
+  tls_get_stats(&stats);
+  return (double) stats.memory_in_use;
+}
+
+static void setup_metrics(bool use_tls) {
+  metrics_register("thread_pool_queue_depth", "Connections waiting for a worker.", METRIC_GAUGE,
+                   metric_queue_depth);
+  metrics_register("thread_pool_active_workers", "Workers handling a connection.", METRIC_GAUGE,
+                   metric_active_workers);
+  metrics_register("sessions_active", "Sessions in the session table.", METRIC_GAUGE,
+                   metric_sessions);
+  metrics_register("rate_limit_entries", "Client addresses tracked by the login rate limiter.",
+                   METRIC_GAUGE, metric_rate_limit_entries);
+  metrics_register("access_log_dropped_total", "Access log entries dropped on full buffers.",
+                   METRIC_COUNTER, metric_access_log_dropped);
+  metrics_register("connections_open", "Client connections currently open.", METRIC_GAUGE,
+                   metric_connections_open);
+  metrics_register("connection_pool_overflow_total",
+                   "Connections allocated on the heap because the slab was exhausted.",
+                   METRIC_COUNTER, metric_connection_overflow);
+  metrics_register("connection_timeouts_total",
+                   "Connections closed for missing the idle or request head deadline.",
+                   METRIC_COUNTER, metric_connection_timeouts);
+  metrics_register("thread_pool_rejected_total",
+                   "Requests answered 503 because the worker queue was full.", METRIC_COUNTER,
+                   metric_worker_queue_full);
+  metrics_register("connection_limit_rejected_total",
+                   "Connections refused at accept by the per-client limit, or because "
+                   "the limit table had no room for another client.",
+                   METRIC_COUNTER, metric_conn_limit_rejected);
+  metrics_register("connection_limit_clients", "Client addresses with open connections.",
+                   METRIC_GAUGE, metric_conn_limit_clients);
+
+  if (use_tls) {
+    metrics_register("tls_full_handshakes_total", "TLS handshakes without resumption.",
+                     METRIC_COUNTER, metric_tls_full_handshakes);
+    metrics_register("tls_resumed_handshakes_total", "TLS handshakes resuming a session.",
+                     METRIC_COUNTER, metric_tls_resumed_handshakes);
+    metrics_register("tls_failed_handshakes_total", "TLS handshakes that failed.", METRIC_COUNTER,
+                     metric_tls_failed_handshakes);
+    metrics_register("tls_connections", "Open TLS connections.", METRIC_GAUGE,
+                     metric_tls_connections);
+    metrics_register("tls_memory_bytes", "OpenSSL heap held by open connections.", METRIC_GAUGE,
+                     metric_tls_memory);
   }
+}
 
-  if (bytes_read <= 0) {
-    if (ssl)
-      tls_close(ssl);
-    close(ctx->client_fd);
-    free(ctx);
+static void handle_client_connection(void *arg) {
+  connection_t *conn = (connection_t *) arg;
+
+  trace_mark(&conn->trace, TRACE_WORKER_START);
+
+  // The event loop has read the request head; body bytes that arrived with
+  // it stay in the buffer as the start of the body stream
+  http_request_t req;
+  int parsed = http_parse_head(conn->read_buffer, conn->read_length, &req, &conn->arena);
+  trace_mark(&conn->trace, TRACE_PARSED);
+  if (parsed == HTTP_HEAD_TOO_LARGE) {
+    response_send(conn, "431 Request Header Fields Too Large", "text/plain", NULL,
+                  "Request Header Fields Too Large", 31);
+    connection_release(conn);
+    return;
+  }
+  if (parsed != 0) {
+    response_send(conn, "400 Bad Request", "text/plain", NULL, "Bad Request", 11);
+    connection_release(conn);
     return;
   }
-  buffer[bytes_read] = '\0';
 
-  // Parse HTTP request
-  http_request_t req;
-  if (http_parse_request(buffer, &req) != 0) {
-    const char *bad_request = "HTTP/1.1 400 Bad Request\r\n"
-                              "Content-Type: text/plain\r\n"
-                              "Connection: close\r\n\r\nBad Request";
-    if (ssl) {
-      tls_write(ssl, bad_request, strlen(bad_request));
-      tls_close(ssl);
+  PROBE3(request_parsed, conn, req.method, req.path);
+
+  // Set client IP, SSL and connection in request
+  strncpy(req.client_ip, conn->client_ip, sizeof(req.client_ip) - 1);
+  req.ssl  = conn->ssl;
+  req.conn = conn;
+  http_set_body_source(&req, connection_body_source, conn);
+
+  const char *expect    = http_get_header(&req, "Expect");
+  conn->expect_continue = expect && strcasecmp(expect, "100-continue") == 0;
+
+  // Handle route. A handler that finishes asynchronously retains the
+  // connection, so this release does not close it.
+  router_handle(conn->client_fd, &req);
+  http_free_request(&req);
+
+  connection_release(conn);
+}
+
+// Read whatever request bytes are available without blocking. Returns the
+// status to wait for, TLS_IO_DONE once the head is complete (or fills the
+// buffer, or the client stops sending after part of it), or TLS_IO_ERROR.
+static tls_io_status_t read_request_head(connection_t *conn) {
+  char *buffer = conn->read_buffer;
+
+  while (conn->read_length < CONNECTION_READ_BUFFER_SIZE - 1) {
+    char *end    = buffer + conn->read_length;
+    size_t space = CONNECTION_READ_BUFFER_SIZE - 1 - conn->read_length;
+    size_t n;
+
+    if (conn->ssl) {
+      tls_io_status_t status = tls_read_nonblock(conn->ssl, end, space, &n);
+      if (status == TLS_IO_CLOSED) {
+        return conn->read_length > 0 ? TLS_IO_DONE : TLS_IO_ERROR;
+      }
+      if (status != TLS_IO_DONE) {
+        return status;
+      }
     } else {
-      write(ctx->client_fd, bad_request, strlen(bad_request));
+      ssize_t r = read(conn->client_fd, end, space);
+      if (r < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        return errno == EAGAIN || errno == EWOULDBLOCK ? TLS_IO_WANT_READ : TLS_IO_ERROR;
+      }
+      if (r == 0) {
+        return conn->read_length > 0 ? TLS_IO_DONE : TLS_IO_ERROR;
+      }
+      n = (size_t) r;
+    }
+
+    // The blank line may straddle two reads
+    size_t from = conn->read_length > 3 ? conn->read_length - 3 : 0;
+    conn->read_length += n;
+    buffer[conn->read_length] = '\0';
+    if (strstr(buffer + from, "\r\n\r\n")) {
+      return TLS_IO_DONE;
     }
-    close(ctx->client_fd);
-    free(ctx);
-    return;
   }
 
-  // Set client IP and SSL in request
-  strncpy(req.client_ip, ctx->client_ip, sizeof(req.client_ip) - 1);
-  req.ssl = ssl;
+  return TLS_IO_DONE;
+}
 
-  // Handle route
-  router_handle(ctx->client_fd, &req);
-  http_free_request(&req);
+// Runs on the event loop thread. Drives the TLS handshake from readiness
+// events, then collects the request head, so a slow client holds no worker
+// thread until its request is ready to handle.
+static void on_connection_event(event_watch_t *watch, uint32_t events) {
+  connection_t *conn     = connection_from_watch(watch);
+  tls_io_status_t status = TLS_IO_ERROR;
+
+  if (!(events & EPOLLERR)) {
+    status = TLS_IO_DONE;
+    if (conn->ssl && !conn->tls_ready) {
+      status = tls_handshake(conn->ssl);
+      if (status == TLS_IO_DONE) {
+        conn->tls_ready = true;
+        trace_mark(&conn->trace, TRACE_HANDSHAKE_DONE);
+      }
+    }
+    if (status == TLS_IO_DONE) {
+      status = read_request_head(conn);
+    }
+  }
+
+  if (status == TLS_IO_WANT_READ || status == TLS_IO_WANT_WRITE) {
+    // The client has started; the idle deadline gives way to the header one
+    uint64_t header_deadline = conn->accepted_ns + MS_TO_NS(CONNECTION_HEADER_TIMEOUT_MS);
+    uint32_t wanted          = status == TLS_IO_WANT_READ ? EPOLLIN : EPOLLOUT;
+    if ((conn->timer.deadline_ns == header_deadline ||
+         event_loop_timer_set(g_event_loop, &conn->timer, header_deadline) == 0) &&
+        event_loop_watch(g_event_loop, watch, wanted) == 0) {
+      return;
+    }
+    status = TLS_IO_ERROR;
+  }
+
+  event_loop_timer_cancel(g_event_loop, &conn->timer);
+  event_loop_unwatch(g_event_loop, watch);
+  if (status == TLS_IO_DONE) {
+    trace_mark(&conn->trace, TRACE_READ_DONE);
+    trace_mark(&conn->trace, TRACE_QUEUED);
+  }
+  if (status == TLS_IO_DONE &&
+      !thread_pool_try_add_task(g_thread_pool, handle_client_connection, conn)) {
+    // Every worker is busy and the queue is full. The socket buffer is
+    // empty, so this short reply goes out without blocking the loop.
+    atomic_fetch_add(&g_worker_queue_full, 1);
+    send_busy(conn);
+    status = TLS_IO_ERROR;
+  }
+  if (status != TLS_IO_DONE) {
+    connection_release(conn);
+  }
+}
+
+// Runs on the event loop thread for a client that missed its idle or header
+// deadline; the connection is closed without involving a worker
+static void on_connection_timeout(event_timer_t *timer) {
+  connection_t *conn = connection_from_timer(timer);
+
+  event_loop_unwatch(g_event_loop, &conn->watch);
+  atomic_fetch_add(&g_connection_timeouts, 1);
+  connection_release(conn);
+}
+
+// Hand a new connection to the event loop until its request head arrives
+static bool start_connection(connection_t *conn) {
+  int flags = fcntl(conn->client_fd, F_GETFL, 0);
+  if (flags < 0 || fcntl(conn->client_fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+    return false;
+  }
+
+  if (conn->ssl_ctx) {
+    conn->ssl = tls_new_connection(conn->ssl_ctx, conn->client_fd);
+    if (!conn->ssl) {
+      return false;
+    }
+  }
 
-  // Cleanup
-  if (ssl) {
-    tls_close(ssl);
-  } else {
-    shutdown(ctx->client_fd, SHUT_WR);
+  conn->watch.handler = on_connection_event;
+  conn->timer.handler = on_connection_timeout;
+  if (event_loop_timer_set(g_event_loop, &conn->timer,
+                           conn->accepted_ns + MS_TO_NS(CONNECTION_IDLE_TIMEOUT_MS)) != 0) {
+    return false;
   }
-  close(ctx->client_fd);
-  free(ctx);
+  if (event_loop_watch(g_event_loop, &conn->watch, EPOLLIN) != 0) {
+    event_loop_timer_cancel(g_event_loop, &conn->timer);
+    return false;
+  }
+  return true;
 }
 
 int main(int argc, char *argv[]) {
   int server_fd, client_fd;
   struct sockaddr_in address;
-  char buffer[BUFFER_SIZE] = {0};
   bool use_tls             = false;
+  bool use_ktls            = false;
+  const char *metrics_path = METRICS_PATH;
+  unsigned slow_ms         = TRACE_SLOW_THRESHOLD_MS;
+  unsigned max_per_ip      = CONN_LIMIT_PER_CLIENT;
   int port                 = PORT;
 
-  // Check for --tls flag
+  // Check for --tls, --ktls, --metrics-path=, --slow-ms= and --max-conns-per-ip= flags
   for (int i = 1; i < argc; i++) {
     if (strcmp(argv[i], "--tls") == 0) {
       use_tls = true;
       port    = TLS_PORT;
-      break;
+    } else if (strcmp(argv[i], "--ktls") == 0) {
+      use_ktls = true;
+    } else if (strncmp(argv[i], "--metrics-path=", 15) == 0 && argv[i][15] == '/') {
+      metrics_path = argv[i] + 15;
+    } else if (strncmp(argv[i], "--slow-ms=", 10) == 0) {
+      slow_ms = (unsigned) strtoul(argv[i] + 10, NULL, 10);
+    } else if (strncmp(argv[i], "--max-conns-per-ip=", 19) == 0) {
+      max_per_ip = (unsigned) strtoul(argv[i] + 19, NULL, 10);
     }
   }
 
+  // The TLS buffer pool has to be installed before OpenSSL allocates anything
+  if (use_tls && !tls_use_buffer_pool()) {
+    fprintf(stderr, "Failed to install TLS buffer pool, continuing without it\n");
+  }
+
   // Setup signal handlers
   signal(SIGINT, signal_handler);
   signal(SIGTERM, signal_handler);
+  signal(SIGPIPE, SIG_IGN); // Writes to a closed client fail with EPIPE instead
 
   // Register cleanup function
   atexit(cleanup);
@@ -174,9 +457,35 @@ int main(int argc, char *argv[]) {
     exit(EXIT_FAILURE);
   }
 
+  // Access log entries are written in batches by a background thread
+  if (access_log_init(ACCESS_LOG_PATH) != 0) {
+    fprintf(stderr, "Failed to open access log at %s\n", ACCESS_LOG_PATH);
+    exit(EXIT_FAILURE);
+  }
+
+  // Requests slower than the threshold are logged with a per-stage breakdown
+  if (trace_init(SLOW_LOG_PATH, slow_ms) != 0) {
+    fprintf(stderr, "Failed to open slow request log at %s\n", SLOW_LOG_PATH);
+    exit(EXIT_FAILURE);
+  }
+
+  // Database calls from handlers complete on their own threads
+  if (db_async_init(DB_ASYNC_THREADS, DB_ASYNC_QUEUE_SIZE) != 0) {
+    fprintf(stderr, "Failed to create database executor\n");
+    exit(EXIT_FAILURE);
+  }
+
+  // Password hashing runs on its own executor so it cannot starve HTTP workers
+  if (password_executor_init(PASSWORD_THREADS, PASSWORD_QUEUE_SIZE) != 0) {
+    fprintf(stderr, "Failed to create password hashing executor\n");
+    exit(EXIT_FAILURE);
+  }
+
   // Initialize security modules
   session_init();
   rate_limit_init();
+  conn_limit_init(max_per_ip, CONN_LIMIT_PREFIX_BITS);
+  csrf_set_mode(CSRF_MODE_STATELESS);
   csrf_init();
 
   // Initialize TLS if requested
@@ -189,6 +498,19 @@ int main(int argc, char *argv[]) {
       exit(EXIT_FAILURE);
     }
     printf("TLS/SSL initialized successfully\n");
+
+    // Kernel TLS lets responses go out with writev after the handshake
+    if (use_ktls && !tls_enable_ktls(g_ssl_ctx)) {
+      fprintf(stderr, "kTLS is not supported by this OpenSSL build, continuing without it\n");
+    }
+  }
+
+  // Connections wait on the event loop, TLS handshake included, until their
+  // request head has arrived or a deadline has passed
+  g_event_loop = event_loop_create();
+  if (!g_event_loop || event_loop_start(g_event_loop) != 0) {
+    fprintf(stderr, "Failed to start event loop\n");
+    exit(EXIT_FAILURE);
   }
 
   // Create thread pool
@@ -198,9 +520,16 @@ int main(int argc, char *argv[]) {
     exit(EXIT_FAILURE);
   }
   printf("Thread pool created with %d threads\n", THREAD_POOL_SIZE);
+  connection_set_worker_pool(g_thread_pool);
+
+  // Connections come from a prefaulted slab; the heap is only a fallback
+  if (connection_pool_init(CONNECTION_POOL_SIZE) != 0) {
+    fprintf(stderr, "Failed to preallocate connections, allocating on demand\n");
+  }
 
   // Setup routes
-  setup_routes();
+  setup_routes(metrics_path);
+  setup_metrics(use_tls);
 
   // Create socket
   if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) == 0) {
@@ -248,22 +577,32 @@ int main(int argc, char *argv[]) {
       continue;
     }
 
-    // Create client context
-    client_context_t *ctx = (client_context_t *) malloc(sizeof(client_context_t));
-    if (!ctx) {
+    // Turn away clients over their connection limit, or that the limit table
+    // has no room left to track, before allocating anything for them
+    uint32_t addr = ntohl(client_addr.sin_addr.s_addr);
+    if (!conn_limit_acquire(addr)) {
+      atomic_fetch_add(&g_conn_limit_rejected, 1);
       close(client_fd);
       continue;
     }
 
-    ctx->client_fd = client_fd;
-    ctx->ssl_ctx   = use_tls ? g_ssl_ctx : NULL;
-    inet_ntop(AF_INET, &client_addr.sin_addr, ctx->client_ip, sizeof(ctx->client_ip));
-
-    // Add task to thread pool
-    if (!thread_pool_add_task(g_thread_pool, handle_client_connection, ctx)) {
-      fprintf(stderr, "Failed to add task to thread pool\n");
+    // Create client connection
+    char client_ip[46];
+    inet_ntop(AF_INET, &client_addr.sin_addr, client_ip, sizeof(client_ip));
+    PROBE2(connection_accept, client_fd, client_ip);
+    connection_t *conn = connection_create(client_fd, client_ip, use_tls ? g_ssl_ctx : NULL);
+    if (!conn) {
+      conn_limit_release(addr);
       close(client_fd);
-      free(ctx);
+      continue;
+    }
+    conn->client_addr  = addr;
+    conn->conn_limited = true;
+
+    // Workers pick the connection up once its request head has arrived
+    if (!start_connection(conn)) {
+      fprintf(stderr, "Failed to start connection\n");
+      connection_release(conn);
     }
   }
 
@@ -0,0 +1,302 @@
+#include "metrics.h"
+#include "router.h"
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define METRICS_ROUTE_SLOTS (METRICS_MAX_ROUTES + 1) // Last slot: no route matched
+#define METRICS_STATUS_CLASSES 6                     // No response, then 1xx to 5xx
+#define METRICS_OVERFLOW_BUCKET (METRICS_BUCKETS - 1)
+
+static const char *status_labels[METRICS_STATUS_CLASSES] = {"none", "1xx", "2xx",
+                                                            "3xx",  "4xx", "5xx"};
+
+// One route/status series. Written only by the owning thread; the scraper
+// reads it concurrently, hence relaxed atomics.
+typedef struct {
+  _Alignas(64) _Atomic uint64_t buckets[METRICS_BUCKETS];
+  _Atomic uint64_t sum_us;
+  _Atomic uint64_t bytes;
+} metrics_series_t;
+
+// Counters of one thread. Each thread gets its own cache-line-aligned shard,
+// so recording never shares a line with another thread.
+typedef struct metrics_shard {
+  metrics_series_t series[METRICS_ROUTE_SLOTS][METRICS_STATUS_CLASSES];
+  struct metrics_shard *next;
+} metrics_shard_t;
+
+typedef struct {
+  const char *name;
+  const char *help;
+  metric_type_t type;
+  metric_read_t read;
+} metrics_callback_t;
+
+// A thread keeps its shard for the life of the process, so shards are never freed
+static _Atomic(metrics_shard_t *) shards = NULL;
+static __thread metrics_shard_t *thread_shard = NULL;
+
+static metrics_callback_t callbacks[METRICS_MAX_CALLBACKS];
+static size_t callback_count            = 0;
+static pthread_mutex_t callbacks_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static metrics_shard_t *metrics_thread_shard(void) {
+  if (thread_shard) {
+    return thread_shard;
+  }
+
+  metrics_shard_t *shard = (metrics_shard_t *) aligned_alloc(64, sizeof(metrics_shard_t));
+  if (!shard) {
+    return NULL;
+  }
+  memset(shard, 0, sizeof(*shard));
+
+  shard->next = atomic_load(&shards);
+  while (!atomic_compare_exchange_weak(&shards, &shard->next, shard)) {
+  }
+  thread_shard = shard;
+  return shard;
+}
+
+// Single writer: a plain load and store, no locked instruction
+static inline void metrics_add(_Atomic uint64_t *counter, uint64_t value) {
+  uint64_t current = atomic_load_explicit(counter, memory_order_relaxed);
+  atomic_store_explicit(counter, current + value, memory_order_relaxed);
+}
+
+static int metrics_bucket_index(uint64_t latency_us) {
+  if (latency_us < METRICS_SUB_BUCKETS) {
+    return (int) latency_us;
+  }
+
+  int exponent = 63 - __builtin_clzll(latency_us);
+  if (exponent >= METRICS_MAX_EXPONENT) {
+    return METRICS_OVERFLOW_BUCKET;
+  }
+  int sub_bucket = (int) (latency_us >> (exponent - 2)) & (METRICS_SUB_BUCKETS - 1);
+  return METRICS_SUB_BUCKETS + (exponent - 2) * METRICS_SUB_BUCKETS + sub_bucket;
+}
+
+// Largest latency in a finite bucket, in microseconds. Latencies are whole
+// microseconds, so this is the inclusive bound Prometheus expects in le.
+static uint64_t metrics_bucket_limit(int index) {
+  if (index < METRICS_SUB_BUCKETS) {
+    return (uint64_t) index;
+  }
+  int exponent   = (index - METRICS_SUB_BUCKETS) / METRICS_SUB_BUCKETS + 2;
+  int sub_bucket = (index - METRICS_SUB_BUCKETS) % METRICS_SUB_BUCKETS;
+  return ((uint64_t) (METRICS_SUB_BUCKETS + 1 + sub_bucket) << (exponent - 2)) - 1;
+}
+
+void metrics_record_request(int route, int status, uint64_t latency_us, size_t bytes) {
+  metrics_shard_t *shard = metrics_thread_shard();
+  if (!shard) {
+    return;
+  }
+
+  int slot         = route >= 0 && route < METRICS_MAX_ROUTES ? route : METRICS_MAX_ROUTES;
+  int status_class = status >= 100 && status < 600 ? status / 100 : 0;
+
+  metrics_series_t *series = &shard->series[slot][status_class];
+  metrics_add(&series->buckets[metrics_bucket_index(latency_us)], 1);
+  metrics_add(&series->sum_us, latency_us);
+  metrics_add(&series->bytes, bytes);
+}
+
+int metrics_register(const char *name, const char *help, metric_type_t type, metric_read_t read) {
+  pthread_mutex_lock(&callbacks_mutex);
+  if (callback_count >= METRICS_MAX_CALLBACKS) {
+    pthread_mutex_unlock(&callbacks_mutex);
+    fprintf(stderr, "Maximum metrics exceeded\n");
+    return -1;
+  }
+  callbacks[callback_count++] = (metrics_callback_t) {name, help, type, read};
+  pthread_mutex_unlock(&callbacks_mutex);
+  return 0;
+}
+
+void metrics_reset(void) {
+  pthread_mutex_lock(&callbacks_mutex);
+  callback_count = 0;
+  pthread_mutex_unlock(&callbacks_mutex);
+
+  for (metrics_shard_t *shard = atomic_load(&shards); shard; shard = shard->next) {
+    memset(shard->series, 0, sizeof(shard->series));
+  }
+}
+
+// Growable output buffer
+typedef struct {
+  char *data;
+  size_t length;
+  size_t capacity;
+  bool failed;
+} metrics_buffer_t;
+
+static void metrics_appendf(metrics_buffer_t *buffer, const char *format, ...) {
+  if (buffer->failed) {
+    return;
+  }
+
+  while (true) {
+    va_list args;
+    va_start(args, format);
+    int needed = vsnprintf(buffer->data + buffer->length, buffer->capacity - buffer->length,
+                           format, args);
+    va_end(args);
+
+    if (needed < 0) {
+      buffer->failed = true;
+      return;
+    }
+    if ((size_t) needed < buffer->capacity - buffer->length) {
+      buffer->length += (size_t) needed;
+      return;
+    }
+
+    size_t capacity = buffer->capacity * 2 + (size_t) needed;
+    char *data      = (char *) realloc(buffer->data, capacity);
+    if (!data) {
+      buffer->failed = true;
+      return;
+    }
+    buffer->data     = data;
+    buffer->capacity = capacity;
+  }
+}
+
+// Sum of every thread's counters for one series
+typedef struct {
+  uint64_t buckets[METRICS_BUCKETS];
+  uint64_t sum_us;
+  uint64_t bytes;
+  uint64_t count;
+} metrics_total_t;
+
+static void metrics_route_labels(size_t slot, const char **method, const char **path) {
+  const route_t *route = slot < METRICS_MAX_ROUTES ? router_get_route(slot) : NULL;
+  *method              = route ? route->method : "";
+  *path                = route ? route->path : "unmatched";
+}
+
+static void metrics_render_requests(metrics_buffer_t *out, metrics_total_t *totals) {
+  metrics_appendf(out, "# HELP http_request_duration_seconds Time from reading the request to "
+                       "closing the connection.\n"
+                       "# TYPE http_request_duration_seconds histogram\n");
+  for (size_t slot = 0; slot < METRICS_ROUTE_SLOTS; slot++) {
+    for (int status_class = 0; status_class < METRICS_STATUS_CLASSES; status_class++) {
+      metrics_total_t *total = &totals[slot * METRICS_STATUS_CLASSES + status_class];
+      if (total->count == 0) {
+        continue;
+      }
+
+      const char *method, *path;
+      metrics_route_labels(slot, &method, &path);
+      const char *status = status_labels[status_class];
+
+      // Cumulative buckets up to the highest one in use
+      int last = METRICS_OVERFLOW_BUCKET - 1;
+      while (last > 0 && total->buckets[last] == 0) {
+        last--;
+      }
+      uint64_t cumulative = 0;
+      for (int i = 0; i <= last; i++) {
+        cumulative += total->buckets[i];
+        uint64_t limit = metrics_bucket_limit(i);
+        metrics_appendf(out,
+                        "http_request_duration_seconds_bucket{method=\"%s\",route=\"%s\","
+                        "status=\"%s\",le=\"%llu.%06llu\"} %llu\n",
+                        method, path, status, (unsigned long long) (limit / 1000000),
+                        (unsigned long long) (limit % 1000000), (unsigned long long) cumulative);
+      }
+      metrics_appendf(out,
+                      "http_request_duration_seconds_bucket{method=\"%s\",route=\"%s\","
+                      "status=\"%s\",le=\"+Inf\"} %llu\n"
+                      "http_request_duration_seconds_sum{method=\"%s\",route=\"%s\","
+                      "status=\"%s\"} %.6f\n"
+                      "http_request_duration_seconds_count{method=\"%s\",route=\"%s\","
+                      "status=\"%s\"} %llu\n",
+                      method, path, status, (unsigned long long) total->count, method, path,
+                      status, (double) total->sum_us / 1e6, method, path, status,
+                      (unsigned long long) total->count);
+    }
+  }
+
+  metrics_appendf(out, "# HELP http_response_bytes_total Response bytes written.\n"
+                       "# TYPE http_response_bytes_total counter\n");
+  for (size_t slot = 0; slot < METRICS_ROUTE_SLOTS; slot++) {
+    for (int status_class = 0; status_class < METRICS_STATUS_CLASSES; status_class++) {
+      metrics_total_t *total = &totals[slot * METRICS_STATUS_CLASSES + status_class];
+      if (total->count == 0) {
+        continue;
+      }
+
+      const char *method, *path;
+      metrics_route_labels(slot, &method, &path);
+      metrics_appendf(out,
+                      "http_response_bytes_total{method=\"%s\",route=\"%s\",status=\"%s\"} "
+                      "%llu\n",
+                      method, path, status_labels[status_class],
+                      (unsigned long long) total->bytes);
+    }
+  }
+}
+
+char *metrics_render(size_t *length) {
+  metrics_total_t *totals = (metrics_total_t *) calloc(
+      METRICS_ROUTE_SLOTS * METRICS_STATUS_CLASSES, sizeof(metrics_total_t));
+  if (!totals) {
+    return NULL;
+  }
+
+  // Aggregation happens only here, at scrape time
+  for (metrics_shard_t *shard = atomic_load(&shards); shard; shard = shard->next) {
+    for (size_t slot = 0; slot < METRICS_ROUTE_SLOTS; slot++) {
+      for (int status_class = 0; status_class < METRICS_STATUS_CLASSES; status_class++) {
+        metrics_series_t *series = &shard->series[slot][status_class];
+        metrics_total_t *total   = &totals[slot * METRICS_STATUS_CLASSES + status_class];
+        for (int i = 0; i < METRICS_BUCKETS; i++) {
+          uint64_t count = atomic_load_explicit(&series->buckets[i], memory_order_relaxed);
+          total->buckets[i] += count;
+          total->count += count;
+        }
+        total->sum_us += atomic_load_explicit(&series->sum_us, memory_order_relaxed);
+        total->bytes += atomic_load_explicit(&series->bytes, memory_order_relaxed);
+      }
+    }
+  }
+
+  metrics_buffer_t out = {.capacity = 4096};
+  out.data             = (char *) malloc(out.capacity);
+  if (!out.data) {
+    free(totals);
+    return NULL;
+  }
+  out.data[0] = '\0';
+
+  metrics_render_requests(&out, totals);
+  free(totals);
+
+  pthread_mutex_lock(&callbacks_mutex);
+  for (size_t i = 0; i < callback_count; i++) {
+    metrics_appendf(&out, "# HELP %s %s\n# TYPE %s %s\n%s %.15g\n", callbacks[i].name,
+                    callbacks[i].help, callbacks[i].name,
+                    callbacks[i].type == METRIC_COUNTER ? "counter" : "gauge", callbacks[i].name,
+                    callbacks[i].read());
+  }
+  pthread_mutex_unlock(&callbacks_mutex);
+
+  if (out.failed) {
+    free(out.data);
+    return NULL;
+  }
+  if (length) {
+    *length = out.length;
+  }
+  return out.data;
+}
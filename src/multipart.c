@@ -0,0 +1,359 @@
+#include "multipart.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#define MULTIPART_READ_SIZE 4096
+
+enum {
+  MULTIPART_PREAMBLE,       // Before the first delimiter
+  MULTIPART_AFTER_BOUNDARY, // "--" ends the body, CRLF starts a part
+  MULTIPART_HEADERS,
+  MULTIPART_DATA,
+  MULTIPART_DONE,
+  MULTIPART_ERROR,
+};
+
+// Find parameter `name` in a header value like `form-data; name="a"`.
+// Quoted values may not contain escaped quotes; browsers percent-encode them.
+static int multipart_param(const char *value, const char *name, char *out, size_t size) {
+  size_t name_length = strlen(name);
+  const char *p      = strchr(value, ';');
+
+  while (p) {
+    p++;
+    while (*p == ' ' || *p == '\t') {
+      p++;
+    }
+
+    if (strncasecmp(p, name, name_length) == 0 && p[name_length] == '=') {
+      p += name_length + 1;
+      const char *end;
+      if (*p == '"') {
+        p++;
+        end = strchr(p, '"');
+        if (!end) {
+          return -1;
+        }
+      } else {
+        end = p + strcspn(p, "; \t");
+      }
+      size_t length = (size_t) (end - p);
+      if (length >= size) {
+        return -1;
+      }
+      memcpy(out, p, length);
+      out[length] = '\0';
+      return 0;
+    }
+    p = strchr(p, ';');
+  }
+  return -1;
+}
+
+int multipart_boundary(const char *content_type, char *boundary, size_t size) {
+  if (!content_type || strncasecmp(content_type, "multipart/", 10) != 0) {
+    return -1;
+  }
+  if (multipart_param(content_type, "boundary", boundary, size) != 0) {
+    return -1;
+  }
+  size_t length = strlen(boundary);
+  return length > 0 && length <= MULTIPART_BOUNDARY_MAX ? 0 : -1;
+}
+
+int multipart_parser_init(multipart_parser_t *parser, const char *content_type,
+                          const multipart_callbacks_t *callbacks, void *ctx) {
+  char boundary[MULTIPART_BOUNDARY_MAX + 1];
+  if (multipart_boundary(content_type, boundary, sizeof(boundary)) != 0) {
+    return -1;
+  }
+
+  int length = snprintf(parser->delimiter, sizeof(parser->delimiter), "\r\n--%s", boundary);
+  if (length < 0 || (size_t) length >= sizeof(parser->delimiter)) {
+    return -1;
+  }
+
+  parser->state            = MULTIPART_PREAMBLE;
+  parser->delimiter_length = (size_t) length;
+  parser->header_length    = 0;
+  parser->callbacks        = *callbacks;
+  parser->ctx              = ctx;
+
+  size_t m = parser->delimiter_length;
+  for (int c = 0; c < 256; c++) {
+    parser->skip[c] = m;
+  }
+  for (size_t i = 0; i + 1 < m; i++) {
+    parser->skip[(unsigned char) parser->delimiter[i]] = m - 1 - i;
+  }
+
+  // The first delimiter may start the body, without a preceding line break
+  memcpy(parser->window, "\r\n", 2);
+  parser->window_length = 2;
+
+  return 0;
+}
+
+// Boyer-Moore-Horspool: offset of the first full delimiter, or -1
+static long multipart_search(const multipart_parser_t *parser, const char *data, size_t length) {
+  size_t m   = parser->delimiter_length;
+  char last  = parser->delimiter[m - 1];
+  size_t pos = 0;
+
+  while (pos + m <= length) {
+    unsigned char c = (unsigned char) data[pos + m - 1];
+    if (c == (unsigned char) last && memcmp(data + pos, parser->delimiter, m - 1) == 0) {
+      return (long) pos;
+    }
+    pos += parser->skip[c];
+  }
+  return -1;
+}
+
+static int multipart_emit(multipart_parser_t *parser, const char *data, size_t length) {
+  if (parser->state != MULTIPART_DATA || length == 0 || !parser->callbacks.on_part_data) {
+    return 0;
+  }
+  return parser->callbacks.on_part_data(parser->ctx, data, length);
+}
+
+static void multipart_header_value(const char *headers, const char *name, char *out, size_t size) {
+  size_t name_length = strlen(name);
+
+  for (const char *line = headers; line; line = strstr(line, "\r\n")) {
+    line += line[0] == '\r' ? 2 : 0;
+    if (strncasecmp(line, name, name_length) == 0 && line[name_length] == ':') {
+      const char *value = line + name_length + 1;
+      while (*value == ' ' || *value == '\t') {
+        value++;
+      }
+      size_t length = strcspn(value, "\r");
+      if (length >= size) {
+        length = size - 1;
+      }
+      memcpy(out, value, length);
+      out[length] = '\0';
+      return;
+    }
+  }
+}
+
+static int multipart_begin_part(multipart_parser_t *parser) {
+  char disposition[MULTIPART_HEADER_SIZE] = {0};
+  multipart_part_t *part                  = &parser->part;
+
+  parser->header[parser->header_length] = '\0';
+  memset(part, 0, sizeof(*part));
+  multipart_header_value(parser->header, "Content-Disposition", disposition, sizeof(disposition));
+  multipart_header_value(parser->header, "Content-Type", part->content_type,
+                         sizeof(part->content_type));
+
+  if (strncasecmp(disposition, "form-data", 9) != 0 ||
+      multipart_param(disposition, "name", part->name, sizeof(part->name)) != 0) {
+    return -1;
+  }
+  multipart_param(disposition, "filename", part->filename, sizeof(part->filename));
+
+  return parser->callbacks.on_part_begin ? parser->callbacks.on_part_begin(parser->ctx, part) : 0;
+}
+
+// Consume as much of the window as possible. Returns -1 on error.
+static int multipart_process(multipart_parser_t *parser) {
+  char *window  = parser->window;
+  size_t length = parser->window_length;
+  size_t pos    = 0;
+  bool more     = true;
+
+  while (more && pos < length) {
+    switch (parser->state) {
+    case MULTIPART_PREAMBLE:
+    case MULTIPART_DATA: {
+      long match = multipart_search(parser, window + pos, length - pos);
+      if (match >= 0) {
+        if (multipart_emit(parser, window + pos, (size_t) match) != 0) {
+          return -1;
+        }
+        if (parser->state == MULTIPART_DATA && parser->callbacks.on_part_end &&
+            parser->callbacks.on_part_end(parser->ctx) != 0) {
+          return -1;
+        }
+        pos += (size_t) match + parser->delimiter_length;
+        parser->state = MULTIPART_AFTER_BOUNDARY;
+      } else {
+        // Only the tail can still be the start of a delimiter
+        size_t keep = parser->delimiter_length - 1;
+        if (keep > length - pos) {
+          keep = length - pos;
+        }
+        size_t safe = length - pos - keep;
+        if (multipart_emit(parser, window + pos, safe) != 0) {
+          return -1;
+        }
+        pos += safe;
+        more = false;
+      }
+      break;
+    }
+    case MULTIPART_AFTER_BOUNDARY:
+      if (window[pos] == ' ' || window[pos] == '\t') {
+        pos++; // Transport padding
+      } else if (length - pos < 2) {
+        more = false;
+      } else if (window[pos] == '-' && window[pos + 1] == '-') {
+        parser->state = MULTIPART_DONE;
+        pos           = length;
+      } else if (window[pos] == '\r' && window[pos + 1] == '\n') {
+        parser->state         = MULTIPART_HEADERS;
+        parser->header_length = 0;
+        pos += 2;
+      } else {
+        return -1;
+      }
+      break;
+    case MULTIPART_HEADERS: {
+      // Keep one byte free for the terminator
+      if (parser->header_length >= sizeof(parser->header) - 1) {
+        return -1;
+      }
+      char *header                    = parser->header;
+      header[parser->header_length++] = window[pos++];
+
+      size_t n     = parser->header_length;
+      bool no_part = n == 2 && header[0] == '\r' && header[1] == '\n';
+      bool ended   = n >= 4 && memcmp(header + n - 4, "\r\n\r\n", 4) == 0;
+      if (no_part || ended) {
+        parser->header_length = no_part ? 0 : n - 2; // Keep the last header's CRLF
+        if (multipart_begin_part(parser) != 0) {
+          return -1;
+        }
+        parser->state = MULTIPART_DATA;
+      }
+      break;
+    }
+    default:
+      pos = length; // Epilogue is ignored
+      break;
+    }
+  }
+
+  memmove(window, window + pos, length - pos);
+  parser->window_length = length - pos;
+  return 0;
+}
+
+int multipart_parser_feed(multipart_parser_t *parser, const char *data, size_t length) {
+  while (length > 0 && parser->state != MULTIPART_ERROR) {
+    size_t space = sizeof(parser->window) - parser->window_length;
+    size_t n     = length < space ? length : space;
+
+    memcpy(parser->window + parser->window_length, data, n);
+    parser->window_length += n;
+    data += n;
+    length -= n;
+
+    if (multipart_process(parser) != 0) {
+      parser->state = MULTIPART_ERROR;
+    }
+  }
+  return parser->state == MULTIPART_ERROR ? -1 : 0;
+}
+
+int multipart_parser_finish(multipart_parser_t *parser) {
+  return parser->state == MULTIPART_DONE ? 0 : -1;
+}
+
+int multipart_read(const http_request_t *request, multipart_parser_t *parser) {
+  if (request->body) {
+    if (multipart_parser_feed(parser, request->body, request->body_length) != 0) {
+      return -1;
+    }
+    return multipart_parser_finish(parser);
+  }
+
+  char buffer[MULTIPART_READ_SIZE];
+  ssize_t n;
+  while ((n = http_body_read(request, buffer, sizeof(buffer))) > 0) {
+    if (multipart_parser_feed(parser, buffer, (size_t) n) != 0) {
+      return -1;
+    }
+  }
+  return n < 0 ? -1 : multipart_parser_finish(parser);
+}
+
+void multipart_spool_init(multipart_spool_t *spool, int fd) {
+  spool->fd        = fd;
+  spool->temporary = false;
+  spool->length    = 0;
+}
+
+static int write_all(int fd, const char *data, size_t length) {
+  while (length > 0) {
+    ssize_t n = write(fd, data, length);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    data += n;
+    length -= (size_t) n;
+  }
+  return 0;
+}
+
+// Move the in-memory data to an unlinked temp file
+static int multipart_spill(multipart_spool_t *spool) {
+  const char *dir = getenv("TMPDIR");
+  char path[256];
+  snprintf(path, sizeof(path), "%s/upload-XXXXXX", dir && *dir ? dir : "/tmp");
+
+  int fd = mkstemp(path);
+  if (fd < 0) {
+    perror("Failed to create upload spool file");
+    return -1;
+  }
+  unlink(path);
+
+  if (write_all(fd, spool->memory, spool->length) != 0) {
+    close(fd);
+    return -1;
+  }
+  spool->fd        = fd;
+  spool->temporary = true;
+  return 0;
+}
+
+int multipart_spool_write(multipart_spool_t *spool, const char *data, size_t length) {
+  if (spool->fd < 0) {
+    if (length <= sizeof(spool->memory) - spool->length) {
+      memcpy(spool->memory + spool->length, data, length);
+      spool->length += length;
+      return 0;
+    }
+    if (multipart_spill(spool) != 0) {
+      return -1;
+    }
+  }
+
+  if (write_all(spool->fd, data, length) != 0) {
+    return -1;
+  }
+  spool->length += length;
+  return 0;
+}
+
+const char *multipart_spool_data(const multipart_spool_t *spool) {
+  return spool->fd < 0 ? spool->memory : NULL;
+}
+
+void multipart_spool_close(multipart_spool_t *spool) {
+  if (spool->temporary) {
+    close(spool->fd);
+    spool->fd        = -1;
+    spool->temporary = false;
+  }
+}
@@ -0,0 +1,144 @@
+#include "response.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+
+int response_begin(response_t *res, connection_t *conn, const char *status,
+                   const char *content_type, const char *headers, long long content_length) {
+  memset(res, 0, sizeof(*res));
+  res->conn    = conn;
+  res->status  = atoi(status);
+  res->length  = content_length;
+  res->chunked = content_length == RESPONSE_LENGTH_CHUNKED;
+
+  char framing[48];
+  if (res->chunked) {
+    snprintf(framing, sizeof(framing), "Transfer-Encoding: chunked\r\n");
+  } else {
+    snprintf(framing, sizeof(framing), "Content-Length: %lld\r\n", content_length);
+  }
+
+  int length = snprintf(conn->write_buffer, sizeof(conn->write_buffer),
+                        "HTTP/1.1 %s\r\n"
+                        "Content-Type: %s\r\n"
+                        "%s"
+                        "%s"
+                        "Connection: close\r\n"
+                        "\r\n",
+                        status, content_type, framing, headers ? headers : "");
+  if (length < 0 || (size_t) length >= sizeof(conn->write_buffer)) {
+    res->failed = true;
+    return -1;
+  }
+
+  res->head     = (size_t) length;
+  res->buffered = (size_t) length;
+  trace_mark(&conn->trace, TRACE_RESPONSE_START);
+  return 0;
+}
+
+// Write out the buffer followed by data, framed as one chunk when chunked,
+// with the final chunk appended if last
+static int response_send_pending(response_t *res, const void *data, size_t length, bool last) {
+  char *buffer   = res->conn->write_buffer;
+  size_t pending = res->buffered - res->head;
+  size_t body    = pending + length;
+  char chunk_size[24];
+  struct iovec iov[6];
+  int count = 0;
+
+  if (res->head > 0) {
+    iov[count++] = (struct iovec){.iov_base = buffer, .iov_len = res->head};
+  }
+  if (res->chunked && body > 0) {
+    int n        = snprintf(chunk_size, sizeof(chunk_size), "%zx\r\n", body);
+    iov[count++] = (struct iovec){.iov_base = chunk_size, .iov_len = (size_t) n};
+  }
+  if (pending > 0) {
+    iov[count++] = (struct iovec){.iov_base = buffer + res->head, .iov_len = pending};
+  }
+  if (length > 0) {
+    iov[count++] = (struct iovec){.iov_base = (void *) data, .iov_len = length};
+  }
+  if (res->chunked && body > 0) {
+    iov[count++] = (struct iovec){.iov_base = (void *) "\r\n", .iov_len = 2};
+  }
+  if (res->chunked && last) {
+    iov[count++] = (struct iovec){.iov_base = (void *) "0\r\n\r\n", .iov_len = 5};
+  }
+
+  res->head     = 0;
+  res->buffered = 0;
+  if (count == 0) {
+    return 0;
+  }
+
+  ssize_t written = connection_writev(res->conn, iov, count);
+  if (written < 0) {
+    perror("Failed to send response");
+    res->failed = true;
+    return -1;
+  }
+  res->bytes += (size_t) written;
+  return 0;
+}
+
+int response_write(response_t *res, const void *data, size_t length) {
+  if (res->failed || res->finished) {
+    return -1;
+  }
+  if (!res->chunked && (long long) (res->body_sent + length) > res->length) {
+    fprintf(stderr, "Response body longer than its Content-Length\n");
+    res->failed = true;
+    return -1;
+  }
+  res->body_sent += length;
+
+  // Small writes are coalesced; large ones skip the copy
+  if (length <= sizeof(res->conn->write_buffer) - res->buffered) {
+    memcpy(res->conn->write_buffer + res->buffered, data, length);
+    res->buffered += length;
+    return 0;
+  }
+  return response_send_pending(res, data, length, false);
+}
+
+int response_flush(response_t *res) {
+  if (res->failed || res->finished) {
+    return -1;
+  }
+  return response_send_pending(res, NULL, 0, false);
+}
+
+int response_end(response_t *res) {
+  if (res->finished) {
+    return res->failed ? -1 : 0;
+  }
+  res->finished = true;
+
+  if (!res->failed) {
+    response_send_pending(res, NULL, 0, res->chunked);
+  }
+  if (!res->chunked && (long long) res->body_sent != res->length) {
+    // The client sees a truncated body when the connection closes
+    fprintf(stderr, "Response body shorter than its Content-Length\n");
+    res->failed = true;
+  }
+
+  trace_mark(&res->conn->trace, TRACE_RESPONSE_SENT);
+  if (res->bytes > 0) {
+    connection_note_response(res->conn, res->status, res->bytes);
+  }
+  return res->failed ? -1 : 0;
+}
+
+int response_send(connection_t *conn, const char *status, const char *content_type,
+                  const char *headers, const void *body, size_t length) {
+  response_t res;
+  if (response_begin(&res, conn, status, content_type, headers, (long long) length) != 0) {
+    return -1;
+  }
+  response_write(&res, body, length);
+  return response_end(&res);
+}
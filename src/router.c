@@ -1,4 +1,6 @@
 #include "router.h"
+#include "connection.h"
+#include "probes.h"
 #include <ctype.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -14,9 +16,16 @@ static size_t route_count = 0;
 static middleware_t global_middlewares[MAX_GLOBAL_MIDDLEWARES];
 static size_t global_middleware_count = 0;
 
+static router_error_handler_t error_handler = NULL;
+
 void router_init(void) {
   route_count             = 0;
   global_middleware_count = 0;
+  error_handler           = NULL;
+}
+
+void router_set_error_handler(router_error_handler_t handler) {
+  error_handler = handler;
 }
 
 // Check if path contains parameters (e.g., "/users/:id")
@@ -86,9 +95,28 @@ void router_register_with_middleware(const char *method, const char *path, route
   routes[route_count].middlewares      = middlewares;
   routes[route_count].middleware_count = middleware_count;
   routes[route_count].has_params       = path_has_params(path);
+  routes[route_count].max_body_size    = ROUTER_MAX_BODY_SIZE;
   route_count++;
 }
 
+void router_set_max_body_size(const char *method, const char *path, size_t max_body_size) {
+  for (size_t i = 0; i < route_count; i++) {
+    if (strcmp(routes[i].method, method) == 0 && strcmp(routes[i].path, path) == 0) {
+      routes[i].max_body_size = max_body_size;
+      return;
+    }
+  }
+  fprintf(stderr, "No route %s %s to set a body limit on\n", method, path);
+}
+
+size_t router_route_count(void) {
+  return route_count;
+}
+
+const route_t *router_get_route(size_t index) {
+  return index < route_count ? &routes[index] : NULL;
+}
+
 void router_use_global_middleware(middleware_t middleware) {
   if (global_middleware_count >= MAX_GLOBAL_MIDDLEWARES) {
     fprintf(stderr, "Maximum global middlewares exceeded\n");
@@ -97,7 +125,60 @@ void router_use_global_middleware(middleware_t middleware) {
   global_middlewares[global_middleware_count++] = middleware;
 }
 
-void router_handle(int client_fd, const http_request_t *request) {
+// Timestamp a stage when the request belongs to a server connection
+static void router_trace(const http_request_t *request, trace_stage_t stage) {
+  if (request->conn) {
+    trace_mark(&request->conn->trace, stage);
+  }
+}
+
+static void router_send_error(int client_fd, const http_request_t *request,
+                              const char *status_line) {
+  if (error_handler) {
+    error_handler(client_fd, request, status_line);
+    return;
+  }
+
+  char response[256];
+  int length = snprintf(response, sizeof(response),
+                        "HTTP/1.1 %s\r\n"
+                        "Content-Type: text/plain\r\n"
+                        "Connection: close\r\n"
+                        "\r\n"
+                        "%s",
+                        status_line, strchr(status_line, ' ') + 1);
+  router_trace(request, TRACE_RESPONSE_START);
+  ssize_t written = write(client_fd, response, (size_t) length);
+  router_trace(request, TRACE_RESPONSE_SENT);
+  if (written > 0) {
+    connection_note_response(request->conn, atoi(status_line), (size_t) written);
+  }
+}
+
+// Buffer the body within the route's limit. Returns false once an error
+// response has been sent.
+static bool router_read_body(int client_fd, http_request_t *request, const route_t *route) {
+  if (route->max_body_size == ROUTE_BODY_STREAMED) {
+    return true;
+  }
+
+  int result = http_read_body(request, route->max_body_size);
+  if (result == HTTP_BODY_TOO_LARGE) {
+    router_send_error(client_fd, request, "413 Payload Too Large");
+    return false;
+  }
+  if (result == HTTP_BODY_TIMEOUT) {
+    router_send_error(client_fd, request, "408 Request Timeout");
+    return false;
+  }
+  if (result != 0) {
+    router_send_error(client_fd, request, "400 Bad Request");
+    return false;
+  }
+  return true;
+}
+
+void router_handle(int client_fd, http_request_t *request) {
   // Run global middlewares first
   for (size_t i = 0; i < global_middleware_count; i++) {
     if (!global_middlewares[i](client_fd, request)) {
@@ -121,6 +202,11 @@ void router_handle(int client_fd, const http_request_t *request) {
     }
 
     if (matched) {
+      PROBE3(route_matched, request->conn, request->method, routes[i].path);
+      if (request->conn) {
+        request->conn->route = (int) i;
+      }
+
       // Run route-specific middlewares
       for (size_t j = 0; j < routes[i].middleware_count; j++) {
         if (!routes[i].middlewares[j](client_fd, request)) {
@@ -128,17 +214,21 @@ void router_handle(int client_fd, const http_request_t *request) {
         }
       }
 
+      router_trace(request, TRACE_MIDDLEWARE_DONE);
+      if (!router_read_body(client_fd, request, &routes[i])) {
+        return;
+      }
+
       // Call handler
+      PROBE2(handler_start, request->conn, routes[i].path);
       routes[i].handler(client_fd, request, &params);
+      PROBE2(handler_end, request->conn, routes[i].path);
+      router_trace(request, TRACE_HANDLER_DONE);
       return;
     }
   }
 
   // No route found - 404
-  const char *response = "HTTP/1.1 404 Not Found\r\n"
-                         "Content-Type: text/plain\r\n"
-                         "Connection: close\r\n"
-                         "\r\n"
-                         "Not Found";
-  write(client_fd, response, strlen(response));
+  router_trace(request, TRACE_MIDDLEWARE_DONE);
+  router_send_error(client_fd, request, "404 Not Found");
 }
@@ -1,9 +1,18 @@
 #include "security.h"
+#include "probes.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
 #include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/random.h>
 #include <time.h>
+#include <unistd.h>
 
 // Session storage
 static session_t sessions[MAX_SESSIONS];
@@ -15,12 +24,49 @@ static rate_limit_entry_t rate_limits[MAX_RATE_LIMIT_ENTRIES];
 static bool rate_limit_initialized      = false;
 static pthread_mutex_t rate_limit_mutex = PTHREAD_MUTEX_INITIALIZER;
 
+// Connection limit storage: an open-addressing table split into shards with
+// a lock each, so accepts and closes from different clients rarely contend.
+// A slot is free when its count is 0.
+typedef struct {
+  uint32_t client; // Address masked to the prefix
+  uint32_t count;  // Open connections
+} conn_limit_entry_t;
+
+typedef struct {
+  _Alignas(64) pthread_mutex_t mutex;
+  conn_limit_entry_t slots[CONN_LIMIT_SHARD_SLOTS];
+  size_t used;
+} conn_limit_shard_t;
+
+static conn_limit_shard_t conn_limit_shards[CONN_LIMIT_SHARDS];
+static unsigned conn_limit_per_client = 0;
+static uint32_t conn_limit_mask       = 0;
+
 // CSRF token storage
 #define MAX_CSRF_TOKENS 100
 #define CSRF_TOKEN_TIMEOUT 3600 // 1 hour
 static csrf_token_t csrf_tokens[MAX_CSRF_TOKENS];
 static bool csrf_initialized      = false;
 static pthread_mutex_t csrf_mutex = PTHREAD_MUTEX_INITIALIZER;
+static csrf_mode_t csrf_mode      = CSRF_MODE_TABLE;
+
+// Stateless CSRF tokens: base64url(timestamp || nonce || truncated HMAC)
+#define CSRF_HMAC_KEY_SIZE 32
+#define CSRF_TIMESTAMP_SIZE 8
+#define CSRF_NONCE_SIZE 8
+#define CSRF_MAC_SIZE 16
+#define CSRF_RAW_SIZE (CSRF_TIMESTAMP_SIZE + CSRF_NONCE_SIZE + CSRF_MAC_SIZE)
+
+// Replay filter: two Bloom filter generations, each covering one token
+// lifetime, so a consumed token is remembered for at least CSRF_TOKEN_TIMEOUT.
+#define CSRF_REPLAY_FILTER_BITS (1u << 22) // 512 KB per generation
+#define CSRF_REPLAY_FILTER_HASHES 4
+
+static unsigned char csrf_hmac_key[CSRF_HMAC_KEY_SIZE];
+static uint64_t csrf_replay_filter[2][CSRF_REPLAY_FILTER_BITS / 64];
+static int csrf_replay_current    = 0;
+static time_t csrf_replay_rotated = 0;
+static __thread char csrf_stateless_token[CSRF_STATELESS_TOKEN_LENGTH + 1];
 
 // Constant-time string comparison (timing-attack resistant)
 int secure_compare(const char *a, const char *b, size_t len) {
@@ -51,26 +97,168 @@ int secure_compare(const char *a, const char *b, size_t len) {
   return (result == 0) ? 0 : -1;
 }
 
-// Generate cryptographically random token
-void generate_token(char *buffer, size_t length) {
-  const char charset[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
-  FILE *urandom        = fopen("/dev/urandom", "r");
+// Per-thread CSPRNG
+//
+// Each thread keeps a ChaCha20 keystream keyed from getrandom(). Output is
+// produced in RNG_BUFFER_SIZE batches; the first 32 bytes of every batch become
+// the next key (fast key erasure), so tokens cost no syscalls and a leaked state
+// does not reveal earlier output. The key is re-seeded from the kernel every
+// RNG_RESEED_INTERVAL bytes.
+#define RNG_BUFFER_SIZE 1024
+#define RNG_KEY_SIZE 32
+#define RNG_RESEED_INTERVAL (1024 * 1024)
+
+typedef struct {
+  uint32_t key[8];
+  unsigned char buffer[RNG_BUFFER_SIZE];
+  size_t pos;
+  size_t since_reseed;
+  bool seeded;
+} rng_state_t;
+
+static __thread rng_state_t rng;
+
+#define ROTL32(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+#define CHACHA_QR(a, b, c, d)                                                                      \
+  a += b;                                                                                          \
+  d ^= a;                                                                                          \
+  d = ROTL32(d, 16);                                                                               \
+  c += d;                                                                                          \
+  b ^= c;                                                                                          \
+  b = ROTL32(b, 12);                                                                               \
+  a += b;                                                                                          \
+  d ^= a;                                                                                          \
+  d = ROTL32(d, 8);                                                                                \
+  c += d;                                                                                          \
+  b ^= c;                                                                                          \
+  b = ROTL32(b, 7);
+
+static void chacha20_block(const uint32_t key[8], uint64_t counter, unsigned char out[64]) {
+  uint32_t in[16] = {0x61707865, 0x3320646e, 0x79622d32, 0x6b206574};
+  memcpy(&in[4], key, 8 * sizeof(uint32_t));
+  in[12] = (uint32_t) counter;
+  in[13] = (uint32_t) (counter >> 32);
+  in[14] = 0;
+  in[15] = 0;
+
+  uint32_t x[16];
+  memcpy(x, in, sizeof(x));
+  for (int i = 0; i < 10; i++) {
+    CHACHA_QR(x[0], x[4], x[8], x[12]);
+    CHACHA_QR(x[1], x[5], x[9], x[13]);
+    CHACHA_QR(x[2], x[6], x[10], x[14]);
+    CHACHA_QR(x[3], x[7], x[11], x[15]);
+    CHACHA_QR(x[0], x[5], x[10], x[15]);
+    CHACHA_QR(x[1], x[6], x[11], x[12]);
+    CHACHA_QR(x[2], x[7], x[8], x[13]);
+    CHACHA_QR(x[3], x[4], x[9], x[14]);
+  }
 
-  if (urandom) {
-    unsigned char random_bytes[length];
-    fread(random_bytes, 1, length, urandom);
-    fclose(urandom);
+  for (int i = 0; i < 16; i++) {
+    uint32_t v     = x[i] + in[i];
+    out[i * 4]     = (unsigned char) v;
+    out[i * 4 + 1] = (unsigned char) (v >> 8);
+    out[i * 4 + 2] = (unsigned char) (v >> 16);
+    out[i * 4 + 3] = (unsigned char) (v >> 24);
+  }
+}
 
-    for (size_t i = 0; i < length; i++) {
-      buffer[i] = charset[random_bytes[i] % (sizeof(charset) - 1)];
+// Read seed material from the kernel, falling back to /dev/urandom on kernels
+// without getrandom(). There is no insecure fallback: without entropy we abort.
+static void rng_read_seed(unsigned char *seed, size_t length) {
+  size_t filled = 0;
+  while (filled < length) {
+    ssize_t n = getrandom(seed + filled, length - filled, 0);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      break;
     }
-  } else {
-    // Fallback to rand() if /dev/urandom unavailable
-    srand((unsigned int) time(NULL));
-    for (size_t i = 0; i < length; i++) {
-      buffer[i] = charset[rand() % (sizeof(charset) - 1)];
+    filled += (size_t) n;
+  }
+
+  if (filled < length) {
+    int fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+    while (fd >= 0 && filled < length) {
+      ssize_t n = read(fd, seed + filled, length - filled);
+      if (n <= 0) {
+        if (n < 0 && errno == EINTR)
+          continue;
+        break;
+      }
+      filled += (size_t) n;
+    }
+    if (fd >= 0)
+      close(fd);
+  }
+
+  if (filled < length) {
+    fprintf(stderr, "Failed to obtain random seed from the kernel\n");
+    abort();
+  }
+}
+
+static void rng_refill(void) {
+  if (!rng.seeded || rng.since_reseed >= RNG_RESEED_INTERVAL) {
+    unsigned char seed[RNG_KEY_SIZE];
+    rng_read_seed(seed, sizeof(seed));
+    // Mix fresh entropy into the existing key rather than replacing it
+    for (size_t i = 0; i < RNG_KEY_SIZE; i++) {
+      ((unsigned char *) rng.key)[i] ^= seed[i];
     }
+    memset(seed, 0, sizeof(seed));
+    rng.since_reseed = 0;
+    rng.seeded       = true;
   }
+
+  for (uint64_t block = 0; block < RNG_BUFFER_SIZE / 64; block++) {
+    chacha20_block(rng.key, block, rng.buffer + block * 64);
+  }
+
+  // Fast key erasure: the first bytes of the batch become the next key
+  memcpy(rng.key, rng.buffer, RNG_KEY_SIZE);
+  memset(rng.buffer, 0, RNG_KEY_SIZE);
+  rng.pos = RNG_KEY_SIZE;
+  rng.since_reseed += RNG_BUFFER_SIZE;
+}
+
+void random_bytes(void *buffer, size_t length) {
+  unsigned char *out = (unsigned char *) buffer;
+
+  while (length > 0) {
+    if (rng.pos >= RNG_BUFFER_SIZE || !rng.seeded) {
+      rng_refill();
+    }
+
+    size_t available = RNG_BUFFER_SIZE - rng.pos;
+    size_t n         = length < available ? length : available;
+    memcpy(out, rng.buffer + rng.pos, n);
+    // Never hand out the same bytes twice
+    memset(rng.buffer + rng.pos, 0, n);
+    rng.pos += n;
+    out += n;
+    length -= n;
+  }
+}
+
+// Generate cryptographically random base62 token
+void generate_token(char *buffer, size_t length) {
+  static const char charset[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
+  // Largest multiple of 62 that fits in a byte; rejecting bytes above it keeps
+  // every character equally likely.
+  const unsigned char limit = 248;
+  unsigned char random[64];
+  size_t filled = 0;
+
+  while (filled < length) {
+    random_bytes(random, sizeof(random));
+    for (size_t i = 0; i < sizeof(random) && filled < length; i++) {
+      if (random[i] < limit) {
+        buffer[filled++] = charset[random[i] % (sizeof(charset) - 1)];
+      }
+    }
+  }
+  memset(random, 0, sizeof(random));
   buffer[length] = '\0';
 }
 
@@ -118,7 +306,7 @@ const char *session_create(const char *username) {
   return NULL; // No free slots
 }
 
-bool session_validate(const char *token, char *username_out, size_t username_size) {
+static bool session_validate_token(const char *token, char *username_out, size_t username_size) {
   if (!token)
     return false;
 
@@ -152,6 +340,13 @@ bool session_validate(const char *token, char *username_out, size_t username_siz
   return false;
 }
 
+bool session_validate(const char *token, char *username_out, size_t username_size) {
+  PROBE(session_validate_start);
+  bool valid = session_validate_token(token, username_out, username_size);
+  PROBE1(session_validate_end, valid);
+  return valid;
+}
+
 void session_destroy(const char *token) {
   if (!token)
     return;
@@ -176,6 +371,20 @@ void session_cleanup_expired(void) {
   pthread_mutex_unlock(&sessions_mutex);
 }
 
+size_t session_count(void) {
+  size_t count = 0;
+
+  pthread_mutex_lock(&sessions_mutex);
+  for (int i = 0; i < MAX_SESSIONS; i++) {
+    if (sessions[i].active) {
+      count++;
+    }
+  }
+  pthread_mutex_unlock(&sessions_mutex);
+
+  return count;
+}
+
 // Rate limiting
 void rate_limit_init(void) {
   if (rate_limit_initialized)
@@ -252,13 +461,312 @@ void rate_limit_cleanup(void) {
   pthread_mutex_unlock(&rate_limit_mutex);
 }
 
+size_t rate_limit_count(void) {
+  size_t count = 0;
+
+  pthread_mutex_lock(&rate_limit_mutex);
+  for (int i = 0; i < MAX_RATE_LIMIT_ENTRIES; i++) {
+    if (rate_limits[i].ip[0] != '\0') {
+      count++;
+    }
+  }
+  pthread_mutex_unlock(&rate_limit_mutex);
+
+  return count;
+}
+
+// Connection limits
+void conn_limit_init(unsigned per_client, unsigned prefix_bits) {
+  for (int i = 0; i < CONN_LIMIT_SHARDS; i++) {
+    pthread_mutex_init(&conn_limit_shards[i].mutex, NULL);
+    memset(conn_limit_shards[i].slots, 0, sizeof(conn_limit_shards[i].slots));
+    conn_limit_shards[i].used = 0;
+  }
+  conn_limit_per_client = per_client;
+  conn_limit_mask       = prefix_bits >= 32 ? UINT32_MAX : ~(UINT32_MAX >> prefix_bits);
+}
+
+// Fibonacci hashing: the top 4 bits pick the shard, the 11 below them the
+// slot. Sharing a bit would squeeze each shard's clients into a fraction of
+// its slots.
+_Static_assert(CONN_LIMIT_SHARDS == 1 << 4 && CONN_LIMIT_SHARD_SLOTS == 1 << 11,
+               "conn_limit_shard() and conn_limit_home() take bits for these sizes");
+
+static uint32_t conn_limit_hash(uint32_t client) {
+  return client * 2654435769u;
+}
+
+static conn_limit_shard_t *conn_limit_shard(uint32_t hash) {
+  return &conn_limit_shards[hash >> 28 & (CONN_LIMIT_SHARDS - 1)];
+}
+
+static size_t conn_limit_home(uint32_t hash) {
+  return hash >> (28 - 11) & (CONN_LIMIT_SHARD_SLOTS - 1);
+}
+
+// Slot holding client, or the free slot where it would go
+static size_t conn_limit_find(const conn_limit_shard_t *shard, uint32_t client, uint32_t hash) {
+  size_t slot = conn_limit_home(hash);
+  while (shard->slots[slot].count > 0 && shard->slots[slot].client != client) {
+    slot = (slot + 1) & (CONN_LIMIT_SHARD_SLOTS - 1);
+  }
+  return slot;
+}
+
+bool conn_limit_acquire(uint32_t addr) {
+  if (conn_limit_per_client == 0) {
+    return true;
+  }
+
+  uint32_t client           = addr & conn_limit_mask;
+  uint32_t hash             = conn_limit_hash(client);
+  conn_limit_shard_t *shard = conn_limit_shard(hash);
+  bool accepted             = false;
+
+  pthread_mutex_lock(&shard->mutex);
+  size_t slot               = conn_limit_find(shard, client, hash);
+  conn_limit_entry_t *entry = &shard->slots[slot];
+  if (entry->count > 0) {
+    accepted = entry->count < conn_limit_per_client;
+  } else {
+    // Kept at most three quarters full so probes stay short; a client
+    // arriving at a full shard is refused like one over its limit
+    accepted = shard->used < CONN_LIMIT_SHARD_SLOTS * 3 / 4;
+    if (accepted) {
+      entry->client = client;
+      shard->used++;
+    }
+  }
+  if (accepted) {
+    entry->count++;
+  }
+  pthread_mutex_unlock(&shard->mutex);
+
+  return accepted;
+}
+
+void conn_limit_release(uint32_t addr) {
+  if (conn_limit_per_client == 0) {
+    return;
+  }
+
+  uint32_t client           = addr & conn_limit_mask;
+  uint32_t hash             = conn_limit_hash(client);
+  conn_limit_shard_t *shard = conn_limit_shard(hash);
+
+  pthread_mutex_lock(&shard->mutex);
+  size_t slot = conn_limit_find(shard, client, hash);
+  if (shard->slots[slot].count > 0 && --shard->slots[slot].count == 0) {
+    shard->used--;
+    // Backward-shift deletion: pull later entries of the probe run into the
+    // gap so lookups never stop early at it
+    size_t gap  = slot;
+    size_t next = (gap + 1) & (CONN_LIMIT_SHARD_SLOTS - 1);
+    while (shard->slots[next].count > 0) {
+      size_t home = conn_limit_home(conn_limit_hash(shard->slots[next].client));
+      // Movable unless its home lies cyclically in (gap, next]
+      if (((next - home) & (CONN_LIMIT_SHARD_SLOTS - 1)) >=
+          ((next - gap) & (CONN_LIMIT_SHARD_SLOTS - 1))) {
+        shard->slots[gap]        = shard->slots[next];
+        shard->slots[next].count = 0;
+        gap                      = next;
+      }
+      next = (next + 1) & (CONN_LIMIT_SHARD_SLOTS - 1);
+    }
+  }
+  pthread_mutex_unlock(&shard->mutex);
+}
+
+size_t conn_limit_count(void) {
+  size_t count = 0;
+
+  for (int i = 0; i < CONN_LIMIT_SHARDS; i++) {
+    pthread_mutex_lock(&conn_limit_shards[i].mutex);
+    count += conn_limit_shards[i].used;
+    pthread_mutex_unlock(&conn_limit_shards[i].mutex);
+  }
+
+  return count;
+}
+
 // CSRF protection
 void csrf_init(void) {
   if (csrf_initialized)
     return;
 
   memset(csrf_tokens, 0, sizeof(csrf_tokens));
-  csrf_initialized = true;
+  memset(csrf_replay_filter, 0, sizeof(csrf_replay_filter));
+  random_bytes(csrf_hmac_key, sizeof(csrf_hmac_key));
+  csrf_replay_rotated = time(NULL);
+  csrf_initialized    = true;
+}
+
+// Must be called before requests are served
+void csrf_set_mode(csrf_mode_t mode) {
+  csrf_mode = mode;
+}
+
+static const char base64url_chars[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+
+// Encode without padding; out must hold 4 * ceil(len / 3) + 1 bytes
+static void base64url_encode(const unsigned char *in, size_t len, char *out) {
+  size_t o = 0;
+  for (size_t i = 0; i < len; i += 3) {
+    uint32_t v = (uint32_t) in[i] << 16;
+    if (i + 1 < len)
+      v |= (uint32_t) in[i + 1] << 8;
+    if (i + 2 < len)
+      v |= in[i + 2];
+
+    out[o++] = base64url_chars[(v >> 18) & 0x3f];
+    out[o++] = base64url_chars[(v >> 12) & 0x3f];
+    if (i + 1 < len)
+      out[o++] = base64url_chars[(v >> 6) & 0x3f];
+    if (i + 2 < len)
+      out[o++] = base64url_chars[v & 0x3f];
+  }
+  out[o] = '\0';
+}
+
+static int base64url_value(char c) {
+  if (c >= 'A' && c <= 'Z')
+    return c - 'A';
+  if (c >= 'a' && c <= 'z')
+    return c - 'a' + 26;
+  if (c >= '0' && c <= '9')
+    return c - '0' + 52;
+  if (c == '-')
+    return 62;
+  if (c == '_')
+    return 63;
+  return -1;
+}
+
+// Decode exactly out_len bytes; returns 0 on success, -1 on malformed input
+static int base64url_decode(const char *in, unsigned char *out, size_t out_len) {
+  size_t expected = (out_len * 4 + 2) / 3;
+  if (strlen(in) != expected)
+    return -1;
+
+  uint32_t acc = 0;
+  int bits     = 0;
+  size_t o     = 0;
+  for (size_t i = 0; i < expected; i++) {
+    int v = base64url_value(in[i]);
+    if (v < 0)
+      return -1;
+    acc = (acc << 6) | (uint32_t) v;
+    bits += 6;
+    if (bits >= 8) {
+      bits -= 8;
+      if (o < out_len)
+        out[o++] = (unsigned char) (acc >> bits);
+    }
+  }
+  // Leftover padding bits must be zero so every token has one encoding
+  if (o != out_len || (acc & ((1u << bits) - 1)) != 0)
+    return -1;
+  return 0;
+}
+
+static void csrf_compute_mac(const char *session_token, const unsigned char *timestamp_nonce,
+                             unsigned char mac[CSRF_MAC_SIZE]) {
+  // MAC input: session token (NUL-terminated, so it cannot run into the
+  // timestamp) followed by timestamp and nonce
+  unsigned char message[SESSION_TOKEN_LENGTH + 1 + CSRF_TIMESTAMP_SIZE + CSRF_NONCE_SIZE];
+  size_t token_len = strnlen(session_token, SESSION_TOKEN_LENGTH);
+  memcpy(message, session_token, token_len);
+  message[token_len] = '\0';
+  memcpy(message + token_len + 1, timestamp_nonce, CSRF_TIMESTAMP_SIZE + CSRF_NONCE_SIZE);
+
+  unsigned char full[EVP_MAX_MD_SIZE];
+  unsigned int full_len = 0;
+  HMAC(EVP_sha256(), csrf_hmac_key, sizeof(csrf_hmac_key), message,
+       token_len + 1 + CSRF_TIMESTAMP_SIZE + CSRF_NONCE_SIZE, full, &full_len);
+
+  memcpy(mac, full, CSRF_MAC_SIZE);
+}
+
+// Internal helper - caller must hold csrf_mutex. Rotates one generation at a
+// time so entries recorded in the current generation survive another lifetime.
+static void csrf_replay_rotate_locked(time_t now) {
+  if (now - csrf_replay_rotated < CSRF_TOKEN_TIMEOUT)
+    return;
+
+  csrf_replay_current ^= 1;
+  memset(csrf_replay_filter[csrf_replay_current], 0, sizeof(csrf_replay_filter[0]));
+  csrf_replay_rotated = now;
+}
+
+// Internal helper - caller must hold csrf_mutex. Records the token MAC in the
+// current generation and returns true if it was already present in either.
+static bool csrf_replay_check_and_set_locked(const unsigned char mac[CSRF_MAC_SIZE]) {
+  // The MAC is unforgeable and uniformly distributed, so its bytes can serve
+  // directly as the two base hashes for double hashing.
+  uint32_t h1, h2;
+  memcpy(&h1, mac, sizeof(h1));
+  memcpy(&h2, mac + sizeof(h1), sizeof(h2));
+  h2 |= 1;
+
+  bool seen[2] = {true, true};
+  for (uint32_t i = 0; i < CSRF_REPLAY_FILTER_HASHES; i++) {
+    uint32_t bit  = (h1 + i * h2) & (CSRF_REPLAY_FILTER_BITS - 1);
+    uint64_t mask = (uint64_t) 1 << (bit & 63);
+
+    for (int gen = 0; gen < 2; gen++) {
+      if (!(csrf_replay_filter[gen][bit >> 6] & mask))
+        seen[gen] = false;
+    }
+    csrf_replay_filter[csrf_replay_current][bit >> 6] |= mask;
+  }
+
+  return seen[0] || seen[1];
+}
+
+static const char *csrf_generate_stateless(const char *session_token) {
+  unsigned char raw[CSRF_RAW_SIZE];
+  uint64_t timestamp = (uint64_t) time(NULL);
+
+  for (int i = 0; i < CSRF_TIMESTAMP_SIZE; i++) {
+    raw[i] = (unsigned char) (timestamp >> (8 * (CSRF_TIMESTAMP_SIZE - 1 - i)));
+  }
+  random_bytes(raw + CSRF_TIMESTAMP_SIZE, CSRF_NONCE_SIZE);
+  csrf_compute_mac(session_token, raw, raw + CSRF_TIMESTAMP_SIZE + CSRF_NONCE_SIZE);
+
+  base64url_encode(raw, sizeof(raw), csrf_stateless_token);
+  return csrf_stateless_token;
+}
+
+static bool csrf_validate_stateless(const char *csrf_token, const char *session_token) {
+  unsigned char raw[CSRF_RAW_SIZE];
+  if (base64url_decode(csrf_token, raw, sizeof(raw)) != 0)
+    return false;
+
+  uint64_t timestamp = 0;
+  for (int i = 0; i < CSRF_TIMESTAMP_SIZE; i++) {
+    timestamp = (timestamp << 8) | raw[i];
+  }
+
+  // Reject expired tokens and tokens from the future
+  time_t now = time(NULL);
+  if (timestamp > (uint64_t) now || (uint64_t) now - timestamp > CSRF_TOKEN_TIMEOUT)
+    return false;
+
+  // Verify it belongs to this session
+  unsigned char expected[CSRF_MAC_SIZE];
+  const unsigned char *mac = raw + CSRF_TIMESTAMP_SIZE + CSRF_NONCE_SIZE;
+  csrf_compute_mac(session_token, raw, expected);
+  if (CRYPTO_memcmp(expected, mac, CSRF_MAC_SIZE) != 0)
+    return false;
+
+  // One-time use: reject tokens the replay filter has already seen
+  pthread_mutex_lock(&csrf_mutex);
+  csrf_replay_rotate_locked(now);
+  bool replayed = csrf_replay_check_and_set_locked(mac);
+  pthread_mutex_unlock(&csrf_mutex);
+
+  return !replayed;
 }
 
 // Internal helper - caller must hold csrf_mutex
@@ -277,6 +785,9 @@ const char *csrf_generate(const char *session_token) {
   if (!session_token)
     return NULL;
 
+  if (csrf_mode == CSRF_MODE_STATELESS)
+    return csrf_generate_stateless(session_token);
+
   pthread_mutex_lock(&csrf_mutex);
 
   csrf_cleanup_expired_locked();
@@ -303,6 +814,9 @@ bool csrf_validate(const char *csrf_token, const char *session_token) {
   if (!csrf_token || !session_token)
     return false;
 
+  if (csrf_mode == CSRF_MODE_STATELESS)
+    return csrf_validate_stateless(csrf_token, session_token);
+
   pthread_mutex_lock(&csrf_mutex);
 
   time_t now = time(NULL);
@@ -336,5 +850,6 @@ bool csrf_validate(const char *csrf_token, const char *session_token) {
 void csrf_cleanup_expired(void) {
   pthread_mutex_lock(&csrf_mutex);
   csrf_cleanup_expired_locked();
+  csrf_replay_rotate_locked(time(NULL));
   pthread_mutex_unlock(&csrf_mutex);
 }
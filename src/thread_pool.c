@@ -1,4 +1,5 @@
 #include "thread_pool.h"
+#include "probes.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -7,9 +8,16 @@
 static void *worker_thread(void *arg);
 
 thread_pool_t *thread_pool_create(int thread_count) {
+  return thread_pool_create_ex(thread_count, MAX_QUEUE_SIZE);
+}
+
+thread_pool_t *thread_pool_create_ex(int thread_count, int queue_size) {
   if (thread_count <= 0) {
     thread_count = DEFAULT_THREAD_COUNT;
   }
+  if (queue_size <= 0) {
+    queue_size = MAX_QUEUE_SIZE;
+  }
 
   thread_pool_t *pool = (thread_pool_t *) malloc(sizeof(thread_pool_t));
   if (!pool) {
@@ -18,15 +26,16 @@ thread_pool_t *thread_pool_create(int thread_count) {
 
   // Initialize pool
   pool->thread_count = thread_count;
-  pool->queue_size   = MAX_QUEUE_SIZE;
+  pool->queue_size   = queue_size;
   pool->queue_front  = 0;
   pool->queue_rear   = 0;
   pool->queue_count  = 0;
+  pool->active_count = 0;
   pool->shutdown     = false;
 
   // Allocate threads and queue
   pool->threads = (pthread_t *) malloc(sizeof(pthread_t) * thread_count);
-  pool->queue   = (task_t *) malloc(sizeof(task_t) * MAX_QUEUE_SIZE);
+  pool->queue   = (task_t *) malloc(sizeof(task_t) * queue_size);
 
   if (!pool->threads || !pool->queue) {
     free(pool->threads);
@@ -78,6 +87,7 @@ bool thread_pool_add_task(thread_pool_t *pool, void (*function)(void *), void *a
   pool->queue[pool->queue_rear].arg      = arg;
   pool->queue_rear                       = (pool->queue_rear + 1) % pool->queue_size;
   pool->queue_count++;
+  PROBE3(pool_enqueue, pool, arg, pool->queue_count);
 
   // Signal waiting threads
   pthread_cond_signal(&pool->queue_cond);
@@ -86,6 +96,31 @@ bool thread_pool_add_task(thread_pool_t *pool, void (*function)(void *), void *a
   return true;
 }
 
+// Like thread_pool_add_task, but fails instead of waiting when the queue is full
+bool thread_pool_try_add_task(thread_pool_t *pool, void (*function)(void *), void *arg) {
+  if (!pool || !function) {
+    return false;
+  }
+
+  pthread_mutex_lock(&pool->queue_mutex);
+
+  if (pool->shutdown || pool->queue_count == pool->queue_size) {
+    pthread_mutex_unlock(&pool->queue_mutex);
+    return false;
+  }
+
+  pool->queue[pool->queue_rear].function = function;
+  pool->queue[pool->queue_rear].arg      = arg;
+  pool->queue_rear                       = (pool->queue_rear + 1) % pool->queue_size;
+  pool->queue_count++;
+  PROBE3(pool_enqueue, pool, arg, pool->queue_count);
+
+  pthread_cond_signal(&pool->queue_cond);
+  pthread_mutex_unlock(&pool->queue_mutex);
+
+  return true;
+}
+
 void thread_pool_destroy(thread_pool_t *pool) {
   if (!pool) {
     return;
@@ -117,6 +152,18 @@ int thread_pool_get_active_count(thread_pool_t *pool) {
     return 0;
   }
 
+  pthread_mutex_lock(&pool->queue_mutex);
+  int count = pool->active_count;
+  pthread_mutex_unlock(&pool->queue_mutex);
+
+  return count;
+}
+
+int thread_pool_get_queue_depth(thread_pool_t *pool) {
+  if (!pool) {
+    return 0;
+  }
+
   pthread_mutex_lock(&pool->queue_mutex);
   int count = pool->queue_count;
   pthread_mutex_unlock(&pool->queue_mutex);
@@ -144,6 +191,8 @@ static void *worker_thread(void *arg) {
     task_t task       = pool->queue[pool->queue_front];
     pool->queue_front = (pool->queue_front + 1) % pool->queue_size;
     pool->queue_count--;
+    pool->active_count++;
+    PROBE3(pool_dequeue, pool, task.arg, pool->queue_count);
 
     // Signal that queue is not full
     pthread_cond_signal(&pool->queue_not_full);
@@ -153,6 +202,10 @@ static void *worker_thread(void *arg) {
     if (task.function) {
       task.function(task.arg);
     }
+
+    pthread_mutex_lock(&pool->queue_mutex);
+    pool->active_count--;
+    pthread_mutex_unlock(&pool->queue_mutex);
   }
 
   return NULL;
@@ -1,12 +1,255 @@
 #include "tls.h"
+#include "probes.h"
+#include <errno.h>
+#include <openssl/core_names.h>
+#include <openssl/rand.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#define TLS_SESSION_CACHE_SIZE 20480 // Sessions kept for session-ID resumption
+#define TLS_SESSION_TIMEOUT 3600     // Seconds a session (or ticket) can be resumed
+#define TLS_TICKET_KEY_ROTATION 3600 // Seconds between ticket key rotations
+#define TLS_IO_TIMEOUT_MS 30000      // Blocking wrappers give up after this long
+#define TLS_COALESCE_SIZE 16384      // Largest TLS record payload
+#define TLS_WRITEV_BATCH 16          // iovecs handed to one writev() call
+#define TLS_POOL_BUFFER_MIN 16384    // Smallest allocation served from the pool
+#define TLS_POOL_BUFFER_SIZE 20480   // Fits a record buffer with its overhead
+#define TLS_POOL_MAX_FREE 256        // Idle buffers kept before returning to malloc
+#define TLS_SESSION_ID_CONTEXT "c-http-server"
+
+// Session ticket keys. New tickets are encrypted with the current key; tickets
+// from the previous key are still accepted (and re-issued) for one more
+// rotation period, so no ticket outlives two periods.
+typedef struct {
+  unsigned char name[16];
+  unsigned char aes_key[32];
+  unsigned char hmac_key[32];
+  time_t created;
+  bool valid;
+} tls_ticket_key_t;
+
+static tls_ticket_key_t ticket_keys[2]; // [0] current, [1] previous
+static pthread_mutex_t ticket_keys_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static atomic_ulong full_handshakes    = 0;
+static atomic_ulong resumed_handshakes = 0;
+static atomic_ulong failed_handshakes  = 0;
+static atomic_ulong ktls_connections   = 0;
+static atomic_ulong active_connections = 0;
+
+// OpenSSL heap accounting. The allocator hooks see every OpenSSL allocation
+// in the process, scrypt scratch space and CSRF HMACs included, so only
+// allocations made inside a connection's SSL calls are counted, and only
+// those of record buffer size come from the shared free list. Every
+// allocation carries a small header saying how it was made.
+typedef union {
+  struct {
+    size_t size;
+    bool pooled;
+    bool counted; // Made by a connection; part of heap_in_use
+  };
+  max_align_t align;
+} tls_alloc_header_t;
+
+typedef struct tls_pool_buffer {
+  struct tls_pool_buffer *next;
+} tls_pool_buffer_t;
+
+static bool pool_enabled                 = false;
+static atomic_size_t heap_in_use         = 0;
+static tls_pool_buffer_t *pool_free_head = NULL;
+static size_t pool_free_count            = 0;
+static pthread_mutex_t pool_mutex        = PTHREAD_MUTEX_INITIALIZER;
+static __thread int connection_calls     = 0; // Nesting of tls_call_begin()
+
+// Bracket OpenSSL calls made on behalf of one connection
+static void tls_call_begin(void) {
+  connection_calls++;
+}
+
+static void tls_call_end(void) {
+  connection_calls--;
+}
 
 void tls_init(void) {
   SSL_load_error_strings();
   OpenSSL_add_ssl_algorithms();
 }
 
+static void *tls_pool_malloc(size_t size, const char *file, int line) {
+  (void) file;
+  (void) line;
+  bool counted      = connection_calls > 0;
+  bool pooled       = counted && size >= TLS_POOL_BUFFER_MIN && size <= TLS_POOL_BUFFER_SIZE;
+  size_t block_size = pooled ? TLS_POOL_BUFFER_SIZE : size;
+  void *block       = NULL;
+
+  if (pooled) {
+    pthread_mutex_lock(&pool_mutex);
+    if (pool_free_head) {
+      block          = pool_free_head;
+      pool_free_head = pool_free_head->next;
+      pool_free_count--;
+    }
+    pthread_mutex_unlock(&pool_mutex);
+  }
+  if (!block) {
+    block = malloc(sizeof(tls_alloc_header_t) + block_size);
+    if (!block) {
+      return NULL;
+    }
+  }
+
+  tls_alloc_header_t *header = (tls_alloc_header_t *) block;
+  header->size               = block_size;
+  header->pooled             = pooled;
+  header->counted            = counted;
+  if (counted) {
+    atomic_fetch_add(&heap_in_use, block_size);
+  }
+  return header + 1;
+}
+
+static void tls_pool_free(void *ptr, const char *file, int line) {
+  (void) file;
+  (void) line;
+  if (!ptr) {
+    return;
+  }
+
+  tls_alloc_header_t *header = (tls_alloc_header_t *) ptr - 1;
+  if (header->counted) {
+    atomic_fetch_sub(&heap_in_use, header->size);
+  }
+
+  if (header->pooled) {
+    pthread_mutex_lock(&pool_mutex);
+    if (pool_free_count < TLS_POOL_MAX_FREE) {
+      tls_pool_buffer_t *buffer = (tls_pool_buffer_t *) header;
+      buffer->next              = pool_free_head;
+      pool_free_head            = buffer;
+      pool_free_count++;
+      header = NULL;
+    }
+    pthread_mutex_unlock(&pool_mutex);
+  }
+  free(header);
+}
+
+static void *tls_pool_realloc(void *ptr, size_t size, const char *file, int line) {
+  if (!ptr) {
+    return tls_pool_malloc(size, file, line);
+  }
+  if (size == 0) {
+    tls_pool_free(ptr, file, line);
+    return NULL;
+  }
+
+  tls_alloc_header_t *header = (tls_alloc_header_t *) ptr - 1;
+  if (header->pooled && size >= TLS_POOL_BUFFER_MIN && size <= TLS_POOL_BUFFER_SIZE) {
+    return ptr; // Already backed by a full pool buffer
+  }
+
+  void *resized = tls_pool_malloc(size, file, line);
+  if (resized) {
+    memcpy(resized, ptr, header->size < size ? header->size : size);
+    tls_pool_free(ptr, file, line);
+  }
+  return resized;
+}
+
+bool tls_use_buffer_pool(void) {
+  if (!CRYPTO_set_mem_functions(tls_pool_malloc, tls_pool_realloc, tls_pool_free)) {
+    return false;
+  }
+  pool_enabled = true;
+  return true;
+}
+
+// Internal helper - caller must hold ticket_keys_mutex
+static int tls_rotate_ticket_keys_locked(time_t now) {
+  tls_ticket_key_t key = {.created = now, .valid = true};
+  if (RAND_bytes(key.name, sizeof(key.name)) != 1 ||
+      RAND_bytes(key.aes_key, sizeof(key.aes_key)) != 1 ||
+      RAND_bytes(key.hmac_key, sizeof(key.hmac_key)) != 1) {
+    return -1;
+  }
+
+  ticket_keys[1] = ticket_keys[0];
+  ticket_keys[0] = key;
+  OPENSSL_cleanse(&key, sizeof(key));
+  return 0;
+}
+
+int tls_rotate_ticket_keys(void) {
+  pthread_mutex_lock(&ticket_keys_mutex);
+  int result = tls_rotate_ticket_keys_locked(time(NULL));
+  pthread_mutex_unlock(&ticket_keys_mutex);
+  return result;
+}
+
+static int tls_ticket_key_cb(SSL *ssl, unsigned char key_name[16], unsigned char *iv,
+                             EVP_CIPHER_CTX *cipher_ctx, EVP_MAC_CTX *mac_ctx, int encrypt) {
+  (void) ssl;
+  tls_ticket_key_t key;
+  int result = 1;
+
+  pthread_mutex_lock(&ticket_keys_mutex);
+  time_t now = time(NULL);
+  if (!ticket_keys[0].valid || now - ticket_keys[0].created >= TLS_TICKET_KEY_ROTATION) {
+    if (tls_rotate_ticket_keys_locked(now) != 0) {
+      pthread_mutex_unlock(&ticket_keys_mutex);
+      return -1;
+    }
+  }
+
+  if (encrypt) {
+    key = ticket_keys[0];
+  } else if (memcmp(key_name, ticket_keys[0].name, sizeof(ticket_keys[0].name)) == 0) {
+    key = ticket_keys[0];
+  } else if (ticket_keys[1].valid &&
+             memcmp(key_name, ticket_keys[1].name, sizeof(ticket_keys[1].name)) == 0) {
+    key    = ticket_keys[1];
+    result = 2; // Valid, but ask OpenSSL to issue a ticket under the current key
+  } else {
+    pthread_mutex_unlock(&ticket_keys_mutex);
+    return 0; // Unknown or expired key: fall back to a full handshake
+  }
+  pthread_mutex_unlock(&ticket_keys_mutex);
+
+  if (encrypt) {
+    if (RAND_bytes(iv, EVP_MAX_IV_LENGTH) != 1) {
+      OPENSSL_cleanse(&key, sizeof(key));
+      return -1;
+    }
+    memcpy(key_name, key.name, sizeof(key.name));
+  }
+
+  OSSL_PARAM params[] = {
+      OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY, key.hmac_key, sizeof(key.hmac_key)),
+      OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, "SHA256", 0),
+      OSSL_PARAM_construct_end(),
+  };
+
+  int ok = encrypt ? EVP_EncryptInit_ex(cipher_ctx, EVP_aes_256_cbc(), NULL, key.aes_key, iv)
+                   : EVP_DecryptInit_ex(cipher_ctx, EVP_aes_256_cbc(), NULL, key.aes_key, iv);
+  if (ok != 1 || EVP_MAC_CTX_set_params(mac_ctx, params) != 1) {
+    result = -1;
+  }
+
+  OPENSSL_cleanse(&key, sizeof(key));
+  return result;
+}
+
 SSL_CTX *tls_create_context(const char *cert_file, const char *key_file) {
   const SSL_METHOD *method = TLS_server_method();
   SSL_CTX *ctx             = SSL_CTX_new(method);
@@ -40,9 +283,43 @@ SSL_CTX *tls_create_context(const char *cert_file, const char *key_file) {
     return NULL;
   }
 
+  // Session resumption: a server-side cache for session IDs plus stateless
+  // tickets under rotating keys, so returning clients skip the full handshake
+  SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+  SSL_CTX_sess_set_cache_size(ctx, TLS_SESSION_CACHE_SIZE);
+  SSL_CTX_set_timeout(ctx, TLS_SESSION_TIMEOUT);
+  SSL_CTX_set_session_id_context(ctx, (const unsigned char *) TLS_SESSION_ID_CONTEXT,
+                                 strlen(TLS_SESSION_ID_CONTEXT));
+  SSL_CTX_set_tlsext_ticket_key_evp_cb(ctx, tls_ticket_key_cb);
+
+  // Free the record buffers whenever a connection has nothing buffered, so
+  // an idle connection holds little more than its SSL object
+  SSL_CTX_set_mode(ctx, SSL_MODE_RELEASE_BUFFERS);
+
   return ctx;
 }
 
+bool tls_enable_ktls(SSL_CTX *ctx) {
+#if defined(SSL_OP_ENABLE_KTLS) && !defined(OPENSSL_NO_KTLS)
+  // OpenSSL installs the kernel keys itself after the handshake and keeps
+  // encrypting in user space if the tls module or the cipher is unavailable
+  SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+  return true;
+#else
+  (void) ctx;
+  return false;
+#endif
+}
+
+bool tls_ktls_send_enabled(SSL *ssl) {
+#ifndef OPENSSL_NO_KTLS
+  return BIO_get_ktls_send(SSL_get_wbio(ssl)) > 0;
+#else
+  (void) ssl;
+  return false;
+#endif
+}
+
 void tls_cleanup_context(SSL_CTX *ctx) {
   if (ctx) {
     SSL_CTX_free(ctx);
@@ -50,48 +327,247 @@ void tls_cleanup_context(SSL_CTX *ctx) {
   EVP_cleanup();
 }
 
-SSL *tls_accept_connection(SSL_CTX *ctx, int client_fd) {
+// Map an SSL_* return value to what the caller has to wait for
+static tls_io_status_t tls_io_status(SSL *ssl, int ret) {
+  switch (SSL_get_error(ssl, ret)) {
+    case SSL_ERROR_WANT_READ:
+      return TLS_IO_WANT_READ;
+    case SSL_ERROR_WANT_WRITE:
+      return TLS_IO_WANT_WRITE;
+    case SSL_ERROR_ZERO_RETURN:
+      return TLS_IO_CLOSED;
+    default:
+      ERR_print_errors_fp(stderr);
+      return TLS_IO_ERROR;
+  }
+}
+
+// Block until the socket is ready for what OpenSSL asked for
+static bool tls_wait(SSL *ssl, tls_io_status_t want) {
+  struct pollfd pfd = {.fd = SSL_get_fd(ssl), .events = want == TLS_IO_WANT_READ ? POLLIN : POLLOUT};
+  int rc;
+  do {
+    rc = poll(&pfd, 1, TLS_IO_TIMEOUT_MS);
+  } while (rc < 0 && errno == EINTR);
+  return rc > 0;
+}
+
+SSL *tls_new_connection(SSL_CTX *ctx, int client_fd) {
+  tls_call_begin();
   SSL *ssl = SSL_new(ctx);
+  if (ssl) {
+    SSL_set_fd(ssl, client_fd); // Allocates the socket BIO
+  }
+  tls_call_end();
   if (!ssl) {
     ERR_print_errors_fp(stderr);
     return NULL;
   }
 
-  SSL_set_fd(ssl, client_fd);
+  SSL_set_accept_state(ssl);
+  atomic_fetch_add(&active_connections, 1);
+  PROBE2(tls_handshake_start, ssl, client_fd);
+  return ssl;
+}
 
-  if (SSL_accept(ssl) <= 0) {
-    ERR_print_errors_fp(stderr);
-    SSL_free(ssl);
+tls_io_status_t tls_handshake(SSL *ssl) {
+  tls_call_begin();
+  int ret = SSL_do_handshake(ssl);
+  tls_call_end();
+  if (ret == 1) {
+    if (SSL_session_reused(ssl)) {
+      atomic_fetch_add(&resumed_handshakes, 1);
+    } else {
+      atomic_fetch_add(&full_handshakes, 1);
+    }
+    if (tls_ktls_send_enabled(ssl)) {
+      atomic_fetch_add(&ktls_connections, 1);
+    }
+    PROBE3(tls_handshake_end, ssl, 1, SSL_session_reused(ssl));
+    return TLS_IO_DONE;
+  }
+
+  tls_io_status_t status = tls_io_status(ssl, ret);
+  if (status != TLS_IO_WANT_READ && status != TLS_IO_WANT_WRITE) {
+    atomic_fetch_add(&failed_handshakes, 1);
+    PROBE3(tls_handshake_end, ssl, 0, 0);
+    return TLS_IO_ERROR;
+  }
+  return status;
+}
+
+tls_io_status_t tls_read_nonblock(SSL *ssl, void *buffer, size_t length, size_t *bytes_read) {
+  tls_call_begin();
+  int ret = SSL_read(ssl, buffer, length);
+  tls_call_end();
+  if (ret > 0) {
+    *bytes_read = (size_t) ret;
+    return TLS_IO_DONE;
+  }
+  *bytes_read = 0;
+  return tls_io_status(ssl, ret);
+}
+
+tls_io_status_t tls_write_nonblock(SSL *ssl, const void *buffer, size_t length,
+                                   size_t *bytes_written) {
+  tls_call_begin();
+  int ret = SSL_write(ssl, buffer, length);
+  tls_call_end();
+  if (ret > 0) {
+    *bytes_written = (size_t) ret;
+    return TLS_IO_DONE;
+  }
+  *bytes_written = 0;
+  return tls_io_status(ssl, ret);
+}
+
+SSL *tls_accept_connection(SSL_CTX *ctx, int client_fd) {
+  SSL *ssl = tls_new_connection(ctx, client_fd);
+  if (!ssl) {
     return NULL;
   }
 
+  tls_io_status_t status;
+  while ((status = tls_handshake(ssl)) != TLS_IO_DONE) {
+    if (status == TLS_IO_ERROR || !tls_wait(ssl, status)) {
+      tls_call_begin();
+      SSL_free(ssl);
+      tls_call_end();
+      atomic_fetch_sub(&active_connections, 1);
+      return NULL;
+    }
+  }
+
   return ssl;
 }
 
 ssize_t tls_read(SSL *ssl, void *buffer, size_t length) {
-  int bytes_read = SSL_read(ssl, buffer, length);
-  if (bytes_read <= 0) {
-    int error = SSL_get_error(ssl, bytes_read);
-    if (error != SSL_ERROR_ZERO_RETURN) {
-      ERR_print_errors_fp(stderr);
+  size_t bytes_read;
+  tls_io_status_t status;
+
+  while ((status = tls_read_nonblock(ssl, buffer, length, &bytes_read)) != TLS_IO_DONE) {
+    if ((status != TLS_IO_WANT_READ && status != TLS_IO_WANT_WRITE) || !tls_wait(ssl, status)) {
+      return -1;
     }
-    return -1;
   }
-  return bytes_read;
+  return (ssize_t) bytes_read;
 }
 
 ssize_t tls_write(SSL *ssl, const void *buffer, size_t length) {
-  int bytes_written = SSL_write(ssl, buffer, length);
-  if (bytes_written <= 0) {
-    ERR_print_errors_fp(stderr);
+  size_t bytes_written;
+  tls_io_status_t status;
+
+  // Retries must pass the same buffer, which holds here
+  while ((status = tls_write_nonblock(ssl, buffer, length, &bytes_written)) != TLS_IO_DONE) {
+    if ((status != TLS_IO_WANT_READ && status != TLS_IO_WANT_WRITE) || !tls_wait(ssl, status)) {
+      return -1;
+    }
+  }
+  return (ssize_t) bytes_written;
+}
+
+// kTLS: the kernel frames and encrypts whatever is written to the socket
+static ssize_t tls_writev_kernel(SSL *ssl, const struct iovec *iov, int iovcnt) {
+  int fd        = SSL_get_fd(ssl);
+  ssize_t total = 0;
+  int index     = 0;
+  size_t offset = 0; // Bytes of iov[index] already written
+
+  while (index < iovcnt) {
+    struct iovec batch[TLS_WRITEV_BATCH];
+    int count = 0;
+    for (int i = index; i < iovcnt && count < TLS_WRITEV_BATCH; i++, count++) {
+      batch[count] = iov[i];
+    }
+    batch[0].iov_base = (char *) batch[0].iov_base + offset;
+    batch[0].iov_len -= offset;
+
+    ssize_t written = writev(fd, batch, count);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if ((errno == EAGAIN || errno == EWOULDBLOCK) && tls_wait(ssl, TLS_IO_WANT_WRITE)) {
+        continue;
+      }
+      return -1;
+    }
+    total += written;
+
+    // Skip past fully written buffers
+    size_t left = (size_t) written;
+    while (index < iovcnt && left >= iov[index].iov_len - offset) {
+      left -= iov[index].iov_len - offset;
+      index++;
+      offset = 0;
+    }
+    offset += left;
+  }
+
+  return total;
+}
+
+ssize_t tls_writev(SSL *ssl, const struct iovec *iov, int iovcnt) {
+  if (tls_ktls_send_enabled(ssl)) {
+    return tls_writev_kernel(ssl, iov, iovcnt);
+  }
+
+  // User-space encryption: gather small buffers so headers and body share a
+  // record instead of each paying for its own header, MAC and write()
+  char buffer[TLS_COALESCE_SIZE];
+  size_t used   = 0;
+  ssize_t total = 0;
+
+  for (int i = 0; i < iovcnt; i++) {
+    const char *data = (const char *) iov[i].iov_base;
+    size_t length    = iov[i].iov_len;
+
+    if (length > sizeof(buffer) - used) {
+      if (used > 0 && tls_write(ssl, buffer, used) < 0) {
+        return -1;
+      }
+      used = 0;
+    }
+    if (length >= sizeof(buffer)) {
+      if (tls_write(ssl, data, length) < 0) {
+        return -1;
+      }
+    } else {
+      memcpy(buffer + used, data, length);
+      used += length;
+    }
+    total += (ssize_t) length;
+  }
+
+  if (used > 0 && tls_write(ssl, buffer, used) < 0) {
     return -1;
   }
-  return bytes_written;
+  return total;
 }
 
 void tls_close(SSL *ssl) {
   if (ssl) {
+    tls_call_begin();
     SSL_shutdown(ssl);
     SSL_free(ssl);
+    tls_call_end();
+    atomic_fetch_sub(&active_connections, 1);
+  }
+}
+
+void tls_get_stats(tls_stats_t *stats) {
+  stats->full_handshakes    = atomic_load(&full_handshakes);
+  stats->resumed_handshakes = atomic_load(&resumed_handshakes);
+  stats->failed_handshakes  = atomic_load(&failed_handshakes);
+  stats->ktls_connections   = atomic_load(&ktls_connections);
+  stats->active_connections = atomic_load(&active_connections);
+
+  size_t in_use         = atomic_load(&heap_in_use);
+  stats->memory_in_use  = pool_enabled ? in_use : 0;
+  stats->pooled_buffers = 0;
+  if (pool_enabled) {
+    pthread_mutex_lock(&pool_mutex);
+    stats->pooled_buffers = pool_free_count;
+    pthread_mutex_unlock(&pool_mutex);
   }
 }
@@ -0,0 +1,112 @@
+#include "trace.h"
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define TRACE_LINE_MAX 1024
+
+static const char *stage_names[TRACE_STAGES] = {
+    [TRACE_ACCEPTED] = "accept",         [TRACE_HANDSHAKE_DONE] = "handshake",
+    [TRACE_QUEUED] = "request_wait",     [TRACE_WORKER_START] = "queue",
+    [TRACE_READ_DONE] = "read",          [TRACE_PARSED] = "parse",
+    [TRACE_MIDDLEWARE_DONE] = "middleware", [TRACE_HANDLER_DONE] = "handler_return",
+    [TRACE_RESPONSE_START] = "handler",  [TRACE_RESPONSE_SENT] = "write",
+    [TRACE_CLOSED] = "close",
+};
+
+static int slow_fd                = -1;
+static uint64_t slow_threshold_ns = 0;
+
+// Sampling budget: at most TRACE_SLOW_PER_SECOND lines per wall-clock second
+static atomic_llong sample_second = 0;
+static atomic_int sample_count    = 0;
+
+int trace_init(const char *path, unsigned threshold_ms) {
+  slow_threshold_ns = (uint64_t) threshold_ms * 1000000ULL;
+  if (threshold_ms == 0) {
+    return 0;
+  }
+
+  slow_fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+  if (slow_fd < 0) {
+    perror("Failed to open slow request log");
+    return -1;
+  }
+  return 0;
+}
+
+void trace_shutdown(void) {
+  if (slow_fd >= 0) {
+    close(slow_fd);
+    slow_fd = -1;
+  }
+}
+
+static bool trace_take_sample(void) {
+  long long now     = (long long) time(NULL);
+  long long current = atomic_load(&sample_second);
+  if (current != now && atomic_compare_exchange_strong(&sample_second, &current, now)) {
+    atomic_store(&sample_count, 0);
+  }
+  return atomic_fetch_add(&sample_count, 1) < TRACE_SLOW_PER_SECOND;
+}
+
+void trace_finish(const trace_t *trace, const access_log_entry_t *entry) {
+  if (slow_fd < 0 || !trace->ns[TRACE_ACCEPTED] || !trace->ns[TRACE_CLOSED]) {
+    return;
+  }
+
+  uint64_t total = trace->ns[TRACE_CLOSED] - trace->ns[TRACE_ACCEPTED];
+  if (total < slow_threshold_ns || !trace_take_sample()) {
+    return;
+  }
+
+  // Order the marks that were reached by time; asynchronous handlers return
+  // before their response starts, synchronous ones after it is sent
+  int order[TRACE_STAGES];
+  int count = 0;
+  for (int stage = 0; stage < TRACE_STAGES; stage++) {
+    if (!trace->ns[stage]) {
+      continue;
+    }
+    int i = count++;
+    while (i > 0 && trace->ns[order[i - 1]] > trace->ns[stage]) {
+      order[i] = order[i - 1];
+      i--;
+    }
+    order[i] = stage;
+  }
+
+  char time_text[32];
+  struct tm tm;
+  time_t timestamp = (time_t) entry->timestamp;
+  gmtime_r(&timestamp, &tm);
+  strftime(time_text, sizeof(time_text), "%Y-%m-%dT%H:%M:%SZ", &tm);
+
+  char line[TRACE_LINE_MAX];
+  int length = snprintf(line, sizeof(line),
+                        "time=%s ip=%s method=%s path=\"%s\" status=%d total_us=%" PRIu64,
+                        time_text, entry->client_ip, entry->method, entry->path, entry->status,
+                        total / 1000);
+
+  // Each stage is the time since the previous mark
+  for (int i = 1; i < count && length < (int) sizeof(line); i++) {
+    uint64_t duration = trace->ns[order[i]] - trace->ns[order[i - 1]];
+    length += snprintf(line + length, sizeof(line) - (size_t) length, " %s_us=%" PRIu64,
+                       stage_names[order[i]], duration / 1000);
+  }
+  if (length >= (int) sizeof(line) - 1) {
+    length = (int) sizeof(line) - 2;
+  }
+  line[length++] = '\n';
+
+  // One O_APPEND write per line keeps lines from different threads whole
+  if (write(slow_fd, line, (size_t) length) < 0) {
+    perror("Failed to write slow request log");
+  }
+}
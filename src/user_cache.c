@@ -0,0 +1,238 @@
+#include "user_cache.h"
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+
+#define USER_CACHE_BUCKETS 512 // Per shard, power of two
+#define USER_NAME_MAX 65
+#define USER_CACHE_NEGATIVE_MAX (USER_CACHE_SHARD_CAPACITY / 4) // Negative entries per shard
+
+// Each shard keeps real users and unknown names in separate LRU lists
+#define USER_LRU_KNOWN 0
+#define USER_LRU_NEGATIVE 1
+
+typedef struct {
+  char username[USER_NAME_MAX];
+  user_record_t record;
+  time_t expires; // 0 for entries that live until evicted or invalidated
+  uint32_t hash;
+  int bucket_next; // Next entry in the hash chain, or in the free list
+  int lru_prev;
+  int lru_next;
+} user_cache_entry_t;
+
+typedef struct {
+  pthread_mutex_t mutex;
+  user_cache_entry_t entries[USER_CACHE_SHARD_CAPACITY];
+  int buckets[USER_CACHE_BUCKETS];
+  int lru_head[2]; // Most recently used, per list
+  int lru_tail[2]; // Eviction candidate, per list
+  int negative_count;
+  int free_head;
+  uint64_t generation;
+} user_cache_shard_t;
+
+static user_cache_shard_t shards[USER_CACHE_SHARDS];
+static pthread_once_t shards_once = PTHREAD_ONCE_INIT;
+
+static void user_cache_init_mutexes(void) {
+  for (int i = 0; i < USER_CACHE_SHARDS; i++) {
+    pthread_mutex_init(&shards[i].mutex, NULL);
+  }
+}
+
+// FNV-1a
+static uint32_t user_cache_hash(const char *username) {
+  uint32_t hash = 2166136261u;
+  for (const unsigned char *p = (const unsigned char *) username; *p; p++) {
+    hash ^= *p;
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+static user_cache_shard_t *user_cache_shard(uint32_t hash) {
+  return &shards[hash & (USER_CACHE_SHARDS - 1)];
+}
+
+static int *user_cache_bucket(user_cache_shard_t *shard, uint32_t hash) {
+  return &shard->buckets[(hash >> 4) & (USER_CACHE_BUCKETS - 1)];
+}
+
+// Internal helpers below - caller must hold shard->mutex
+static int find_locked(user_cache_shard_t *shard, const char *username, uint32_t hash) {
+  for (int i = *user_cache_bucket(shard, hash); i >= 0; i = shard->entries[i].bucket_next) {
+    if (shard->entries[i].hash == hash && strcmp(shard->entries[i].username, username) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+static int lru_list(const user_cache_entry_t *e) {
+  return (e->record.flags & USER_FLAG_NEGATIVE) ? USER_LRU_NEGATIVE : USER_LRU_KNOWN;
+}
+
+static void lru_unlink_locked(user_cache_shard_t *shard, int i) {
+  user_cache_entry_t *e = &shard->entries[i];
+  int list              = lru_list(e);
+  if (e->lru_prev >= 0) {
+    shard->entries[e->lru_prev].lru_next = e->lru_next;
+  } else {
+    shard->lru_head[list] = e->lru_next;
+  }
+  if (e->lru_next >= 0) {
+    shard->entries[e->lru_next].lru_prev = e->lru_prev;
+  } else {
+    shard->lru_tail[list] = e->lru_prev;
+  }
+  if (list == USER_LRU_NEGATIVE) {
+    shard->negative_count--;
+  }
+}
+
+static void lru_push_front_locked(user_cache_shard_t *shard, int i) {
+  user_cache_entry_t *e = &shard->entries[i];
+  int list              = lru_list(e);
+  e->lru_prev           = -1;
+  e->lru_next           = shard->lru_head[list];
+  if (shard->lru_head[list] >= 0) {
+    shard->entries[shard->lru_head[list]].lru_prev = i;
+  } else {
+    shard->lru_tail[list] = i;
+  }
+  shard->lru_head[list] = i;
+  if (list == USER_LRU_NEGATIVE) {
+    shard->negative_count++;
+  }
+}
+
+static void remove_locked(user_cache_shard_t *shard, int i) {
+  user_cache_entry_t *e = &shard->entries[i];
+
+  int *link = user_cache_bucket(shard, e->hash);
+  while (*link != i) {
+    link = &shard->entries[*link].bucket_next;
+  }
+  *link = e->bucket_next;
+
+  lru_unlink_locked(shard, i);
+  e->bucket_next   = shard->free_head;
+  shard->free_head = i;
+}
+
+void user_cache_init(void) {
+  pthread_once(&shards_once, user_cache_init_mutexes);
+
+  for (int s = 0; s < USER_CACHE_SHARDS; s++) {
+    user_cache_shard_t *shard = &shards[s];
+    pthread_mutex_lock(&shard->mutex);
+
+    memset(shard->buckets, 0xff, sizeof(shard->buckets)); // All -1
+    for (int i = 0; i < USER_CACHE_SHARD_CAPACITY; i++) {
+      shard->entries[i].bucket_next = i + 1 < USER_CACHE_SHARD_CAPACITY ? i + 1 : -1;
+    }
+    for (int list = USER_LRU_KNOWN; list <= USER_LRU_NEGATIVE; list++) {
+      shard->lru_head[list] = -1;
+      shard->lru_tail[list] = -1;
+    }
+    shard->free_head      = 0;
+    shard->negative_count = 0;
+    shard->generation++;
+
+    pthread_mutex_unlock(&shard->mutex);
+  }
+}
+
+bool user_cache_get(const char *username, user_record_t *out) {
+  uint32_t hash             = user_cache_hash(username);
+  user_cache_shard_t *shard = user_cache_shard(hash);
+  bool hit                  = false;
+
+  pthread_mutex_lock(&shard->mutex);
+  int i = find_locked(shard, username, hash);
+  if (i >= 0) {
+    user_cache_entry_t *e = &shard->entries[i];
+    if (e->expires && time(NULL) >= e->expires) {
+      remove_locked(shard, i);
+    } else {
+      lru_unlink_locked(shard, i);
+      lru_push_front_locked(shard, i);
+      *out = e->record;
+      hit  = true;
+    }
+  }
+  pthread_mutex_unlock(&shard->mutex);
+
+  return hit;
+}
+
+uint64_t user_cache_generation(const char *username) {
+  user_cache_shard_t *shard = user_cache_shard(user_cache_hash(username));
+
+  pthread_mutex_lock(&shard->mutex);
+  uint64_t generation = shard->generation;
+  pthread_mutex_unlock(&shard->mutex);
+
+  return generation;
+}
+
+void user_cache_put(const char *username, const user_record_t *record, uint64_t generation) {
+  if (strlen(username) >= USER_NAME_MAX) {
+    return;
+  }
+
+  uint32_t hash             = user_cache_hash(username);
+  user_cache_shard_t *shard = user_cache_shard(hash);
+
+  pthread_mutex_lock(&shard->mutex);
+  if (shard->generation != generation) {
+    pthread_mutex_unlock(&shard->mutex);
+    return; // Invalidated while the caller was reading the database
+  }
+
+  bool negative = (record->flags & USER_FLAG_NEGATIVE) != 0;
+  int i         = find_locked(shard, username, hash);
+  if (i >= 0) {
+    lru_unlink_locked(shard, i);
+  }
+  // A burst of unknown names replaces older unknown names, and displaces at
+  // most a quarter of the real users; those reclaim negative slots first
+  if (negative && shard->negative_count >= USER_CACHE_NEGATIVE_MAX) {
+    remove_locked(shard, shard->lru_tail[USER_LRU_NEGATIVE]);
+  }
+  if (i < 0) {
+    if (shard->free_head < 0) {
+      int list = negative || shard->negative_count == 0 ? USER_LRU_KNOWN : USER_LRU_NEGATIVE;
+      remove_locked(shard, shard->lru_tail[list]);
+    }
+    i                = shard->free_head;
+    shard->free_head = shard->entries[i].bucket_next;
+
+    int *bucket                   = user_cache_bucket(shard, hash);
+    shard->entries[i].bucket_next = *bucket;
+    *bucket                       = i;
+  }
+
+  user_cache_entry_t *e = &shard->entries[i];
+  strcpy(e->username, username);
+  e->hash    = hash;
+  e->record  = *record;
+  e->expires = negative ? time(NULL) + USER_CACHE_NEGATIVE_TTL : 0;
+  lru_push_front_locked(shard, i);
+
+  pthread_mutex_unlock(&shard->mutex);
+}
+
+void user_cache_invalidate(const char *username) {
+  uint32_t hash             = user_cache_hash(username);
+  user_cache_shard_t *shard = user_cache_shard(hash);
+
+  pthread_mutex_lock(&shard->mutex);
+  shard->generation++;
+  int i = find_locked(shard, username, hash);
+  if (i >= 0) {
+    remove_locked(shard, i);
+  }
+  pthread_mutex_unlock(&shard->mutex);
+}
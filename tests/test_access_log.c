@@ -0,0 +1,155 @@
+#include "../include/access_log.h"
+#include "../vendor/unity/src/unity.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static char log_dir[] = "/tmp/test_access_log.XXXXXX";
+static char log_path[sizeof(log_dir) + 16];
+
+static void remove_logs(void) {
+  char path[sizeof(log_path) + 8];
+  unlink(log_path);
+  for (int i = 1; i < ACCESS_LOG_MAX_FILES; i++) {
+    snprintf(path, sizeof(path), "%s.%d", log_path, i);
+    unlink(path);
+  }
+}
+
+void setUp(void) {
+  remove_logs();
+}
+
+void tearDown(void) {
+  access_log_shutdown();
+  remove_logs();
+}
+
+static void record(const char *path, int status) {
+  access_log_entry_t entry = {.timestamp = 0, .latency_us = 250, .bytes = 11, .status = status};
+  strcpy(entry.method, "GET");
+  strcpy(entry.client_ip, "127.0.0.1");
+  snprintf(entry.path, sizeof(entry.path), "%s", path);
+  access_log_record(&entry);
+}
+
+// Contents of path, NUL terminated; the caller frees it
+static char *read_file(const char *path) {
+  FILE *file = fopen(path, "rb");
+  TEST_ASSERT_NOT_NULL(file);
+  fseek(file, 0, SEEK_END);
+  long size = ftell(file);
+  fseek(file, 0, SEEK_SET);
+
+  char *data = malloc((size_t) size + 1);
+  TEST_ASSERT_NOT_NULL(data);
+  TEST_ASSERT_EQUAL(size, (long) fread(data, 1, (size_t) size, file));
+  data[size] = '\0';
+  fclose(file);
+  return data;
+}
+
+static size_t count_lines(const char *data, const char *prefix) {
+  size_t count = 0;
+  for (const char *line = data; *line; line = strchr(line, '\n') + 1) {
+    if (strncmp(line, prefix, strlen(prefix)) == 0) {
+      count++;
+    }
+  }
+  return count;
+}
+
+void test_access_log_writes_entries(void) {
+  TEST_ASSERT_EQUAL(0, access_log_init(log_path));
+  record("/", 200);
+  record("/a b\"\n", 404);
+  access_log_shutdown(); // Flushes what is queued
+
+  char *data = read_file(log_path);
+  TEST_ASSERT_EQUAL_STRING("time=1970-01-01T00:00:00Z ip=127.0.0.1 method=GET path=\"/\" "
+                           "status=200 bytes=11 latency_us=250\n"
+                           "time=1970-01-01T00:00:00Z ip=127.0.0.1 method=GET "
+                           "path=\"/a%20b%22%0A\" status=404 bytes=11 latency_us=250\n",
+                           data);
+  free(data);
+}
+
+void test_access_log_rotates_full_file(void) {
+  char path[sizeof(log_path) + 8];
+
+  // A file already at the size limit, and an older rotation to shift along
+  FILE *file = fopen(log_path, "w");
+  TEST_ASSERT_NOT_NULL(file);
+  TEST_ASSERT_EQUAL(0, ftruncate(fileno(file), ACCESS_LOG_MAX_FILE_SIZE));
+  fclose(file);
+  snprintf(path, sizeof(path), "%s.1", log_path);
+  file = fopen(path, "w");
+  TEST_ASSERT_NOT_NULL(file);
+  fputs("older\n", file);
+  fclose(file);
+
+  TEST_ASSERT_EQUAL(0, access_log_init(log_path));
+  record("/first", 200);
+  access_log_shutdown();
+
+  // The full file took the entry, then moved to .1; its predecessor to .2
+  struct stat st;
+  TEST_ASSERT_EQUAL(0, stat(path, &st));
+  TEST_ASSERT_GREATER_THAN(ACCESS_LOG_MAX_FILE_SIZE, st.st_size);
+  TEST_ASSERT_EQUAL(0, stat(log_path, &st));
+  TEST_ASSERT_EQUAL(0, st.st_size);
+  snprintf(path, sizeof(path), "%s.2", log_path);
+  char *data = read_file(path);
+  TEST_ASSERT_EQUAL_STRING("older\n", data);
+  free(data);
+
+  // New entries go to the fresh file
+  TEST_ASSERT_EQUAL(0, access_log_init(log_path));
+  record("/second", 200);
+  access_log_shutdown();
+  data = read_file(log_path);
+  TEST_ASSERT_EQUAL(1, count_lines(data, "time="));
+  TEST_ASSERT_NOT_NULL(strstr(data, "path=\"/second\""));
+  free(data);
+}
+
+// Must run last: drop counts are kept for the life of the process
+void test_access_log_full_ring_drops_and_reports(void) {
+  const size_t recorded = ACCESS_LOG_RING_SIZE * 4;
+
+  TEST_ASSERT_EQUAL(0, access_log_init(log_path));
+  for (size_t i = 0; i < recorded; i++) {
+    record("/flood", 200); // Far faster than the writer drains
+  }
+  uint64_t dropped = access_log_dropped();
+  TEST_ASSERT_GREATER_THAN(0, dropped);
+  access_log_shutdown();
+
+  // Every entry was either written or counted, and the drop was reported
+  char *data = read_file(log_path);
+  TEST_ASSERT_EQUAL(recorded, count_lines(data, "time=") + dropped);
+  char expected[64];
+  snprintf(expected, sizeof(expected), " entries (%llu total)\n", (unsigned long long) dropped);
+  TEST_ASSERT_NOT_NULL(strstr(data, expected));
+  free(data);
+}
+
+int main(void) {
+  if (!mkdtemp(log_dir)) {
+    perror("mkdtemp");
+    return 1;
+  }
+  snprintf(log_path, sizeof(log_path), "%s/access.log", log_dir);
+
+  UNITY_BEGIN();
+
+  RUN_TEST(test_access_log_writes_entries);
+  RUN_TEST(test_access_log_rotates_full_file);
+  RUN_TEST(test_access_log_full_ring_drops_and_reports);
+
+  int failures = UNITY_END();
+  rmdir(log_dir);
+  return failures;
+}
@@ -0,0 +1,296 @@
+#include "../include/connection.h"
+#include "../include/http.h"
+#include "../include/timing.h"
+#include "../vendor/unity/src/unity.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define SLAB_CAPACITY 4
+#define CONTENDING_THREADS 8
+#define ROUNDS_PER_THREAD 20000
+
+static connection_t *slab_base; // Lowest slab slot, to index owners
+static atomic_int owners[SLAB_CAPACITY];
+static atomic_int failures; // Slots handed out twice, or creates that failed
+
+void setUp(void) {
+  TEST_ASSERT_EQUAL(0, connection_pool_init(SLAB_CAPACITY));
+}
+
+void tearDown(void) {
+  connection_pool_destroy();
+}
+
+// A connection without a socket; releasing it closes nothing
+static connection_t *create(void) {
+  return connection_create(-1, "127.0.0.1", NULL);
+}
+
+void test_connection_slab_then_overflow(void) {
+  connection_t *conns[SLAB_CAPACITY + 2];
+
+  for (int i = 0; i < SLAB_CAPACITY; i++) {
+    conns[i] = create();
+    TEST_ASSERT_NOT_NULL(conns[i]);
+    TEST_ASSERT_TRUE(conns[i]->pooled);
+  }
+  // The slab is empty, so the heap takes over
+  conns[SLAB_CAPACITY]     = create();
+  conns[SLAB_CAPACITY + 1] = create();
+  TEST_ASSERT_FALSE(conns[SLAB_CAPACITY]->pooled);
+
+  connection_pool_stats_t stats = connection_pool_stats();
+  TEST_ASSERT_EQUAL(SLAB_CAPACITY, stats.capacity);
+  TEST_ASSERT_EQUAL(SLAB_CAPACITY + 2, stats.in_use);
+  TEST_ASSERT_GREATER_OR_EQUAL(2, stats.overflow);
+
+  // A released slot is handed out again before the heap
+  connection_t *released = conns[3];
+  connection_release(released);
+  conns[3] = create();
+  TEST_ASSERT_EQUAL_PTR(released, conns[3]);
+
+  // Still open, so destroying the pool must leave the slab mapped
+  connection_pool_destroy();
+  TEST_ASSERT_EQUAL(SLAB_CAPACITY, connection_pool_stats().capacity);
+
+  for (int i = 0; i < SLAB_CAPACITY + 2; i++) {
+    connection_release(conns[i]);
+  }
+  TEST_ASSERT_EQUAL(0, connection_pool_stats().in_use);
+}
+
+void test_connection_reuse_clears_state(void) {
+  connection_t *conn = create();
+  conn->route        = 3;
+  conn->log.status   = 500;
+  TEST_ASSERT_NOT_NULL(arena_alloc(&conn->arena, 100));
+  connection_release(conn);
+
+  // LIFO: the same slot comes back, with nothing left from its last use
+  connection_t *again = create();
+  TEST_ASSERT_EQUAL_PTR(conn, again);
+  TEST_ASSERT_EQUAL(-1, again->route);
+  TEST_ASSERT_EQUAL(0, again->log.status);
+  TEST_ASSERT_EQUAL(1, atomic_load(&again->refcount));
+  TEST_ASSERT_EQUAL_PTR(again->arena_buffer, again->arena.cursor);
+  connection_release(again);
+}
+
+static void *contend(void *arg) {
+  int id = (int) (intptr_t) arg;
+
+  for (int round = 0; round < ROUNDS_PER_THREAD; round++) {
+    connection_t *conn = create();
+    if (!conn) {
+      atomic_fetch_add(&failures, 1);
+      continue;
+    }
+    if (conn->pooled) {
+      // Nobody else may hold this slot until it is released
+      int expected      = 0;
+      atomic_int *owner = &owners[conn - slab_base];
+      if (!atomic_compare_exchange_strong(owner, &expected, id)) {
+        atomic_fetch_add(&failures, 1);
+      }
+      conn->route = id;
+      sched_yield(); // Hold the slot long enough for a second holder to show
+      if (conn->route != id || atomic_load(owner) != id) {
+        atomic_fetch_add(&failures, 1);
+      }
+      atomic_store(owner, 0);
+    }
+    connection_release(conn);
+  }
+  return NULL;
+}
+
+void test_connection_slab_under_contention(void) {
+  // Find the bottom of the slab
+  connection_t *conns[SLAB_CAPACITY];
+  slab_base = NULL;
+  for (int i = 0; i < SLAB_CAPACITY; i++) {
+    conns[i] = create();
+    if (!slab_base || conns[i] < slab_base) {
+      slab_base = conns[i];
+    }
+  }
+  for (int i = 0; i < SLAB_CAPACITY; i++) {
+    connection_release(conns[i]);
+  }
+
+  // More threads than slots: pops and pushes race, and the slab runs dry
+  pthread_t threads[CONTENDING_THREADS];
+  atomic_store(&failures, 0);
+  for (int i = 0; i < CONTENDING_THREADS; i++) {
+    pthread_create(&threads[i], NULL, contend, (void *) (intptr_t) (i + 1));
+  }
+  for (int i = 0; i < CONTENDING_THREADS; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  TEST_ASSERT_EQUAL(0, atomic_load(&failures));
+  TEST_ASSERT_EQUAL(0, connection_pool_stats().in_use);
+
+  // Every slot made it back onto the free stack exactly once
+  for (int i = 0; i < SLAB_CAPACITY; i++) {
+    conns[i] = create();
+    TEST_ASSERT_TRUE(conns[i]->pooled);
+    for (int j = 0; j < i; j++) {
+      TEST_ASSERT_TRUE(conns[i] != conns[j]);
+    }
+  }
+  connection_t *extra = create();
+  TEST_ASSERT_FALSE(extra->pooled);
+  connection_release(extra);
+  for (int i = 0; i < SLAB_CAPACITY; i++) {
+    connection_release(conns[i]);
+  }
+}
+
+// A plain connection on one end of a non-blocking socketpair; the test
+// plays the client on the other end
+static connection_t *create_socket(int *client_fd) {
+  int fds[2];
+  TEST_ASSERT_EQUAL(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+  fcntl(fds[0], F_SETFL, O_NONBLOCK);
+  *client_fd = fds[1];
+  return connection_create(fds[0], "127.0.0.1", NULL);
+}
+
+// Pretend the connection has existed for ago_ms, and its body for body_ms
+static void backdate(connection_t *conn, unsigned ago_ms, unsigned body_ms) {
+  uint64_t now        = timing_now_ns();
+  conn->accepted_ns   = now - MS_TO_NS(ago_ms);
+  conn->body_start_ns = now - MS_TO_NS(body_ms);
+}
+
+// Read once, returning how long it took
+static uint64_t timed_read(connection_t *conn, ssize_t *result) {
+  char buffer[64];
+  uint64_t start = timing_now_ns();
+  errno          = 0;
+  *result        = connection_read(conn, buffer, sizeof(buffer));
+  return timing_now_ns() - start;
+}
+
+void test_connection_read_waits_for_data(void) {
+  int client;
+  connection_t *conn = create_socket(&client);
+  char buffer[16];
+
+  TEST_ASSERT_EQUAL(5, write(client, "hello", 5));
+  TEST_ASSERT_EQUAL(5, connection_read(conn, buffer, sizeof(buffer)));
+  TEST_ASSERT_EQUAL(5, conn->body_received);
+  TEST_ASSERT_GREATER_THAN(0, conn->body_start_ns);
+
+  close(client);
+  TEST_ASSERT_EQUAL(0, connection_read(conn, buffer, sizeof(buffer)));
+  connection_release(conn);
+}
+
+void test_connection_read_request_deadline(void) {
+  int client;
+  ssize_t result;
+  connection_t *conn = create_socket(&client);
+
+  // 100 ms left of the whole request
+  backdate(conn, CONNECTION_REQUEST_TIMEOUT_MS - 100, 0);
+  uint64_t waited = timed_read(conn, &result);
+  TEST_ASSERT_EQUAL(-1, result);
+  TEST_ASSERT_EQUAL(ETIMEDOUT, errno);
+  TEST_ASSERT_GREATER_OR_EQUAL(MS_TO_NS(90), waited);
+  TEST_ASSERT_LESS_THAN(MS_TO_NS(1000), waited);
+
+  close(client);
+  connection_release(conn);
+}
+
+void test_connection_read_body_deadline(void) {
+  int client;
+  ssize_t result;
+  connection_t *conn = create_socket(&client);
+
+  // A body going well above the minimum rate still has to end in time
+  backdate(conn, CONNECTION_BODY_TIMEOUT_MS, CONNECTION_BODY_TIMEOUT_MS - 100);
+  conn->body_received = (size_t) CONNECTION_MIN_BODY_RATE * CONNECTION_BODY_TIMEOUT_MS;
+  uint64_t waited     = timed_read(conn, &result);
+  TEST_ASSERT_EQUAL(-1, result);
+  TEST_ASSERT_EQUAL(ETIMEDOUT, errno);
+  TEST_ASSERT_GREATER_OR_EQUAL(MS_TO_NS(90), waited);
+  TEST_ASSERT_LESS_THAN(MS_TO_NS(1000), waited);
+
+  close(client);
+  connection_release(conn);
+}
+
+void test_connection_read_minimum_rate(void) {
+  int client;
+  ssize_t result;
+  char buffer[16];
+  connection_t *conn = create_socket(&client);
+
+  // Within the grace period, nothing needs to have arrived yet
+  backdate(conn, 1000, 1000);
+  TEST_ASSERT_EQUAL(1, write(client, "x", 1));
+  TEST_ASSERT_EQUAL(1, connection_read(conn, buffer, sizeof(buffer)));
+
+  // 10 s into the body with 4 KB read: well under CONNECTION_MIN_BODY_RATE,
+  // so a client with nothing more to send is cut off at once
+  backdate(conn, 10000, 10000);
+  conn->body_received = 4096;
+  uint64_t waited     = timed_read(conn, &result);
+  TEST_ASSERT_EQUAL(-1, result);
+  TEST_ASSERT_EQUAL(ETIMEDOUT, errno);
+  TEST_ASSERT_LESS_THAN(MS_TO_NS(100), waited);
+
+  // Data already waiting is still taken, however late
+  TEST_ASSERT_EQUAL(2, write(client, "ab", 2));
+  TEST_ASSERT_EQUAL(2, connection_read(conn, buffer, sizeof(buffer)));
+
+  // Keeping up with the rate moves the deadline out
+  conn->body_received = 10 * CONNECTION_MIN_BODY_RATE;
+  backdate(conn, 10000, 10000 - 100);
+  waited = timed_read(conn, &result);
+  TEST_ASSERT_EQUAL(ETIMEDOUT, errno);
+  TEST_ASSERT_GREATER_OR_EQUAL(MS_TO_NS(CONNECTION_RATE_GRACE_MS), waited);
+
+  close(client);
+  connection_release(conn);
+}
+
+void test_connection_body_timeout_reaches_parser(void) {
+  int client;
+  connection_t *conn = create_socket(&client);
+  const char *head   = "POST /login HTTP/1.1\r\nContent-Length: 100\r\n\r\npartial";
+  http_request_t req;
+
+  TEST_ASSERT_EQUAL(0, http_parse_head(head, strlen(head), &req, &conn->arena));
+  http_set_body_source(&req, connection_body_source, conn);
+  backdate(conn, CONNECTION_REQUEST_TIMEOUT_MS, 0);
+  TEST_ASSERT_EQUAL(HTTP_BODY_TIMEOUT, http_read_body(&req, 1024));
+
+  close(client);
+  connection_release(conn);
+}
+
+int main(void) {
+  UNITY_BEGIN();
+
+  RUN_TEST(test_connection_slab_then_overflow);
+  RUN_TEST(test_connection_reuse_clears_state);
+  RUN_TEST(test_connection_slab_under_contention);
+  RUN_TEST(test_connection_read_waits_for_data);
+  RUN_TEST(test_connection_read_request_deadline);
+  RUN_TEST(test_connection_read_body_deadline);
+  RUN_TEST(test_connection_read_minimum_rate);
+  RUN_TEST(test_connection_body_timeout_reaches_parser);
+
+  return UNITY_END();
+}
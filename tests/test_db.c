@@ -1,6 +1,11 @@
 #include "../vendor/unity/src/unity.h"
 #include "../include/db.h"
+#include "../include/password.h"
+#include "../include/user_cache.h"
+#include <pthread.h>
 #include <stdio.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #define TEST_DB "test.db"
@@ -75,6 +80,210 @@ void test_db_multiple_users(void) {
     TEST_ASSERT_EQUAL(-1, db_verify_user("user1", "pass2"));
 }
 
+void test_db_uses_wal_journal(void) {
+    sqlite3_stmt *stmt;
+    sqlite3_prepare_v2(db_get_connection(), "PRAGMA journal_mode;", -1, &stmt, NULL);
+    TEST_ASSERT_EQUAL(SQLITE_ROW, sqlite3_step(stmt));
+    TEST_ASSERT_EQUAL_STRING("wal", (const char *)sqlite3_column_text(stmt, 0));
+    sqlite3_finalize(stmt);
+}
+
+void test_db_reuses_pooled_connections(void) {
+    // More operations than pooled connections: each must be checked back in
+    for (int i = 0; i < DB_POOL_SIZE * 2; i++) {
+        TEST_ASSERT_EQUAL(-1, db_verify_user("nobody", "pass"));
+    }
+    TEST_ASSERT_EQUAL(0, db_create_user("john", "secret123"));
+    TEST_ASSERT_EQUAL(0, db_verify_user("john", "secret123"));
+}
+
+static void *register_users(void *arg) {
+    int id = *(int *)arg;
+    char username[32];
+    for (int i = 0; i < 3; i++) {
+        snprintf(username, sizeof(username), "user_%d_%d", id, i);
+        if (db_create_user(username, "pass") != 0) {
+            return (void *)1;
+        }
+    }
+    // Every thread races for the same name; exactly one may win
+    return (void *)(long)(db_create_user("shared", "pass") == 0 ? 2 : 0);
+}
+
+void test_db_concurrent_registrations_group_commit(void) {
+    pthread_t threads[4];
+    int ids[4];
+    for (int i = 0; i < 4; i++) {
+        ids[i] = i;
+        pthread_create(&threads[i], NULL, register_users, &ids[i]);
+    }
+
+    int winners = 0;
+    for (int i = 0; i < 4; i++) {
+        void *result;
+        pthread_join(threads[i], &result);
+        TEST_ASSERT_NOT_EQUAL(1, (long)result);
+        winners += (long)result == 2;
+    }
+    TEST_ASSERT_EQUAL(1, winners);
+
+    TEST_ASSERT_EQUAL(0, db_verify_user("user_3_2", "pass"));
+    TEST_ASSERT_EQUAL(0, db_verify_user("shared", "pass"));
+}
+
+void test_db_create_user_invalidates_negative_cache(void) {
+    // First lookup caches "john" as unknown
+    TEST_ASSERT_EQUAL(-1, db_verify_user("john", "secret123"));
+
+    TEST_ASSERT_EQUAL(0, db_create_user("john", "secret123"));
+    TEST_ASSERT_EQUAL(0, db_verify_user("john", "secret123"));
+}
+
+void test_db_repeat_login_served_from_cache(void) {
+    db_create_user("john", "secret123");
+    TEST_ASSERT_EQUAL(0, db_verify_user("john", "secret123"));
+
+    // Changes made behind the server's back are not seen until invalidated
+    sqlite3_exec(db_get_connection(), "DELETE FROM users WHERE username = 'john';", NULL, NULL,
+                 NULL);
+    TEST_ASSERT_EQUAL(0, db_verify_user("john", "secret123"));
+    TEST_ASSERT_EQUAL(-1, db_verify_user("john", "wrongpass"));
+}
+
+static double verify_ms(const char *username, const char *password) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    TEST_ASSERT_EQUAL(-1, db_verify_user(username, password));
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6;
+}
+
+void test_db_unknown_user_costs_a_hash(void) {
+    db_create_user("john", "secret123");
+    double wrong_password = verify_ms("john", "wrongpass");
+
+    // Both the database miss and the cached negative entry pay for a hash,
+    // so timing does not tell which usernames exist
+    double unknown = verify_ms("nobody", "wrongpass");
+    double cached  = verify_ms("nobody", "wrongpass");
+    TEST_ASSERT_TRUE(unknown > wrong_password / 2);
+    TEST_ASSERT_TRUE(cached > wrong_password / 2);
+}
+
+typedef struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    bool done;
+    int result;
+} async_result_t;
+
+static void async_complete(int result, void *user_data) {
+    async_result_t *r = (async_result_t *)user_data;
+    pthread_mutex_lock(&r->mutex);
+    r->result = result;
+    r->done = true;
+    pthread_cond_signal(&r->cond);
+    pthread_mutex_unlock(&r->mutex);
+}
+
+static int async_wait(async_result_t *r) {
+    pthread_mutex_lock(&r->mutex);
+    while (!r->done) {
+        pthread_cond_wait(&r->cond, &r->mutex);
+    }
+    r->done = false;
+    pthread_mutex_unlock(&r->mutex);
+    return r->result;
+}
+
+void test_db_async_create_and_verify(void) {
+    async_result_t r = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, false, 0};
+    TEST_ASSERT_EQUAL(0, db_async_init(2, 8));
+
+    TEST_ASSERT_TRUE(db_create_user_async("john", "secret123", async_complete, &r));
+    TEST_ASSERT_EQUAL(0, async_wait(&r));
+
+    TEST_ASSERT_TRUE(db_verify_user_async("john", "secret123", async_complete, &r));
+    TEST_ASSERT_EQUAL(0, async_wait(&r));
+
+    TEST_ASSERT_TRUE(db_verify_user_async("john", "wrongpass", async_complete, &r));
+    TEST_ASSERT_EQUAL(-1, async_wait(&r));
+
+    db_async_shutdown();
+}
+
+static void read_stored_password(const char *username, char *out, size_t out_size) {
+    sqlite3_stmt *stmt;
+    sqlite3_prepare_v2(db_get_connection(), "SELECT password FROM users WHERE username = ?;", -1,
+                       &stmt, NULL);
+    sqlite3_bind_text(stmt, 1, username, -1, SQLITE_STATIC);
+    TEST_ASSERT_EQUAL(SQLITE_ROW, sqlite3_step(stmt));
+    snprintf(out, out_size, "%s", (const char *)sqlite3_column_text(stmt, 0));
+    sqlite3_finalize(stmt);
+}
+
+void test_db_password_stored_hashed(void) {
+    db_create_user("john", "secret123");
+
+    char stored[PASSWORD_HASH_MAX];
+    read_stored_password("john", stored, sizeof(stored));
+    TEST_ASSERT_EQUAL(0, strncmp(stored, "$scrypt$v=", 10));
+    TEST_ASSERT_NULL(strstr(stored, "secret123"));
+    TEST_ASSERT_FALSE(password_needs_rehash(stored));
+}
+
+void test_db_legacy_password_rehashed_on_login(void) {
+    sqlite3_exec(db_get_connection(),
+                 "INSERT INTO users (username, password) VALUES ('legacy', 'plainpass');", NULL,
+                 NULL, NULL);
+
+    TEST_ASSERT_EQUAL(-1, db_verify_user("legacy", "wrongpass"));
+    TEST_ASSERT_EQUAL(0, db_verify_user("legacy", "plainpass"));
+
+    char stored[PASSWORD_HASH_MAX];
+    read_stored_password("legacy", stored, sizeof(stored));
+    TEST_ASSERT_FALSE(password_needs_rehash(stored));
+    TEST_ASSERT_EQUAL(0, db_verify_user("legacy", "plainpass"));
+}
+
+void test_db_verify_user_on_executor(void) {
+    TEST_ASSERT_EQUAL(0, password_executor_init(1, 4));
+
+    TEST_ASSERT_EQUAL(0, db_create_user("john", "secret123"));
+    TEST_ASSERT_EQUAL(0, db_verify_user("john", "secret123"));
+    TEST_ASSERT_EQUAL(-1, db_verify_user("john", "wrongpass"));
+
+    password_executor_shutdown();
+}
+
+void test_db_unknown_names_keep_users_cached(void) {
+    user_record_t record = {0};
+    char name[32];
+
+    // A few users per shard, then a flood of names that do not exist
+    user_cache_init();
+    for (int i = 0; i < USER_CACHE_SHARDS * 4; i++) {
+        snprintf(name, sizeof(name), "user%d", i);
+        record.id = i + 1;
+        user_cache_put(name, &record, user_cache_generation(name));
+    }
+    record.flags = USER_FLAG_NEGATIVE;
+    for (int i = 0; i < USER_CACHE_SHARDS * USER_CACHE_SHARD_CAPACITY * 4; i++) {
+        snprintf(name, sizeof(name), "ghost%d", i);
+        user_cache_put(name, &record, user_cache_generation(name));
+    }
+
+    // The newest unknown name is still cached, and every user survived
+    TEST_ASSERT_TRUE(user_cache_get(name, &record));
+    TEST_ASSERT_TRUE(record.flags & USER_FLAG_NEGATIVE);
+    for (int i = 0; i < USER_CACHE_SHARDS * 4; i++) {
+        snprintf(name, sizeof(name), "user%d", i);
+        TEST_ASSERT_TRUE(user_cache_get(name, &record));
+        TEST_ASSERT_EQUAL(i + 1, record.id);
+        TEST_ASSERT_EQUAL(0, record.flags);
+    }
+}
+
 int main(void) {
     UNITY_BEGIN();
 
@@ -85,6 +294,17 @@ int main(void) {
     RUN_TEST(test_db_verify_user_wrong_password);
     RUN_TEST(test_db_verify_user_nonexistent);
     RUN_TEST(test_db_multiple_users);
+    RUN_TEST(test_db_uses_wal_journal);
+    RUN_TEST(test_db_concurrent_registrations_group_commit);
+    RUN_TEST(test_db_reuses_pooled_connections);
+    RUN_TEST(test_db_create_user_invalidates_negative_cache);
+    RUN_TEST(test_db_repeat_login_served_from_cache);
+    RUN_TEST(test_db_unknown_user_costs_a_hash);
+    RUN_TEST(test_db_async_create_and_verify);
+    RUN_TEST(test_db_password_stored_hashed);
+    RUN_TEST(test_db_legacy_password_rehashed_on_login);
+    RUN_TEST(test_db_verify_user_on_executor);
+    RUN_TEST(test_db_unknown_names_keep_users_cached);
 
     return UNITY_END();
 }
@@ -0,0 +1,158 @@
+#include "../include/event_loop.h"
+#include "../include/timing.h"
+#include "../vendor/unity/src/unity.h"
+#include <stdatomic.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define WAIT_LIMIT_MS 2000 // Longest a test waits for the loop
+
+static event_loop_t *loop;
+static atomic_int fired_order[4]; // Timer ids in firing order
+static atomic_int fired_count;
+static atomic_int watch_events;
+static atomic_int rearm_count;    // Handler runs that watched their fd again
+static atomic_int rearm_failures;
+
+typedef struct {
+  event_timer_t timer;
+  int id;
+} test_timer_t;
+
+void setUp(void) {
+  atomic_store(&fired_count, 0);
+  atomic_store(&watch_events, 0);
+  atomic_store(&rearm_count, 0);
+  atomic_store(&rearm_failures, 0);
+  loop = event_loop_create();
+  TEST_ASSERT_NOT_NULL(loop);
+  TEST_ASSERT_EQUAL(0, event_loop_start(loop));
+}
+
+void tearDown(void) {
+  event_loop_destroy(loop);
+}
+
+static void on_timer(event_timer_t *timer) {
+  test_timer_t *owner = (test_timer_t *) timer;
+  int index           = atomic_fetch_add(&fired_count, 1);
+  if (index < 4) {
+    atomic_store(&fired_order[index], owner->id);
+  }
+}
+
+static void on_readable(event_watch_t *watch, uint32_t events) {
+  (void) watch;
+  atomic_fetch_or(&watch_events, (int) events);
+}
+
+// Leaves the data unread, so every re-arm fires again at once
+static void on_readable_rearm(event_watch_t *watch, uint32_t events) {
+  (void) events;
+  if (atomic_fetch_add(&rearm_count, 1) < 3 && event_loop_watch(loop, watch, EPOLLIN) != 0) {
+    atomic_fetch_add(&rearm_failures, 1);
+  }
+}
+
+// Wait until counter reaches count, or give up after WAIT_LIMIT_MS
+static void wait_for(atomic_int *counter, int count) {
+  for (int ms = 0; ms < WAIT_LIMIT_MS && atomic_load(counter) < count; ms++) {
+    usleep(1000);
+  }
+}
+
+void test_event_loop_timers_fire_in_deadline_order(void) {
+  uint64_t now           = timing_now_ns();
+  test_timer_t timers[3] = {{{0, on_timer, 0}, 1}, {{0, on_timer, 0}, 2}, {{0, on_timer, 0}, 3}};
+
+  // Armed out of order, from another thread than the loop's
+  TEST_ASSERT_EQUAL(0, event_loop_timer_set(loop, &timers[0].timer, now + MS_TO_NS(60)));
+  TEST_ASSERT_EQUAL(0, event_loop_timer_set(loop, &timers[1].timer, now + MS_TO_NS(20)));
+  TEST_ASSERT_EQUAL(0, event_loop_timer_set(loop, &timers[2].timer, now + MS_TO_NS(40)));
+
+  wait_for(&fired_count, 3);
+  TEST_ASSERT_EQUAL(3, atomic_load(&fired_count));
+  TEST_ASSERT_EQUAL(2, atomic_load(&fired_order[0]));
+  TEST_ASSERT_EQUAL(3, atomic_load(&fired_order[1]));
+  TEST_ASSERT_EQUAL(1, atomic_load(&fired_order[2]));
+  TEST_ASSERT_GREATER_OR_EQUAL(now + MS_TO_NS(60), timing_now_ns());
+
+  // Fired timers are disarmed
+  TEST_ASSERT_EQUAL(0, timers[0].timer.slot);
+  TEST_ASSERT_EQUAL(0, timers[1].timer.slot);
+}
+
+void test_event_loop_timer_move_and_cancel(void) {
+  uint64_t now           = timing_now_ns();
+  test_timer_t timers[2] = {{{0, on_timer, 0}, 1}, {{0, on_timer, 0}, 2}};
+
+  // A long deadline brought forward fires at the new time
+  TEST_ASSERT_EQUAL(0, event_loop_timer_set(loop, &timers[0].timer, now + MS_TO_NS(60000)));
+  TEST_ASSERT_EQUAL(0, event_loop_timer_set(loop, &timers[1].timer, now + MS_TO_NS(30)));
+  TEST_ASSERT_EQUAL(0, event_loop_timer_set(loop, &timers[0].timer, now + MS_TO_NS(10)));
+  event_loop_timer_cancel(loop, &timers[1].timer);
+  event_loop_timer_cancel(loop, &timers[1].timer); // Already disarmed: no-op
+
+  wait_for(&fired_count, 1);
+  usleep(100000); // Long past the cancelled deadline
+  TEST_ASSERT_EQUAL(1, atomic_load(&fired_count));
+  TEST_ASSERT_EQUAL(1, atomic_load(&fired_order[0]));
+}
+
+void test_event_loop_deadline_and_readiness(void) {
+  int fds[2];
+  TEST_ASSERT_EQUAL(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+  event_watch_t watch = {fds[0], on_readable, false};
+  test_timer_t idle   = {{0, on_timer, 0}, 1};
+
+  // A silent client: only the deadline fires
+  TEST_ASSERT_EQUAL(0, event_loop_watch(loop, &watch, EPOLLIN));
+  TEST_ASSERT_EQUAL(0, event_loop_timer_set(loop, &idle.timer, timing_now_ns() + MS_TO_NS(20)));
+  wait_for(&fired_count, 1);
+  TEST_ASSERT_EQUAL(1, atomic_load(&fired_count));
+  TEST_ASSERT_EQUAL(0, atomic_load(&watch_events));
+
+  // Data before the deadline: the watch fires and the deadline can be dropped
+  TEST_ASSERT_EQUAL(0, event_loop_timer_set(loop, &idle.timer, timing_now_ns() + MS_TO_NS(200)));
+  TEST_ASSERT_EQUAL(1, write(fds[1], "x", 1));
+  wait_for(&watch_events, 1);
+  TEST_ASSERT_TRUE(atomic_load(&watch_events) & EPOLLIN);
+  event_loop_timer_cancel(loop, &idle.timer);
+  usleep(300000);
+  TEST_ASSERT_EQUAL(1, atomic_load(&fired_count));
+
+  event_loop_unwatch(loop, &watch);
+  close(fds[0]);
+  close(fds[1]);
+}
+
+void test_event_loop_watch_with_data_pending(void) {
+  int fds[2];
+  TEST_ASSERT_EQUAL(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+  event_watch_t watch = {fds[0], on_readable_rearm, false};
+
+  // The handler may run, and re-arm, before event_loop_watch returns here
+  TEST_ASSERT_EQUAL(1, write(fds[1], "x", 1));
+  TEST_ASSERT_EQUAL(0, event_loop_watch(loop, &watch, EPOLLIN));
+  wait_for(&rearm_count, 4);
+  TEST_ASSERT_EQUAL(4, atomic_load(&rearm_count));
+  TEST_ASSERT_EQUAL(0, atomic_load(&rearm_failures));
+  TEST_ASSERT_TRUE(watch.registered);
+
+  event_loop_unwatch(loop, &watch);
+  TEST_ASSERT_FALSE(watch.registered);
+  close(fds[0]);
+  close(fds[1]);
+}
+
+int main(void) {
+  UNITY_BEGIN();
+
+  RUN_TEST(test_event_loop_timers_fire_in_deadline_order);
+  RUN_TEST(test_event_loop_timer_move_and_cancel);
+  RUN_TEST(test_event_loop_deadline_and_readiness);
+  RUN_TEST(test_event_loop_watch_with_data_pending);
+
+  return UNITY_END();
+}
@@ -1,5 +1,6 @@
 #include "../vendor/unity/src/unity.h"
 #include "../include/http.h"
+#include <stdio.h>
 #include <string.h>
 
 void setUp(void) {
@@ -37,6 +38,7 @@ void test_http_parse_post_request(void) {
         "POST /login HTTP/1.1\r\n"
         "Host: localhost\r\n"
         "Content-Type: application/x-www-form-urlencoded\r\n"
+        "Content-Length: 35\r\n"
         "\r\n"
         "username=testuser&password=testpass";
 
@@ -70,6 +72,7 @@ void test_http_parse_post_data(void) {
     // Test missing key
     char missing[256];
     TEST_ASSERT_EQUAL(-1, http_parse_post_data(body, "nonexistent", missing, sizeof(missing)));
+    TEST_ASSERT_EQUAL(-1, http_parse_post_data(body, "name", missing, sizeof(missing)));
 }
 
 void test_http_parse_post_data_url_encoded(void) {
@@ -104,6 +107,322 @@ void test_http_get_header_case_insensitive(void) {
     http_free_request(&req);
 }
 
+void test_http_parse_request_arena(void) {
+    const char *request =
+        "POST /login HTTP/1.1\r\n"
+        "Host: localhost\r\n"
+        "Content-Length: 30\r\n"
+        "\r\n"
+        "username=test&password=pass123";
+
+    _Alignas(ARENA_ALIGNMENT) char buffer[256];
+    arena_t arena;
+    arena_init(&arena, buffer, sizeof(buffer));
+
+    http_request_t req;
+    TEST_ASSERT_EQUAL(0, http_parse_request_arena(request, &req, &arena));
+    TEST_ASSERT_EQUAL_STRING("username=test&password=pass123", req.body);
+    TEST_ASSERT_TRUE(req.body >= buffer && req.body < buffer + sizeof(buffer));
+
+    // Handler scratch space comes from the same arena
+    char *scratch = (char *) http_request_alloc(&req, 64);
+    TEST_ASSERT_TRUE(scratch >= buffer && scratch + 64 <= buffer + sizeof(buffer));
+    TEST_ASSERT_EQUAL(0, (unsigned long) scratch % ARENA_ALIGNMENT);
+
+    http_free_request(&req);
+    arena_reset(&arena);
+}
+
+void test_arena_overflow_and_reset(void) {
+    _Alignas(ARENA_ALIGNMENT) char buffer[64];
+    arena_t arena;
+    arena_init(&arena, buffer, sizeof(buffer));
+
+    char *first = (char *) arena_alloc(&arena, 48);
+    TEST_ASSERT_EQUAL_PTR(buffer, first);
+
+    // Does not fit in what is left: spills into a heap block
+    char *spill = (char *) arena_alloc(&arena, 32);
+    TEST_ASSERT_NOT_NULL(spill);
+    TEST_ASSERT_TRUE(spill < buffer || spill >= buffer + sizeof(buffer));
+    memset(spill, 'x', 32);
+
+    char *large = (char *) arena_alloc(&arena, ARENA_BLOCK_SIZE * 2);
+    TEST_ASSERT_NOT_NULL(large);
+    memset(large, 'y', ARENA_BLOCK_SIZE * 2);
+
+    // Reset frees the heap blocks and starts over in the buffer
+    arena_reset(&arena);
+    TEST_ASSERT_EQUAL_PTR(buffer, arena_alloc(&arena, 16));
+    arena_reset(&arena);
+}
+
+void test_http_request_alloc_without_arena(void) {
+    http_request_t req;
+    TEST_ASSERT_EQUAL(0, http_parse_request("GET / HTTP/1.1\r\n\r\n", &req));
+    TEST_ASSERT_NULL(http_request_alloc(&req, 16));
+    http_free_request(&req);
+}
+
+// Hands out a fixed string a few bytes at a time, like a slow socket
+typedef struct {
+    const char *data;
+    size_t offset;
+    size_t step;
+} test_source_t;
+
+static ssize_t test_source_read(void *ctx, void *buf, size_t size) {
+    test_source_t *source = (test_source_t *) ctx;
+    size_t left = strlen(source->data) - source->offset;
+    size_t n = size < source->step ? size : source->step;
+    if (n > left) n = left;
+    memcpy(buf, source->data + source->offset, n);
+    source->offset += n;
+    return (ssize_t) n;
+}
+
+void test_http_body_content_length(void) {
+    // Bytes past Content-Length belong to something else
+    const char *request =
+        "POST /upload HTTP/1.1\r\n"
+        "Content-Length: 5\r\n"
+        "\r\n"
+        "helloEXTRA";
+
+    http_request_t req;
+    TEST_ASSERT_EQUAL(0, http_parse_request(request, &req));
+    TEST_ASSERT_EQUAL(5, req.body_length);
+    TEST_ASSERT_EQUAL_STRING("hello", req.body);
+    http_free_request(&req);
+
+    // A body shorter than Content-Length is an error
+    const char *truncated =
+        "POST /upload HTTP/1.1\r\n"
+        "Content-Length: 50\r\n"
+        "\r\n"
+        "hello";
+    TEST_ASSERT_EQUAL(-1, http_parse_request(truncated, &req));
+    http_free_request(&req);
+}
+
+void test_http_body_streamed_chunked(void) {
+    const char *head =
+        "POST /upload HTTP/1.1\r\n"
+        "Transfer-Encoding: chunked\r\n"
+        "\r\n"
+        "5\r\nhel";
+    test_source_t source = {"lo\r\n6;ext=1\r\n world\r\n0\r\nTrailer: x\r\n\r\n", 0, 3};
+
+    http_request_t req;
+    TEST_ASSERT_EQUAL(0, http_parse_head(head, strlen(head), &req, NULL));
+    http_set_body_source(&req, test_source_read, &source);
+
+    char body[32];
+    size_t length = 0;
+    ssize_t n;
+    while ((n = http_body_read(&req, body + length, sizeof(body) - 1 - length)) > 0) {
+        length += (size_t) n;
+    }
+    TEST_ASSERT_EQUAL(0, n);
+    body[length] = '\0';
+    TEST_ASSERT_EQUAL_STRING("hello world", body);
+
+    http_free_request(&req);
+}
+
+void test_http_read_body_limits(void) {
+    const char *head =
+        "POST /upload HTTP/1.1\r\n"
+        "Transfer-Encoding: chunked\r\n"
+        "\r\n";
+    test_source_t source = {"a\r\n0123456789\r\n0\r\n\r\n", 0, 4};
+
+    http_request_t req;
+    TEST_ASSERT_EQUAL(0, http_parse_head(head, strlen(head), &req, NULL));
+    http_set_body_source(&req, test_source_read, &source);
+    TEST_ASSERT_EQUAL(HTTP_BODY_TOO_LARGE, http_read_body(&req, 8));
+    TEST_ASSERT_NULL(req.body);
+    http_free_request(&req);
+
+    // Declared lengths are checked before reading anything
+    const char *large =
+        "POST /upload HTTP/1.1\r\n"
+        "Content-Length: 100000\r\n"
+        "\r\n";
+    TEST_ASSERT_EQUAL(0, http_parse_head(large, strlen(large), &req, NULL));
+    TEST_ASSERT_EQUAL(HTTP_BODY_TOO_LARGE, http_read_body(&req, 1024));
+    http_free_request(&req);
+
+    // Binary bodies keep their NULs
+    const char *binary = "POST / HTTP/1.1\r\nContent-Length: 3\r\n\r\na\0b";
+    TEST_ASSERT_EQUAL(0, http_parse_head(binary, strlen(binary) + 2, &req, NULL));
+    TEST_ASSERT_EQUAL(0, http_read_body(&req, 1024));
+    TEST_ASSERT_EQUAL(3, req.body_length);
+    TEST_ASSERT_EQUAL(0, memcmp(req.body, "a\0b", 3));
+    http_free_request(&req);
+}
+
+void test_http_body_framing_rejected(void) {
+    http_request_t req;
+
+    // Both framings at once is a request smuggling vector
+    TEST_ASSERT_EQUAL(-1, http_parse_request("POST / HTTP/1.1\r\n"
+                                             "Content-Length: 4\r\n"
+                                             "Transfer-Encoding: chunked\r\n"
+                                             "\r\n"
+                                             "0\r\n\r\n", &req));
+    TEST_ASSERT_EQUAL(-1, http_parse_request("POST / HTTP/1.1\r\n"
+                                             "Content-Length: -1\r\n"
+                                             "\r\n", &req));
+    TEST_ASSERT_EQUAL(-1, http_parse_request("POST / HTTP/1.1\r\n"
+                                             "Transfer-Encoding: chunked\r\n"
+                                             "\r\n"
+                                             "zz\r\n", &req));
+    http_free_request(&req);
+}
+
+void test_http_form_parse(void) {
+    char body[] = "xusername=evil&username=john+doe&password=p%40ss%3D1&empty=&flag&&"
+                  "long=0123456789abcdef0123456789abcdef%21&username=second";
+    http_form_t form;
+    size_t length;
+
+    TEST_ASSERT_EQUAL(0, http_form_parse(&form, body, strlen(body)));
+    TEST_ASSERT_EQUAL(7, form.count);
+
+    // Names match exactly, not as substrings, and the first value wins
+    TEST_ASSERT_EQUAL_STRING("john doe", http_form_get(&form, "username", NULL));
+    TEST_ASSERT_EQUAL_STRING("evil", http_form_get(&form, "xusername", NULL));
+    TEST_ASSERT_EQUAL_STRING("p@ss=1", http_form_get(&form, "password", &length));
+    TEST_ASSERT_EQUAL(6, length);
+    TEST_ASSERT_EQUAL_STRING("", http_form_get(&form, "empty", NULL));
+    TEST_ASSERT_EQUAL_STRING("", http_form_get(&form, "flag", NULL));
+    TEST_ASSERT_EQUAL_STRING("0123456789abcdef0123456789abcdef!", http_form_get(&form, "long", NULL));
+    TEST_ASSERT_NULL(http_form_get(&form, "user", NULL));
+
+    // Decoded in place: values point into the body
+    const char *value = http_form_get(&form, "password", NULL);
+    TEST_ASSERT_TRUE(value > body && value < body + sizeof(body));
+}
+
+void test_http_form_binary_and_malformed_escapes(void) {
+    char body[] = "a=%00x&b=100%&c=%zz%4";
+    http_form_t form;
+    size_t length;
+
+    TEST_ASSERT_EQUAL(0, http_form_parse(&form, body, strlen(body)));
+    const char *a = http_form_get(&form, "a", &length);
+    TEST_ASSERT_EQUAL(2, length);
+    TEST_ASSERT_EQUAL(0, memcmp(a, "\0x", 2));
+    TEST_ASSERT_EQUAL_STRING("100%", http_form_get(&form, "b", NULL));
+    TEST_ASSERT_EQUAL_STRING("%zz%4", http_form_get(&form, "c", NULL));
+}
+
+void test_http_known_headers(void) {
+    const char *request =
+        "GET / HTTP/1.1\r\n"
+        "hOST: example.com\r\n"
+        "X-Trace: abc\r\n"
+        "Cookie: a=1\r\n"
+        "COOKIE: b=2\r\n"
+        "If-None-Match: \"v1\"\r\n"
+        "\r\n";
+
+    http_request_t req;
+    TEST_ASSERT_EQUAL(0, http_parse_request(request, &req));
+
+    TEST_ASSERT_EQUAL(HTTP_HEADER_HOST, http_header_classify("host", 4));
+    TEST_ASSERT_EQUAL(HTTP_HEADER_AUTHORIZATION, http_header_classify("Authorization", 13));
+    TEST_ASSERT_EQUAL(HTTP_HEADER_IF_NONE_MATCH, http_header_classify("if-none-match", 13));
+    TEST_ASSERT_EQUAL(HTTP_HEADER_UNKNOWN, http_header_classify("Hose", 4));
+    TEST_ASSERT_EQUAL(HTTP_HEADER_UNKNOWN, http_header_classify("X-Trace", 7));
+
+    TEST_ASSERT_EQUAL_STRING("example.com", http_get_known_header(&req, HTTP_HEADER_HOST));
+    TEST_ASSERT_EQUAL_STRING("a=1", http_get_known_header(&req, HTTP_HEADER_COOKIE));
+    TEST_ASSERT_EQUAL_STRING("\"v1\"", http_get_header(&req, "if-none-match"));
+    TEST_ASSERT_NULL(http_get_known_header(&req, HTTP_HEADER_AUTHORIZATION));
+    TEST_ASSERT_NULL(http_get_header(&req, "Connection"));
+
+    // Unknown names still come from the list
+    TEST_ASSERT_EQUAL_STRING("abc", http_get_header(&req, "x-trace"));
+
+    http_free_request(&req);
+}
+
+void test_http_head_limits(void) {
+    static char head[MAX_HEADERS * 16 + 2 * MAX_HEADER_SIZE];
+    http_request_t req;
+    size_t length;
+
+    // One header too many
+    length = (size_t) sprintf(head, "GET / HTTP/1.1\r\n");
+    for (int i = 0; i <= MAX_HEADERS; i++) {
+        length += (size_t) sprintf(head + length, "X-%d: %d\r\n", i, i);
+    }
+    strcpy(head + length, "\r\n");
+    TEST_ASSERT_EQUAL(HTTP_HEAD_TOO_LARGE, http_parse_head(head, strlen(head), &req, NULL));
+
+    // Exactly MAX_HEADERS is fine
+    length = (size_t) sprintf(head, "GET / HTTP/1.1\r\n");
+    for (int i = 0; i < MAX_HEADERS; i++) {
+        length += (size_t) sprintf(head + length, "X-%d: %d\r\n", i, i);
+    }
+    strcpy(head + length, "\r\n");
+    TEST_ASSERT_EQUAL(0, http_parse_head(head, strlen(head), &req, NULL));
+    TEST_ASSERT_EQUAL(MAX_HEADERS, req.header_count);
+    http_free_request(&req);
+
+    // A value too long to store
+    length = (size_t) sprintf(head, "GET / HTTP/1.1\r\nX-Long: ");
+    memset(head + length, 'a', MAX_HEADER_SIZE);
+    strcpy(head + length + MAX_HEADER_SIZE, "\r\nContent-Length: 5\r\n\r\n");
+    TEST_ASSERT_EQUAL(HTTP_HEAD_TOO_LARGE, http_parse_head(head, strlen(head), &req, NULL));
+
+    // A name too long to store
+    length = (size_t) sprintf(head, "GET / HTTP/1.1\r\n");
+    memset(head + length, 'a', MAX_HEADER_SIZE);
+    strcpy(head + length + MAX_HEADER_SIZE, ": x\r\n\r\n");
+    TEST_ASSERT_EQUAL(HTTP_HEAD_TOO_LARGE, http_parse_head(head, strlen(head), &req, NULL));
+
+    // A line without a colon is malformed, not the end of the headers
+    const char *no_colon = "POST / HTTP/1.1\r\nbogus\r\nContent-Length: 5\r\n\r\nhello";
+    TEST_ASSERT_EQUAL(-1, http_parse_head(no_colon, strlen(no_colon), &req, NULL));
+}
+
+void test_http_duplicate_content_length(void) {
+    http_request_t req;
+
+    // Two lengths that disagree make the body boundary ambiguous
+    TEST_ASSERT_EQUAL(-1, http_parse_request("POST / HTTP/1.1\r\n"
+                                             "Content-Length: 5\r\n"
+                                             "Content-Length: 50\r\n"
+                                             "\r\n"
+                                             "hello", &req));
+    TEST_ASSERT_EQUAL(-1, http_parse_request("POST / HTTP/1.1\r\n"
+                                             "Content-Length: 5\r\n"
+                                             "X-Other: 1\r\n"
+                                             "content-length: 0\r\n"
+                                             "\r\n"
+                                             "hello", &req));
+
+    // So does a second Transfer-Encoding, even one that only adds identity
+    TEST_ASSERT_EQUAL(-1, http_parse_request("POST / HTTP/1.1\r\n"
+                                             "Transfer-Encoding: chunked\r\n"
+                                             "Transfer-Encoding: identity\r\n"
+                                             "\r\n"
+                                             "5\r\nhello\r\n0\r\n\r\n", &req));
+
+    // Repeating the same value is allowed
+    TEST_ASSERT_EQUAL(0, http_parse_request("POST / HTTP/1.1\r\n"
+                                            "Content-Length: 5\r\n"
+                                            "Content-Length: 5\r\n"
+                                            "\r\n"
+                                            "hello", &req));
+    TEST_ASSERT_EQUAL(5, req.body_length);
+    TEST_ASSERT_EQUAL(0, memcmp(req.body, "hello", 5));
+    http_free_request(&req);
+}
+
 int main(void) {
     UNITY_BEGIN();
 
@@ -112,6 +431,18 @@ int main(void) {
     RUN_TEST(test_http_parse_post_data);
     RUN_TEST(test_http_parse_post_data_url_encoded);
     RUN_TEST(test_http_get_header_case_insensitive);
+    RUN_TEST(test_http_parse_request_arena);
+    RUN_TEST(test_arena_overflow_and_reset);
+    RUN_TEST(test_http_request_alloc_without_arena);
+    RUN_TEST(test_http_body_content_length);
+    RUN_TEST(test_http_body_streamed_chunked);
+    RUN_TEST(test_http_read_body_limits);
+    RUN_TEST(test_http_body_framing_rejected);
+    RUN_TEST(test_http_form_parse);
+    RUN_TEST(test_http_form_binary_and_malformed_escapes);
+    RUN_TEST(test_http_known_headers);
+    RUN_TEST(test_http_head_limits);
+    RUN_TEST(test_http_duplicate_content_length);
 
     return UNITY_END();
 }
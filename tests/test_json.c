@@ -0,0 +1,85 @@
+#include "../include/json.h"
+#include "../vendor/unity/src/unity.h"
+#include <limits.h>
+#include <math.h>
+#include <string.h>
+
+void setUp(void) {
+}
+
+void tearDown(void) {
+}
+
+void test_json_nested_document(void) {
+  char buffer[256];
+  json_writer_t json;
+  size_t length;
+
+  json_init(&json, buffer, sizeof(buffer));
+  json_object_begin(&json);
+  json_key(&json, "ok");
+  json_bool(&json, true);
+  json_key(&json, "items");
+  json_array_begin(&json);
+  json_int(&json, 1);
+  json_int(&json, -42);
+  json_int(&json, LLONG_MIN);
+  json_object_begin(&json);
+  json_object_end(&json);
+  json_null(&json);
+  json_array_end(&json);
+  json_key(&json, "ratio");
+  json_double(&json, 0.5);
+  json_key(&json, "nan");
+  json_double(&json, NAN);
+  json_object_end(&json);
+
+  const char *out = json_finish(&json, &length);
+  TEST_ASSERT_EQUAL_STRING("{\"ok\":true,\"items\":[1,-42,-9223372036854775808,{},null],"
+                           "\"ratio\":0.5,\"nan\":null}",
+                           out);
+  TEST_ASSERT_EQUAL(strlen(out), length);
+}
+
+void test_json_string_escaping(void) {
+  char buffer[256];
+  json_writer_t json;
+
+  // Long enough that the special characters land in and after a 16-byte block
+  json_init(&json, buffer, sizeof(buffer));
+  json_string(&json, "plain text without specials \"quoted\" back\\slash\n\t\x01 caf\xc3\xa9");
+  TEST_ASSERT_EQUAL_STRING(
+      "\"plain text without specials \\\"quoted\\\" back\\\\slash\\n\\t\\u0001 caf\xc3\xa9\"",
+      json_finish(&json, NULL));
+
+  // Embedded NULs are escaped when the length is given
+  json_init(&json, buffer, sizeof(buffer));
+  json_string_n(&json, "a\0b", 3);
+  TEST_ASSERT_EQUAL_STRING("\"a\\u0000b\"", json_finish(&json, NULL));
+}
+
+void test_json_overflow_and_unbalanced(void) {
+  char buffer[8];
+  json_writer_t json;
+
+  json_init(&json, buffer, sizeof(buffer));
+  json_string(&json, "too long for the buffer");
+  TEST_ASSERT_NULL(json_finish(&json, NULL));
+
+  json_init(&json, buffer, sizeof(buffer));
+  json_array_begin(&json);
+  TEST_ASSERT_NULL(json_finish(&json, NULL));
+
+  // Exactly fits, terminator included
+  json_init(&json, buffer, sizeof(buffer));
+  json_string(&json, "12345");
+  TEST_ASSERT_EQUAL_STRING("\"12345\"", json_finish(&json, NULL));
+}
+
+int main(void) {
+  UNITY_BEGIN();
+  RUN_TEST(test_json_nested_document);
+  RUN_TEST(test_json_string_escaping);
+  RUN_TEST(test_json_overflow_and_unbalanced);
+  return UNITY_END();
+}
@@ -0,0 +1,130 @@
+#include "../include/metrics.h"
+#include "../include/router.h"
+#include "../vendor/unity/src/unity.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define RECORDING_THREADS 4
+#define RECORDS_PER_THREAD 1000
+
+static void mock_handler(int client_fd, const http_request_t *request,
+                         const route_params_t *params) {
+  (void) client_fd;
+  (void) request;
+  (void) params;
+}
+
+static double read_answer(void) {
+  return 42;
+}
+
+void setUp(void) {
+  metrics_reset();
+  router_init();
+  router_register("GET", "/", mock_handler);
+  router_register("POST", "/login", mock_handler);
+}
+
+void tearDown(void) {
+}
+
+static void assert_rendered(const char *expected) {
+  char *text = metrics_render(NULL);
+  TEST_ASSERT_NOT_NULL(text);
+  if (!strstr(text, expected)) {
+    TEST_FAIL_MESSAGE(expected);
+  }
+  free(text);
+}
+
+void test_metrics_histogram_per_route_and_status(void) {
+  metrics_record_request(1, 200, 3, 100);
+  metrics_record_request(1, 200, 1500, 50);
+  metrics_record_request(1, 401, 10, 20);
+
+  assert_rendered("http_request_duration_seconds_count{method=\"POST\",route=\"/login\","
+                  "status=\"2xx\"} 2\n");
+  assert_rendered("http_request_duration_seconds_count{method=\"POST\",route=\"/login\","
+                  "status=\"4xx\"} 1\n");
+  assert_rendered("http_request_duration_seconds_sum{method=\"POST\",route=\"/login\","
+                  "status=\"2xx\"} 0.001503\n");
+  assert_rendered("http_response_bytes_total{method=\"POST\",route=\"/login\",status=\"2xx\"} "
+                  "150\n");
+}
+
+void test_metrics_buckets_are_cumulative(void) {
+  metrics_record_request(0, 200, 3, 0);    // Bucket [3, 3]
+  metrics_record_request(0, 200, 1500, 0); // Bucket [1280, 1535]
+
+  assert_rendered("route=\"/\",status=\"2xx\",le=\"0.000003\"} 1\n");
+  assert_rendered("route=\"/\",status=\"2xx\",le=\"0.001279\"} 1\n");
+  assert_rendered("route=\"/\",status=\"2xx\",le=\"0.001535\"} 2\n");
+  assert_rendered("route=\"/\",status=\"2xx\",le=\"+Inf\"} 2\n");
+}
+
+void test_metrics_bucket_bounds_are_inclusive(void) {
+  metrics_record_request(0, 200, 1279, 0); // Last value of [1024, 1280)
+  metrics_record_request(0, 200, 1280, 0); // First value of [1280, 1536)
+
+  assert_rendered("route=\"/\",status=\"2xx\",le=\"0.001023\"} 0\n");
+  assert_rendered("route=\"/\",status=\"2xx\",le=\"0.001279\"} 1\n");
+  assert_rendered("route=\"/\",status=\"2xx\",le=\"0.001535\"} 2\n");
+}
+
+void test_metrics_unmatched_route(void) {
+  metrics_record_request(-1, 404, 5, 9);
+
+  assert_rendered("http_request_duration_seconds_count{method=\"\",route=\"unmatched\","
+                  "status=\"4xx\"} 1\n");
+}
+
+void test_metrics_overflow_counts_only_in_inf(void) {
+  metrics_record_request(0, 500, 100000000ULL, 0); // 100 s, past the last bucket
+
+  assert_rendered("route=\"/\",status=\"5xx\",le=\"+Inf\"} 1\n");
+  assert_rendered("http_request_duration_seconds_count{method=\"GET\",route=\"/\","
+                  "status=\"5xx\"} 1\n");
+}
+
+void test_metrics_registered_callback(void) {
+  TEST_ASSERT_EQUAL(0, metrics_register("answer", "The answer.", METRIC_GAUGE, read_answer));
+
+  assert_rendered("# HELP answer The answer.\n# TYPE answer gauge\nanswer 42\n");
+}
+
+static void *record_requests(void *arg) {
+  (void) arg;
+  for (int i = 0; i < RECORDS_PER_THREAD; i++) {
+    metrics_record_request(0, 200, (uint64_t) i, 1);
+  }
+  return NULL;
+}
+
+void test_metrics_aggregates_threads(void) {
+  pthread_t threads[RECORDING_THREADS];
+  for (int i = 0; i < RECORDING_THREADS; i++) {
+    pthread_create(&threads[i], NULL, record_requests, NULL);
+  }
+  for (int i = 0; i < RECORDING_THREADS; i++) {
+    pthread_join(threads[i], NULL);
+  }
+
+  assert_rendered("http_request_duration_seconds_count{method=\"GET\",route=\"/\","
+                  "status=\"2xx\"} 4000\n");
+  assert_rendered("http_response_bytes_total{method=\"GET\",route=\"/\",status=\"2xx\"} 4000\n");
+}
+
+int main(void) {
+  UNITY_BEGIN();
+
+  RUN_TEST(test_metrics_histogram_per_route_and_status);
+  RUN_TEST(test_metrics_buckets_are_cumulative);
+  RUN_TEST(test_metrics_bucket_bounds_are_inclusive);
+  RUN_TEST(test_metrics_unmatched_route);
+  RUN_TEST(test_metrics_overflow_counts_only_in_inf);
+  RUN_TEST(test_metrics_registered_callback);
+  RUN_TEST(test_metrics_aggregates_threads);
+
+  return UNITY_END();
+}
@@ -0,0 +1,186 @@
+#include "../include/multipart.h"
+#include "../vendor/unity/src/unity.h"
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define CONTENT_TYPE "multipart/form-data; boundary=----XyZ"
+
+// Records what the parser hands out
+typedef struct {
+  int parts;
+  int ended;
+  char names[4][32];
+  char filenames[4][32];
+  char data[4][256];
+  size_t lengths[4];
+} collected_t;
+
+static int on_begin(void *ctx, const multipart_part_t *part) {
+  collected_t *c = (collected_t *) ctx;
+  strcpy(c->names[c->parts], part->name);
+  strcpy(c->filenames[c->parts], part->filename);
+  c->parts++;
+  return 0;
+}
+
+static int on_data(void *ctx, const char *data, size_t length) {
+  collected_t *c = (collected_t *) ctx;
+  int i          = c->parts - 1;
+  memcpy(c->data[i] + c->lengths[i], data, length);
+  c->lengths[i] += length;
+  return 0;
+}
+
+static int on_end(void *ctx) {
+  ((collected_t *) ctx)->ended++;
+  return 0;
+}
+
+static const multipart_callbacks_t callbacks = {on_begin, on_data, on_end};
+
+static const char body[] = "preamble\r\n"
+                           "------XyZ\r\n"
+                           "Content-Disposition: form-data; name=\"title\"\r\n"
+                           "\r\n"
+                           "Hello\r\n--not-a-boundary\r\n"
+                           "------XyZ\r\n"
+                           "Content-Disposition: form-data; name=\"file\"; filename=\"a.bin\"\r\n"
+                           "Content-Type: application/octet-stream\r\n"
+                           "\r\n"
+                           "\x01\x00\x02\r\n----Xy\r\n"
+                           "------XyZ--\r\n"
+                           "epilogue";
+
+void setUp(void) {
+}
+
+void tearDown(void) {
+}
+
+void test_multipart_boundary(void) {
+  char boundary[MULTIPART_BOUNDARY_MAX + 1];
+
+  TEST_ASSERT_EQUAL(0, multipart_boundary(CONTENT_TYPE, boundary, sizeof(boundary)));
+  TEST_ASSERT_EQUAL_STRING("----XyZ", boundary);
+  TEST_ASSERT_EQUAL(0, multipart_boundary("multipart/form-data; charset=utf-8; boundary=\"a b\"",
+                                          boundary, sizeof(boundary)));
+  TEST_ASSERT_EQUAL_STRING("a b", boundary);
+  TEST_ASSERT_EQUAL(-1, multipart_boundary("application/x-www-form-urlencoded", boundary,
+                                           sizeof(boundary)));
+  TEST_ASSERT_EQUAL(-1, multipart_boundary("multipart/form-data", boundary, sizeof(boundary)));
+}
+
+void test_multipart_parse_in_one_feed(void) {
+  multipart_parser_t parser;
+  collected_t c = {0};
+
+  TEST_ASSERT_EQUAL(0, multipart_parser_init(&parser, CONTENT_TYPE, &callbacks, &c));
+  TEST_ASSERT_EQUAL(0, multipart_parser_feed(&parser, body, sizeof(body) - 1));
+  TEST_ASSERT_EQUAL(0, multipart_parser_finish(&parser));
+
+  TEST_ASSERT_EQUAL(2, c.parts);
+  TEST_ASSERT_EQUAL(2, c.ended);
+  TEST_ASSERT_EQUAL_STRING("title", c.names[0]);
+  TEST_ASSERT_EQUAL_STRING("", c.filenames[0]);
+  TEST_ASSERT_EQUAL(23, c.lengths[0]);
+  TEST_ASSERT_EQUAL(0, memcmp(c.data[0], "Hello\r\n--not-a-boundary", 23));
+  TEST_ASSERT_EQUAL_STRING("file", c.names[1]);
+  TEST_ASSERT_EQUAL_STRING("a.bin", c.filenames[1]);
+  TEST_ASSERT_EQUAL(11, c.lengths[1]);
+  TEST_ASSERT_EQUAL(0, memcmp(c.data[1], "\x01\x00\x02\r\n----Xy", 11));
+}
+
+void test_multipart_parse_byte_by_byte(void) {
+  multipart_parser_t parser;
+  collected_t c = {0};
+
+  // Delimiters split across feeds at every possible offset
+  TEST_ASSERT_EQUAL(0, multipart_parser_init(&parser, CONTENT_TYPE, &callbacks, &c));
+  for (size_t i = 0; i < sizeof(body) - 1; i++) {
+    TEST_ASSERT_EQUAL(0, multipart_parser_feed(&parser, body + i, 1));
+  }
+  TEST_ASSERT_EQUAL(0, multipart_parser_finish(&parser));
+
+  TEST_ASSERT_EQUAL(2, c.parts);
+  TEST_ASSERT_EQUAL(23, c.lengths[0]);
+  TEST_ASSERT_EQUAL(11, c.lengths[1]);
+  TEST_ASSERT_EQUAL(0, memcmp(c.data[1], "\x01\x00\x02\r\n----Xy", 11));
+}
+
+void test_multipart_truncated_and_malformed(void) {
+  multipart_parser_t parser;
+  collected_t c = {0};
+
+  TEST_ASSERT_EQUAL(0, multipart_parser_init(&parser, CONTENT_TYPE, &callbacks, &c));
+  TEST_ASSERT_EQUAL(0, multipart_parser_feed(&parser, body, 120));
+  TEST_ASSERT_EQUAL(-1, multipart_parser_finish(&parser));
+
+  const char *no_disposition = "------XyZ\r\nContent-Type: text/plain\r\n\r\nx\r\n------XyZ--";
+  TEST_ASSERT_EQUAL(0, multipart_parser_init(&parser, CONTENT_TYPE, &callbacks, &c));
+  TEST_ASSERT_EQUAL(-1, multipart_parser_feed(&parser, no_disposition, strlen(no_disposition)));
+}
+
+void test_multipart_longest_boundary(void) {
+  multipart_parser_t parser;
+  collected_t c = {0};
+  char boundary[MULTIPART_BOUNDARY_MAX + 1];
+  char content_type[128];
+  char longest[256];
+
+  memset(boundary, 'b', MULTIPART_BOUNDARY_MAX);
+  boundary[MULTIPART_BOUNDARY_MAX] = '\0';
+  snprintf(content_type, sizeof(content_type), "multipart/form-data; boundary=%s", boundary);
+  snprintf(longest, sizeof(longest),
+           "--%s\r\nContent-Disposition: form-data; name=\"a\"\r\n\r\nxyz\r\n--%s--\r\n",
+           boundary, boundary);
+
+  TEST_ASSERT_EQUAL(0, multipart_parser_init(&parser, content_type, &callbacks, &c));
+  TEST_ASSERT_EQUAL(0, multipart_parser_feed(&parser, longest, strlen(longest)));
+  TEST_ASSERT_EQUAL(0, multipart_parser_finish(&parser));
+  TEST_ASSERT_EQUAL(1, c.parts);
+  TEST_ASSERT_EQUAL(1, c.ended);
+  TEST_ASSERT_EQUAL(3, c.lengths[0]);
+  TEST_ASSERT_EQUAL(0, memcmp(c.data[0], "xyz", 3));
+
+  // One more is past the RFC 2046 limit
+  snprintf(content_type, sizeof(content_type), "multipart/form-data; boundary=%sb", boundary);
+  TEST_ASSERT_EQUAL(-1, multipart_parser_init(&parser, content_type, &callbacks, &c));
+}
+
+void test_multipart_spool_spills_to_file(void) {
+  multipart_spool_t spool;
+  char chunk[1000];
+  memset(chunk, 'x', sizeof(chunk));
+
+  multipart_spool_init(&spool, -1);
+  TEST_ASSERT_EQUAL(0, multipart_spool_write(&spool, "small", 5));
+  TEST_ASSERT_NOT_NULL(multipart_spool_data(&spool));
+
+  for (int i = 0; i < 10; i++) {
+    TEST_ASSERT_EQUAL(0, multipart_spool_write(&spool, chunk, sizeof(chunk)));
+  }
+  TEST_ASSERT_NULL(multipart_spool_data(&spool));
+  TEST_ASSERT_TRUE(spool.fd >= 0);
+  TEST_ASSERT_EQUAL(10005, spool.length);
+
+  // Everything written so far is in the file, in order
+  char start[6] = {0};
+  TEST_ASSERT_EQUAL(5, pread(spool.fd, start, 5, 0));
+  TEST_ASSERT_EQUAL_STRING("small", start);
+  TEST_ASSERT_EQUAL(10005, lseek(spool.fd, 0, SEEK_END));
+
+  multipart_spool_close(&spool);
+  TEST_ASSERT_EQUAL(-1, spool.fd);
+}
+
+int main(void) {
+  UNITY_BEGIN();
+  RUN_TEST(test_multipart_boundary);
+  RUN_TEST(test_multipart_parse_in_one_feed);
+  RUN_TEST(test_multipart_parse_byte_by_byte);
+  RUN_TEST(test_multipart_truncated_and_malformed);
+  RUN_TEST(test_multipart_longest_boundary);
+  RUN_TEST(test_multipart_spool_spills_to_file);
+  return UNITY_END();
+}
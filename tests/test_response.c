@@ -0,0 +1,230 @@
+#include "../include/response.h"
+#include "../vendor/unity/src/unity.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define LARGE_BODY_SIZE (1024 * 1024) // Far more than the socket buffers hold
+
+static const char chunked_head[] = "HTTP/1.1 200 OK\r\n"
+                                   "Content-Type: text/plain\r\n"
+                                   "Transfer-Encoding: chunked\r\n"
+                                   "Connection: close\r\n"
+                                   "\r\n";
+
+static int client;
+static connection_t *conn;
+
+// A plain connection on one end of a non-blocking socketpair; the test
+// reads what it sends from the other end
+void setUp(void) {
+  int fds[2];
+  TEST_ASSERT_EQUAL(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+  fcntl(fds[0], F_SETFL, O_NONBLOCK);
+  client = fds[1];
+  conn   = connection_create(fds[0], "127.0.0.1", NULL);
+  TEST_ASSERT_NOT_NULL(conn);
+}
+
+void tearDown(void) {
+  connection_release(conn);
+  close(client);
+}
+
+// Everything sent so far, NUL terminated
+static char *received(size_t *length) {
+  static char data[65536];
+  size_t used = 0;
+  ssize_t n;
+  while ((n = recv(client, data + used, sizeof(data) - 1 - used, MSG_DONTWAIT)) > 0) {
+    used += (size_t) n;
+  }
+  data[used] = '\0';
+  if (length) {
+    *length = used;
+  }
+  return data;
+}
+
+static void fixed_head(char *head, size_t size, long long length) {
+  snprintf(head, size,
+           "HTTP/1.1 200 OK\r\n"
+           "Content-Type: text/plain\r\n"
+           "Content-Length: %lld\r\n"
+           "Connection: close\r\n"
+           "\r\n",
+           length);
+}
+
+void test_response_fixed_length_coalesced(void) {
+  response_t res;
+  char head[128];
+
+  TEST_ASSERT_EQUAL(0, response_begin(&res, conn, "200 OK", "text/plain", NULL, 11));
+  TEST_ASSERT_EQUAL(0, response_write(&res, "hello", 5));
+  TEST_ASSERT_EQUAL(0, response_write(&res, " world", 6));
+
+  // Small writes wait in the write buffer, headers included
+  TEST_ASSERT_EQUAL_STRING("", received(NULL));
+  TEST_ASSERT_EQUAL(0, res.bytes);
+
+  TEST_ASSERT_EQUAL(0, response_end(&res));
+  fixed_head(head, sizeof(head), 11);
+  strcat(head, "hello world");
+  TEST_ASSERT_EQUAL_STRING(head, received(NULL));
+  TEST_ASSERT_EQUAL(strlen(head), res.bytes);
+  TEST_ASSERT_EQUAL(200, conn->log.status);
+  TEST_ASSERT_EQUAL(strlen(head), conn->log.bytes);
+}
+
+void test_response_chunked_framing(void) {
+  response_t res;
+  const char *extra = "Cache-Control: no-store\r\n";
+
+  TEST_ASSERT_EQUAL(0, response_begin(&res, conn, "200 OK", "text/plain", extra,
+                                      RESPONSE_LENGTH_CHUNKED));
+  TEST_ASSERT_EQUAL(0, response_write(&res, "hello", 5));
+  TEST_ASSERT_EQUAL(0, response_flush(&res));
+  TEST_ASSERT_EQUAL_STRING("HTTP/1.1 200 OK\r\n"
+                           "Content-Type: text/plain\r\n"
+                           "Transfer-Encoding: chunked\r\n"
+                           "Cache-Control: no-store\r\n"
+                           "Connection: close\r\n"
+                           "\r\n"
+                           "5\r\nhello\r\n",
+                           received(NULL));
+
+  // Buffered writes go out as one chunk; an empty flush sends nothing
+  TEST_ASSERT_EQUAL(0, response_write(&res, " big", 4));
+  TEST_ASSERT_EQUAL(0, response_write(&res, " world", 6));
+  TEST_ASSERT_EQUAL(0, response_flush(&res));
+  TEST_ASSERT_EQUAL(0, response_flush(&res));
+  TEST_ASSERT_EQUAL_STRING("a\r\n big world\r\n", received(NULL));
+
+  TEST_ASSERT_EQUAL(0, response_end(&res));
+  TEST_ASSERT_EQUAL_STRING("0\r\n\r\n", received(NULL));
+  TEST_ASSERT_EQUAL(-1, response_write(&res, "late", 4));
+}
+
+void test_response_large_write_goes_direct(void) {
+  static char body[CONNECTION_WRITE_BUFFER_SIZE * 2];
+  char expected[sizeof(chunked_head) + sizeof(body) + 32];
+  size_t length;
+  response_t res;
+
+  memset(body, 'x', sizeof(body));
+  TEST_ASSERT_EQUAL(0, response_begin(&res, conn, "200 OK", "text/plain", NULL,
+                                      RESPONSE_LENGTH_CHUNKED));
+  TEST_ASSERT_EQUAL(0, response_write(&res, "ab", 2));
+
+  // Too big to buffer: sent at once, behind what was buffered, in one chunk
+  TEST_ASSERT_EQUAL(0, response_write(&res, body, sizeof(body)));
+  char *data = received(&length);
+  int head   = snprintf(expected, sizeof(expected), "%s%zx\r\nab", chunked_head, sizeof(body) + 2);
+  memcpy(expected + head, body, sizeof(body));
+  memcpy(expected + head + sizeof(body), "\r\n", 2);
+  TEST_ASSERT_EQUAL(head + sizeof(body) + 2, length);
+  TEST_ASSERT_EQUAL_MEMORY(expected, data, length);
+  TEST_ASSERT_EQUAL(0, res.buffered);
+
+  TEST_ASSERT_EQUAL(0, response_end(&res));
+  TEST_ASSERT_EQUAL_STRING("0\r\n\r\n", received(NULL));
+}
+
+void test_response_overrun_fails(void) {
+  response_t res;
+
+  TEST_ASSERT_EQUAL(0, response_begin(&res, conn, "200 OK", "text/plain", NULL, 5));
+  TEST_ASSERT_EQUAL(0, response_write(&res, "abc", 3));
+  TEST_ASSERT_EQUAL(-1, response_write(&res, "def", 3));
+  TEST_ASSERT_TRUE(res.failed);
+
+  // Nothing of a response that broke its own length reaches the client
+  TEST_ASSERT_EQUAL(-1, response_flush(&res));
+  TEST_ASSERT_EQUAL(-1, response_end(&res));
+  TEST_ASSERT_EQUAL_STRING("", received(NULL));
+  TEST_ASSERT_EQUAL(0, conn->log.status);
+}
+
+void test_response_underrun_fails(void) {
+  response_t res;
+  char head[128];
+
+  TEST_ASSERT_EQUAL(0, response_begin(&res, conn, "200 OK", "text/plain", NULL, 10));
+  TEST_ASSERT_EQUAL(0, response_write(&res, "abcde", 5));
+  TEST_ASSERT_EQUAL(-1, response_end(&res));
+
+  // What there was still went out; closing shows the client the truncation
+  fixed_head(head, sizeof(head), 10);
+  strcat(head, "abcde");
+  TEST_ASSERT_EQUAL_STRING(head, received(NULL));
+  TEST_ASSERT_EQUAL(-1, response_end(&res));
+}
+
+typedef struct {
+  char *data;
+  size_t length;
+  size_t expected;
+} reader_t;
+
+// Starts late, so the writer fills the socket and has to wait
+static void *read_slowly(void *arg) {
+  reader_t *reader = (reader_t *) arg;
+  usleep(50000);
+  while (reader->length < reader->expected) {
+    ssize_t n = read(client, reader->data + reader->length, reader->expected - reader->length);
+    if (n <= 0) {
+      break;
+    }
+    reader->length += (size_t) n;
+  }
+  return NULL;
+}
+
+void test_response_resumes_after_partial_write(void) {
+  char head[128];
+  response_t res;
+
+  fixed_head(head, sizeof(head), LARGE_BODY_SIZE);
+  size_t head_length = strlen(head);
+  char *body         = malloc(LARGE_BODY_SIZE);
+  reader_t reader    = {malloc(head_length + LARGE_BODY_SIZE), 0, head_length + LARGE_BODY_SIZE};
+  TEST_ASSERT_NOT_NULL(body);
+  TEST_ASSERT_NOT_NULL(reader.data);
+  for (size_t i = 0; i < LARGE_BODY_SIZE; i++) {
+    body[i] = (char) (i * 7 + i / 251);
+  }
+
+  pthread_t thread;
+  pthread_create(&thread, NULL, read_slowly, &reader);
+  TEST_ASSERT_EQUAL(0, response_begin(&res, conn, "200 OK", "text/plain", NULL, LARGE_BODY_SIZE));
+  TEST_ASSERT_EQUAL(0, response_write(&res, body, LARGE_BODY_SIZE));
+  TEST_ASSERT_EQUAL(0, response_end(&res));
+  pthread_join(thread, NULL);
+
+  // Every byte arrived once and in order
+  TEST_ASSERT_EQUAL(head_length + LARGE_BODY_SIZE, reader.length);
+  TEST_ASSERT_EQUAL(reader.length, res.bytes);
+  TEST_ASSERT_EQUAL_MEMORY(head, reader.data, head_length);
+  TEST_ASSERT_EQUAL_MEMORY(body, reader.data + head_length, LARGE_BODY_SIZE);
+  free(body);
+  free(reader.data);
+}
+
+int main(void) {
+  UNITY_BEGIN();
+
+  RUN_TEST(test_response_fixed_length_coalesced);
+  RUN_TEST(test_response_chunked_framing);
+  RUN_TEST(test_response_large_write_goes_direct);
+  RUN_TEST(test_response_overrun_fails);
+  RUN_TEST(test_response_underrun_fails);
+  RUN_TEST(test_response_resumes_after_partial_write);
+
+  return UNITY_END();
+}
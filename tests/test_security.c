@@ -0,0 +1,189 @@
+#include "../include/security.h"
+#include "../vendor/unity/src/unity.h"
+#include <string.h>
+
+#define SESSION_A "aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa"
+#define SESSION_B "bbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbb"
+
+void setUp(void) {
+  csrf_init();
+}
+
+void tearDown(void) {
+  csrf_set_mode(CSRF_MODE_TABLE);
+}
+
+// Token generation tests
+void test_generate_token_is_base62(void) {
+  char token[SESSION_TOKEN_LENGTH + 1];
+  generate_token(token, SESSION_TOKEN_LENGTH);
+
+  TEST_ASSERT_EQUAL(SESSION_TOKEN_LENGTH, strlen(token));
+  for (size_t i = 0; i < SESSION_TOKEN_LENGTH; i++) {
+    char c = token[i];
+    TEST_ASSERT((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9'));
+  }
+}
+
+void test_generate_token_unique(void) {
+  char a[SESSION_TOKEN_LENGTH + 1];
+  char b[SESSION_TOKEN_LENGTH + 1];
+  generate_token(a, SESSION_TOKEN_LENGTH);
+  generate_token(b, SESSION_TOKEN_LENGTH);
+
+  TEST_ASSERT_NOT_EQUAL(0, strcmp(a, b));
+}
+
+// CSRF table mode tests
+void test_csrf_table_one_time_use(void) {
+  char token[CSRF_TOKEN_LENGTH + 1];
+  strcpy(token, csrf_generate(SESSION_A));
+
+  TEST_ASSERT_TRUE(csrf_validate(token, SESSION_A));
+  TEST_ASSERT_FALSE(csrf_validate(token, SESSION_A));
+}
+
+// CSRF stateless mode tests
+void test_csrf_stateless_validates_once(void) {
+  csrf_set_mode(CSRF_MODE_STATELESS);
+
+  char token[CSRF_STATELESS_TOKEN_LENGTH + 1];
+  strcpy(token, csrf_generate(SESSION_A));
+  TEST_ASSERT_EQUAL(CSRF_STATELESS_TOKEN_LENGTH, strlen(token));
+
+  TEST_ASSERT_TRUE(csrf_validate(token, SESSION_A));
+  TEST_ASSERT_FALSE(csrf_validate(token, SESSION_A));
+}
+
+void test_csrf_stateless_rejects_other_session(void) {
+  csrf_set_mode(CSRF_MODE_STATELESS);
+
+  char token[CSRF_STATELESS_TOKEN_LENGTH + 1];
+  strcpy(token, csrf_generate(SESSION_A));
+
+  TEST_ASSERT_FALSE(csrf_validate(token, SESSION_B));
+  TEST_ASSERT_TRUE(csrf_validate(token, SESSION_A));
+}
+
+void test_csrf_stateless_rejects_tampered_token(void) {
+  csrf_set_mode(CSRF_MODE_STATELESS);
+
+  char token[CSRF_STATELESS_TOKEN_LENGTH + 1];
+  strcpy(token, csrf_generate(SESSION_A));
+  char *c = &token[CSRF_STATELESS_TOKEN_LENGTH / 2];
+  *c       = (*c == 'A') ? 'B' : 'A';
+
+  TEST_ASSERT_FALSE(csrf_validate(token, SESSION_A));
+  TEST_ASSERT_FALSE(csrf_validate("not-a-token", SESSION_A));
+}
+
+void test_csrf_stateless_exceeds_table_capacity(void) {
+  csrf_set_mode(CSRF_MODE_STATELESS);
+
+  // Far more outstanding tokens than the table could hold
+  static char tokens[1000][CSRF_STATELESS_TOKEN_LENGTH + 1];
+  for (int i = 0; i < 1000; i++) {
+    strcpy(tokens[i], csrf_generate(SESSION_A));
+  }
+  for (int i = 0; i < 1000; i++) {
+    TEST_ASSERT_TRUE(csrf_validate(tokens[i], SESSION_A));
+  }
+}
+
+// Connection limit tests
+void test_conn_limit_per_client(void) {
+  conn_limit_init(2, 32);
+
+  TEST_ASSERT_TRUE(conn_limit_acquire(0x0a000001));
+  TEST_ASSERT_TRUE(conn_limit_acquire(0x0a000001));
+  TEST_ASSERT_FALSE(conn_limit_acquire(0x0a000001));
+  TEST_ASSERT_TRUE(conn_limit_acquire(0x0a000002)); // Other clients are unaffected
+  TEST_ASSERT_EQUAL(2, conn_limit_count());
+
+  conn_limit_release(0x0a000001);
+  TEST_ASSERT_TRUE(conn_limit_acquire(0x0a000001));
+
+  conn_limit_release(0x0a000001);
+  conn_limit_release(0x0a000001);
+  conn_limit_release(0x0a000002);
+  TEST_ASSERT_EQUAL(0, conn_limit_count());
+}
+
+void test_conn_limit_prefix_and_disabled(void) {
+  // A /24 counts as one client
+  conn_limit_init(1, 24);
+  TEST_ASSERT_TRUE(conn_limit_acquire(0xc0a80101));
+  TEST_ASSERT_FALSE(conn_limit_acquire(0xc0a801fe));
+  TEST_ASSERT_TRUE(conn_limit_acquire(0xc0a80201));
+
+  conn_limit_init(0, 32);
+  for (int i = 0; i < 1000; i++) {
+    TEST_ASSERT_TRUE(conn_limit_acquire(0x0a000001));
+  }
+  TEST_ASSERT_EQUAL(0, conn_limit_count());
+}
+
+void test_conn_limit_many_clients(void) {
+  conn_limit_init(1, 32);
+
+  // Enough clients to share shards and probe past each other
+  for (uint32_t addr = 1; addr <= 2000; addr++) {
+    TEST_ASSERT_TRUE(conn_limit_acquire(addr));
+  }
+  TEST_ASSERT_EQUAL(2000, conn_limit_count());
+
+  // Closing every other client leaves the rest findable
+  for (uint32_t addr = 1; addr <= 2000; addr += 2) {
+    conn_limit_release(addr);
+  }
+  for (uint32_t addr = 2; addr <= 2000; addr += 2) {
+    TEST_ASSERT_FALSE(conn_limit_acquire(addr));
+  }
+  for (uint32_t addr = 2; addr <= 2000; addr += 2) {
+    conn_limit_release(addr);
+  }
+  TEST_ASSERT_EQUAL(0, conn_limit_count());
+}
+
+void test_conn_limit_one_shard_holds_many_clients(void) {
+  conn_limit_init(1, 32);
+
+  // Addresses chosen so every client lands in the same shard, as a client
+  // controlling its source addresses could arrange
+  uint32_t clients[1024];
+  size_t found = 0;
+  for (uint32_t addr = 1; found < 1024; addr++) {
+    if ((addr * 2654435769u) >> 28 == 0) {
+      clients[found++] = addr;
+    }
+  }
+
+  for (size_t i = 0; i < found; i++) {
+    TEST_ASSERT_TRUE(conn_limit_acquire(clients[i]));
+  }
+  TEST_ASSERT_EQUAL(1024, conn_limit_count());
+  TEST_ASSERT_FALSE(conn_limit_acquire(clients[500]));
+
+  for (size_t i = 0; i < found; i++) {
+    conn_limit_release(clients[i]);
+  }
+  TEST_ASSERT_EQUAL(0, conn_limit_count());
+}
+
+int main(void) {
+  UNITY_BEGIN();
+
+  RUN_TEST(test_generate_token_is_base62);
+  RUN_TEST(test_generate_token_unique);
+  RUN_TEST(test_csrf_table_one_time_use);
+  RUN_TEST(test_csrf_stateless_validates_once);
+  RUN_TEST(test_csrf_stateless_rejects_other_session);
+  RUN_TEST(test_csrf_stateless_rejects_tampered_token);
+  RUN_TEST(test_csrf_stateless_exceeds_table_capacity);
+  RUN_TEST(test_conn_limit_per_client);
+  RUN_TEST(test_conn_limit_prefix_and_disabled);
+  RUN_TEST(test_conn_limit_many_clients);
+  RUN_TEST(test_conn_limit_one_shard_holds_many_clients);
+
+  return UNITY_END();
+}
@@ -0,0 +1,372 @@
+#include "../include/tls.h"
+#include "../vendor/unity/src/unity.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define CERT_FILE TEST_CERT_DIR "/cert.pem"
+#define KEY_FILE TEST_CERT_DIR "/key.pem"
+#define PUMP_ROUNDS 100      // Handshake round trips before giving up
+#define TLS_TEST_CHUNK 16384 // One full record
+
+// A server connection driven through tls.c and a plain OpenSSL client, on
+// the two ends of a non-blocking socketpair
+typedef struct {
+  SSL *server;
+  SSL *client;
+  int fds[2];
+} tls_pair_t;
+
+static SSL_CTX *server_ctx;
+static SSL_CTX *client_ctx;
+
+void setUp(void) {
+  server_ctx = tls_create_context(CERT_FILE, KEY_FILE);
+  client_ctx = SSL_CTX_new(TLS_client_method());
+}
+
+void tearDown(void) {
+  SSL_CTX_free(client_ctx);
+  tls_cleanup_context(server_ctx);
+}
+
+static void pair_open(tls_pair_t *pair, SSL_CTX *ctx, SSL_SESSION *session) {
+  TEST_ASSERT_EQUAL(0, socketpair(AF_UNIX, SOCK_STREAM, 0, pair->fds));
+  fcntl(pair->fds[0], F_SETFL, O_NONBLOCK);
+  fcntl(pair->fds[1], F_SETFL, O_NONBLOCK);
+
+  pair->server = tls_new_connection(server_ctx, pair->fds[0]);
+  pair->client = SSL_new(ctx);
+  TEST_ASSERT_NOT_NULL(pair->server);
+  TEST_ASSERT_NOT_NULL(pair->client);
+  SSL_set_fd(pair->client, pair->fds[1]);
+  SSL_set_connect_state(pair->client);
+  if (session) {
+    SSL_set_session(pair->client, session);
+  }
+}
+
+// Step both sides until the handshake completes; returns the server's status
+static tls_io_status_t pair_handshake(tls_pair_t *pair) {
+  tls_io_status_t server = TLS_IO_WANT_READ;
+  bool client_done       = false;
+
+  for (int round = 0; round < PUMP_ROUNDS && !(server == TLS_IO_DONE && client_done); round++) {
+    if (!client_done) {
+      int ret = SSL_do_handshake(pair->client);
+      int err = SSL_get_error(pair->client, ret);
+      if (ret != 1 && err != SSL_ERROR_WANT_READ && err != SSL_ERROR_WANT_WRITE) {
+        ERR_clear_error();
+        break;
+      }
+      client_done = ret == 1;
+    }
+    if (server != TLS_IO_DONE) {
+      server = tls_handshake(pair->server);
+      if (server == TLS_IO_ERROR) {
+        break;
+      }
+    }
+  }
+  return server;
+}
+
+// Send a byte from the server so the client processes whatever followed the
+// handshake (TLS 1.3 tickets arrive after it)
+static void pair_settle(tls_pair_t *pair) {
+  size_t written = 0;
+  char byte;
+  TEST_ASSERT_EQUAL(TLS_IO_DONE, tls_write_nonblock(pair->server, "x", 1, &written));
+  TEST_ASSERT_EQUAL(1, SSL_read(pair->client, &byte, 1));
+}
+
+static void pair_close(tls_pair_t *pair) {
+  SSL_shutdown(pair->client); // Sessions of connections freed without one cannot resume
+  SSL_free(pair->client);
+  tls_close(pair->server);
+  close(pair->fds[0]);
+  close(pair->fds[1]);
+}
+
+// Full handshake, returning the client's session for resumption
+static SSL_SESSION *first_session(SSL_CTX *ctx) {
+  tls_pair_t pair;
+  pair_open(&pair, ctx, NULL);
+  TEST_ASSERT_EQUAL(TLS_IO_DONE, pair_handshake(&pair));
+  pair_settle(&pair);
+  TEST_ASSERT_FALSE(SSL_session_reused(pair.client));
+
+  SSL_SESSION *session = SSL_get1_session(pair.client);
+  pair_close(&pair);
+  TEST_ASSERT_NOT_NULL(session);
+  return session;
+}
+
+// Reconnect with session; returns whether the server resumed it
+static bool resumes(SSL_CTX *ctx, SSL_SESSION *session) {
+  tls_pair_t pair;
+  pair_open(&pair, ctx, session);
+  TEST_ASSERT_EQUAL(TLS_IO_DONE, pair_handshake(&pair));
+  pair_settle(&pair);
+
+  bool reused = SSL_session_reused(pair.client);
+  TEST_ASSERT_EQUAL(reused, SSL_session_reused(pair.server));
+  pair_close(&pair);
+  return reused;
+}
+
+void test_tls_ticket_resumes_session(void) {
+  tls_stats_t before, after;
+  SSL_SESSION *session = first_session(client_ctx);
+
+  tls_get_stats(&before);
+  TEST_ASSERT_TRUE(resumes(client_ctx, session));
+  tls_get_stats(&after);
+  TEST_ASSERT_EQUAL(before.resumed_handshakes + 1, after.resumed_handshakes);
+  TEST_ASSERT_EQUAL(before.full_handshakes, after.full_handshakes);
+
+  SSL_SESSION_free(session);
+}
+
+void test_tls_ticket_key_rotation(void) {
+  SSL_SESSION *session = first_session(client_ctx);
+
+  // One rotation: the ticket's key is now the previous one and still works
+  TEST_ASSERT_EQUAL(0, tls_rotate_ticket_keys());
+  TEST_ASSERT_TRUE(resumes(client_ctx, session));
+
+  // Two rotations: the key is gone, so a full handshake is needed
+  TEST_ASSERT_EQUAL(0, tls_rotate_ticket_keys());
+  TEST_ASSERT_EQUAL(0, tls_rotate_ticket_keys());
+  TEST_ASSERT_FALSE(resumes(client_ctx, session));
+
+  SSL_SESSION_free(session);
+}
+
+void test_tls_session_cache_without_tickets(void) {
+  // TLS 1.2 clients that refuse tickets resume by session ID
+  SSL_CTX *ctx = SSL_CTX_new(TLS_client_method());
+  SSL_CTX_set_max_proto_version(ctx, TLS1_2_VERSION);
+  SSL_CTX_set_options(ctx, SSL_OP_NO_TICKET);
+
+  SSL_SESSION *session = first_session(ctx);
+  TEST_ASSERT_FALSE(SSL_SESSION_has_ticket(session));
+  TEST_ASSERT_TRUE(resumes(ctx, session));
+
+  // Another context has another cache
+  tls_cleanup_context(server_ctx);
+  server_ctx = tls_create_context(CERT_FILE, KEY_FILE);
+  TEST_ASSERT_FALSE(resumes(ctx, session));
+
+  SSL_SESSION_free(session);
+  SSL_CTX_free(ctx);
+}
+
+void test_tls_handshake_waits_for_client(void) {
+  tls_stats_t before, after;
+  tls_pair_t pair;
+  tls_get_stats(&before);
+  pair_open(&pair, client_ctx, NULL);
+
+  // Nothing sent yet: the server must ask to be called again, not block
+  TEST_ASSERT_EQUAL(TLS_IO_WANT_READ, tls_handshake(pair.server));
+  TEST_ASSERT_EQUAL(TLS_IO_WANT_READ, tls_handshake(pair.server));
+
+  TEST_ASSERT_EQUAL(TLS_IO_DONE, pair_handshake(&pair));
+  tls_get_stats(&after);
+  TEST_ASSERT_EQUAL(before.full_handshakes + 1, after.full_handshakes);
+  TEST_ASSERT_EQUAL(before.active_connections + 1, after.active_connections);
+
+  pair_close(&pair);
+  tls_get_stats(&after);
+  TEST_ASSERT_EQUAL(before.active_connections, after.active_connections);
+}
+
+void test_tls_handshake_rejects_plain_http(void) {
+  tls_stats_t before, after;
+  tls_pair_t pair;
+  const char *request = "GET / HTTP/1.1\r\nHost: localhost\r\n\r\n";
+  tls_get_stats(&before);
+  pair_open(&pair, client_ctx, NULL);
+
+  TEST_ASSERT_EQUAL((ssize_t) strlen(request), write(pair.fds[1], request, strlen(request)));
+  TEST_ASSERT_EQUAL(TLS_IO_ERROR, tls_handshake(pair.server));
+  ERR_clear_error();
+  tls_get_stats(&after);
+  TEST_ASSERT_EQUAL(before.failed_handshakes + 1, after.failed_handshakes);
+
+  pair_close(&pair);
+}
+
+void test_tls_nonblocking_read_and_write(void) {
+  tls_pair_t pair;
+  char buffer[TLS_TEST_CHUNK];
+  size_t length = 0;
+  pair_open(&pair, client_ctx, NULL);
+  TEST_ASSERT_EQUAL(TLS_IO_DONE, pair_handshake(&pair));
+
+  TEST_ASSERT_EQUAL(TLS_IO_WANT_READ,
+                    tls_read_nonblock(pair.server, buffer, sizeof(buffer), &length));
+  TEST_ASSERT_EQUAL(4, SSL_write(pair.client, "ping", 4));
+  TEST_ASSERT_EQUAL(TLS_IO_DONE, tls_read_nonblock(pair.server, buffer, sizeof(buffer), &length));
+  TEST_ASSERT_EQUAL(4, length);
+  TEST_ASSERT_EQUAL_MEMORY("ping", buffer, 4);
+
+  // Fill the socket until the server has to wait, then retry the same write
+  // once the client has read some of it
+  memset(buffer, 'a', sizeof(buffer));
+  tls_io_status_t status = TLS_IO_DONE;
+  for (int i = 0; i < 1000 && status == TLS_IO_DONE; i++) {
+    status = tls_write_nonblock(pair.server, buffer, sizeof(buffer), &length);
+  }
+  TEST_ASSERT_EQUAL(TLS_IO_WANT_WRITE, status);
+
+  char sink[TLS_TEST_CHUNK];
+  while (SSL_read(pair.client, sink, sizeof(sink)) > 0) {
+  }
+  ERR_clear_error();
+  TEST_ASSERT_EQUAL(TLS_IO_DONE, tls_write_nonblock(pair.server, buffer, sizeof(buffer), &length));
+  TEST_ASSERT_EQUAL(sizeof(buffer), length);
+
+  // close_notify from the client ends the stream cleanly
+  SSL_shutdown(pair.client);
+  while ((status = tls_read_nonblock(pair.server, buffer, sizeof(buffer), &length)) ==
+         TLS_IO_DONE) {
+  }
+  TEST_ASSERT_EQUAL(TLS_IO_CLOSED, status);
+
+  pair_close(&pair);
+}
+
+// Read exactly length bytes on the client side; returns the SSL_read calls
+// it took, one per record at most
+static int client_read_all(SSL *client, char *out, size_t length) {
+  size_t received = 0;
+  int reads       = 0;
+  for (int round = 0; received < length && round < PUMP_ROUNDS * 10; round++) {
+    int n = SSL_read(client, out + received, (int) (length - received));
+    if (n > 0) {
+      received += (size_t) n;
+      reads++;
+    }
+  }
+  TEST_ASSERT_EQUAL(length, received);
+  return reads;
+}
+
+void test_tls_writev_coalesces_small_buffers(void) {
+  tls_pair_t pair;
+  pair_open(&pair, client_ctx, NULL);
+  TEST_ASSERT_EQUAL(TLS_IO_DONE, pair_handshake(&pair));
+  TEST_ASSERT_FALSE(tls_ktls_send_enabled(pair.server)); // No kTLS on AF_UNIX
+
+  // More pieces than one writev() batch, all small: a single record
+  struct iovec iov[24];
+  char expected[sizeof(iov) / sizeof(iov[0]) * 8];
+  for (size_t i = 0; i < sizeof(iov) / sizeof(iov[0]); i++) {
+    memset(expected + i * 8, 'a' + (int) i, 8);
+    iov[i] = (struct iovec) {expected + i * 8, 8};
+  }
+  TEST_ASSERT_EQUAL(sizeof(expected), tls_writev(pair.server, iov, 24));
+
+  char received[sizeof(expected)];
+  TEST_ASSERT_EQUAL(1, client_read_all(pair.client, received, sizeof(received)));
+  TEST_ASSERT_EQUAL_MEMORY(expected, received, sizeof(expected));
+
+  pair_close(&pair);
+}
+
+void test_tls_writev_large_body(void) {
+  static char body[TLS_TEST_CHUNK + 4000];
+  static char received[sizeof(body) + 64];
+  const char *head = "HTTP/1.1 200 OK\r\n\r\n";
+  tls_pair_t pair;
+  pair_open(&pair, client_ctx, NULL);
+  TEST_ASSERT_EQUAL(TLS_IO_DONE, pair_handshake(&pair));
+
+  for (size_t i = 0; i < sizeof(body); i++) {
+    body[i] = (char) (i * 31);
+  }
+  struct iovec iov[] = {{(void *) head, strlen(head)}, {body, sizeof(body)}, {"end", 3}};
+  size_t total       = strlen(head) + sizeof(body) + 3;
+  TEST_ASSERT_EQUAL(total, tls_writev(pair.server, iov, 3));
+
+  client_read_all(pair.client, received, total);
+  TEST_ASSERT_EQUAL_MEMORY(head, received, strlen(head));
+  TEST_ASSERT_EQUAL_MEMORY(body, received + strlen(head), sizeof(body));
+  TEST_ASSERT_EQUAL_MEMORY("end", received + strlen(head) + sizeof(body), 3);
+
+  pair_close(&pair);
+}
+
+void test_tls_memory_counts_only_connections(void) {
+  tls_stats_t start, stats;
+  tls_pair_t pair;
+
+  // Cached sessions would outlive the connection that made them
+  SSL_CTX_set_session_cache_mode(server_ctx, SSL_SESS_CACHE_OFF);
+
+  // The first handshake also sets up state OpenSSL keeps for the life of the
+  // process (fetched algorithms and the like)
+  pair_open(&pair, client_ctx, NULL);
+  TEST_ASSERT_EQUAL(TLS_IO_DONE, pair_handshake(&pair));
+  pair_close(&pair);
+  tls_get_stats(&start);
+
+  // OpenSSL use outside a connection (scrypt, HMACs) is neither counted nor
+  // served from the pool, even at record buffer size
+  void *scratch = OPENSSL_malloc(TLS_TEST_CHUNK + 1000);
+  TEST_ASSERT_NOT_NULL(scratch);
+  tls_get_stats(&stats);
+  TEST_ASSERT_EQUAL(start.memory_in_use, stats.memory_in_use);
+  OPENSSL_free(scratch);
+  tls_get_stats(&stats);
+  TEST_ASSERT_EQUAL(start.pooled_buffers, stats.pooled_buffers);
+
+  pair_open(&pair, client_ctx, NULL);
+  TEST_ASSERT_EQUAL(TLS_IO_DONE, pair_handshake(&pair));
+  pair_settle(&pair);
+  tls_get_stats(&stats);
+  TEST_ASSERT_GREATER_THAN(start.memory_in_use, stats.memory_in_use);
+
+  // Closing gives everything back; the record buffers wait in the pool
+  pair_close(&pair);
+  tls_get_stats(&stats);
+  TEST_ASSERT_EQUAL(start.memory_in_use, stats.memory_in_use);
+  TEST_ASSERT_GREATER_THAN(0, stats.pooled_buffers);
+
+  // The next connection reuses them instead of adding more
+  size_t pooled = stats.pooled_buffers;
+  pair_open(&pair, client_ctx, NULL);
+  TEST_ASSERT_EQUAL(TLS_IO_DONE, pair_handshake(&pair));
+  pair_settle(&pair);
+  pair_close(&pair);
+  tls_get_stats(&stats);
+  TEST_ASSERT_EQUAL(pooled, stats.pooled_buffers);
+  TEST_ASSERT_EQUAL(start.memory_in_use, stats.memory_in_use);
+}
+
+int main(void) {
+  // Before anything else touches OpenSSL
+  if (!tls_use_buffer_pool()) {
+    fprintf(stderr, "Failed to install the TLS buffer pool\n");
+    return 1;
+  }
+  tls_init();
+
+  UNITY_BEGIN();
+
+  RUN_TEST(test_tls_memory_counts_only_connections);
+  RUN_TEST(test_tls_ticket_resumes_session);
+  RUN_TEST(test_tls_ticket_key_rotation);
+  RUN_TEST(test_tls_session_cache_without_tickets);
+  RUN_TEST(test_tls_handshake_waits_for_client);
+  RUN_TEST(test_tls_handshake_rejects_plain_http);
+  RUN_TEST(test_tls_nonblocking_read_and_write);
+  RUN_TEST(test_tls_writev_coalesces_small_buffers);
+  RUN_TEST(test_tls_writev_large_body);
+
+  return UNITY_END();
+}
@@ -0,0 +1,138 @@
+#include "../include/trace.h"
+#include "../vendor/unity/src/unity.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define START_NS 1000000000ULL // Any non-zero monotonic time
+
+static char log_path[] = "/tmp/test_slow_log.XXXXXX";
+static const access_log_entry_t entry = {
+    .timestamp = 0, .status = 200, .method = "GET", .path = "/slow", .client_ip = "10.0.0.1"};
+
+void setUp(void) {
+  TEST_ASSERT_EQUAL(0, truncate(log_path, 0));
+  TEST_ASSERT_EQUAL(0, trace_init(log_path, 500));
+}
+
+void tearDown(void) {
+  trace_shutdown();
+}
+
+static char *read_log(void) {
+  static char data[65536];
+  FILE *file = fopen(log_path, "r");
+  TEST_ASSERT_NOT_NULL(file);
+  size_t length = fread(data, 1, sizeof(data) - 1, file);
+  data[length]  = '\0';
+  fclose(file);
+  return data;
+}
+
+// Mark stage at offset_ms after accept
+static void mark_at(trace_t *trace, trace_stage_t stage, unsigned offset_ms) {
+  trace->ns[stage] = START_NS + MS_TO_NS(offset_ms);
+}
+
+void test_trace_slow_request_breakdown(void) {
+  trace_t trace = {0};
+  mark_at(&trace, TRACE_ACCEPTED, 0);
+  mark_at(&trace, TRACE_QUEUED, 1);
+  mark_at(&trace, TRACE_WORKER_START, 3);
+  mark_at(&trace, TRACE_READ_DONE, 4);
+  mark_at(&trace, TRACE_PARSED, 4);
+  mark_at(&trace, TRACE_MIDDLEWARE_DONE, 5);
+  mark_at(&trace, TRACE_RESPONSE_START, 505);
+  mark_at(&trace, TRACE_RESPONSE_SENT, 506);
+  mark_at(&trace, TRACE_HANDLER_DONE, 507);
+  mark_at(&trace, TRACE_CLOSED, 510);
+  trace_finish(&trace, &entry);
+
+  // No handshake on plain HTTP, so no handshake stage
+  TEST_ASSERT_EQUAL_STRING("time=1970-01-01T00:00:00Z ip=10.0.0.1 method=GET path=\"/slow\" "
+                           "status=200 total_us=510000 request_wait_us=1000 queue_us=2000 "
+                           "read_us=1000 parse_us=0 middleware_us=1000 handler_us=500000 "
+                           "write_us=1000 handler_return_us=1000 close_us=3000\n",
+                           read_log());
+}
+
+void test_trace_async_handler_returns_before_response(void) {
+  trace_t trace = {0};
+  mark_at(&trace, TRACE_ACCEPTED, 0);
+  mark_at(&trace, TRACE_HANDLER_DONE, 1);
+  mark_at(&trace, TRACE_RESPONSE_START, 600);
+  mark_at(&trace, TRACE_RESPONSE_SENT, 601);
+  mark_at(&trace, TRACE_CLOSED, 601);
+  trace_finish(&trace, &entry);
+
+  TEST_ASSERT_NOT_NULL(strstr(read_log(), " total_us=601000 handler_return_us=1000 "
+                                          "handler_us=599000 write_us=1000 close_us=0\n"));
+}
+
+void test_trace_fast_and_unfinished_requests_skipped(void) {
+  trace_t fast = {0};
+  mark_at(&fast, TRACE_ACCEPTED, 0);
+  mark_at(&fast, TRACE_CLOSED, 499);
+  trace_finish(&fast, &entry);
+
+  trace_t unfinished = {0};
+  mark_at(&unfinished, TRACE_ACCEPTED, 0);
+  mark_at(&unfinished, TRACE_RESPONSE_SENT, 900);
+  trace_finish(&unfinished, &entry);
+
+  TEST_ASSERT_EQUAL_STRING("", read_log());
+
+  // A threshold of 0 turns the log off
+  trace_shutdown();
+  TEST_ASSERT_EQUAL(0, trace_init(log_path, 0));
+  mark_at(&fast, TRACE_CLOSED, 5000);
+  trace_finish(&fast, &entry);
+  TEST_ASSERT_EQUAL_STRING("", read_log());
+}
+
+// Must run last: uses up the budget of the current second
+void test_trace_samples_per_second(void) {
+  trace_t trace = {0};
+  mark_at(&trace, TRACE_ACCEPTED, 0);
+  mark_at(&trace, TRACE_CLOSED, 1000);
+
+  // Start at the top of a second so the budget resets once at most
+  time_t second = time(NULL);
+  while (time(NULL) == second) {
+    usleep(1000);
+  }
+  second = time(NULL);
+  for (int i = 0; i < TRACE_SLOW_PER_SECOND * 3; i++) {
+    trace_finish(&trace, &entry);
+  }
+  if (time(NULL) != second) {
+    TEST_IGNORE_MESSAGE("Crossed a second boundary");
+  }
+
+  int lines = 0;
+  for (const char *p = read_log(); (p = strchr(p, '\n')); p++) {
+    lines++;
+  }
+  TEST_ASSERT_EQUAL(TRACE_SLOW_PER_SECOND, lines);
+}
+
+int main(void) {
+  int fd = mkstemp(log_path);
+  if (fd < 0) {
+    perror("mkstemp");
+    return 1;
+  }
+  close(fd);
+
+  UNITY_BEGIN();
+
+  RUN_TEST(test_trace_slow_request_breakdown);
+  RUN_TEST(test_trace_async_handler_returns_before_response);
+  RUN_TEST(test_trace_fast_and_unfinished_requests_skipped);
+  RUN_TEST(test_trace_samples_per_second);
+
+  int failures = UNITY_END();
+  unlink(log_path);
+  return failures;
+}